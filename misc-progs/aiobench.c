@@ -0,0 +1,217 @@
+/*
+ * aiobench.c -- random AIO against a scull device at rising queue depths
+ *
+ * The same job as
+ *
+ *	fio --name=scull --filename=/dev/scull0 --ioengine=libaio \
+ *	    --rw=randread --bs=4k --size=64m --iodepth=N
+ *
+ * for N = 1, 2, 4 ... 64, without needing fio or libaio: the device is
+ * filled with "size" megabytes (unless -n is given), then for each depth
+ * "count" reads (or writes, with -w) of "bs" bytes at random offsets are
+ * kept that many deep in flight with io_submit()/io_getevents(). Each
+ * depth reports IOPS and the mean, median and 99th percentile latency
+ * from submission to completion. Load the module with aio=1 to have
+ * requests actually queued; without it every io_submit() completes
+ * its request before returning. With -S the offsets run sequentially
+ * (fio's --rw=read), so requests in flight together are contiguous and
+ * the driver can batch them.
+ *
+ *	aiobench [-nwS] [-s size_mb] [-b bs] [-c count] [-d maxdepth] [device]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static long long rand_off(long long size, long bs)
+{
+	/* keep the blocks aligned, as fio does */
+	return (((long long)random() << 16 ^ random()) % (size / bs)) * bs;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scull0";
+	long size_mb = 64, bs = 4096, count = 20000, maxdepth = 64, i;
+	int opt, fill = 1, writing = 0, sequential = 0, fd;
+	long long size, next_off;
+	char *buf;
+	double start, elapsed;
+
+	while ((opt = getopt(argc, argv, "nwSs:b:c:d:")) != -1) {
+		switch (opt) {
+		case 'n': fill = 0; break;
+		case 'w': writing = 1; break;
+		case 'S': sequential = 1; break;
+		case 's': size_mb = atol(optarg); break;
+		case 'b': bs = atol(optarg); break;
+		case 'c': count = atol(optarg); break;
+		case 'd': maxdepth = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-nwS] [-s size_mb] [-b bs] [-c count] "
+				"[-d maxdepth] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	size = (long long)size_mb << 20;
+	if (bs <= 0 || size < bs || count <= 0 || maxdepth <= 0) {
+		fprintf(stderr, "%s: bad size, block size, count or depth\n", argv[0]);
+		exit(1);
+	}
+
+	buf = malloc(bs * maxdepth > (1 << 20) ? bs * maxdepth : (1 << 20));
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if (fill) {
+		/* opening write-only trims the device first */
+		fd = open(device, O_WRONLY);
+		if (fd < 0) {
+			perror(device);
+			exit(1);
+		}
+		memset(buf, 0x5a, 1 << 20);
+		for (i = 0; i < size_mb; i++) {
+			long done = 0;
+			while (done < (1 << 20)) {
+				ssize_t n = write(fd, buf + done, (1 << 20) - done);
+				if (n <= 0) {
+					perror("write");
+					exit(1);
+				}
+				done += n;
+			}
+		}
+		close(fd);
+	}
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	printf("%s %ld-byte %s %s over %ld MB\n", device, bs,
+	       sequential ? "sequential" : "random", writing ? "writes" : "reads", size_mb);
+	printf("%6s %10s %10s %10s %10s\n", "depth", "IOPS", "mean us", "p50 us", "p99 us");
+
+	for (long depth = 1; depth <= maxdepth; depth *= 2) {
+		struct iocb *cbs = calloc(depth, sizeof(*cbs));
+		struct iocb **ptrs = calloc(depth, sizeof(*ptrs));
+		struct io_event *events = calloc(depth, sizeof(*events));
+		double *submitted = calloc(depth, sizeof(*submitted));
+		double *lat = calloc(count, sizeof(*lat));
+		aio_context_t ctx = 0;
+		long issued = 0, completed = 0, ready = 0;
+		double sum = 0;
+
+		if (!cbs || !ptrs || !events || !submitted || !lat) {
+			perror("calloc");
+			exit(1);
+		}
+		if (syscall(SYS_io_setup, depth, &ctx) < 0) {
+			perror("io_setup");
+			exit(1);
+		}
+
+		srandom(1);
+		next_off = 0;
+		start = now();
+		/* slots 0..depth-1 each hold one request at a time */
+		for (i = 0; i < depth && i < count; i++)
+			ptrs[ready++] = &cbs[i];
+		while (completed < count) {
+			long n;
+
+			for (i = 0; i < ready; i++) {
+				struct iocb *cb = ptrs[i];
+				long slot = cb - cbs;
+
+				memset(cb, 0, sizeof(*cb));
+				cb->aio_fildes = fd;
+				cb->aio_lio_opcode = writing ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+				cb->aio_buf = (unsigned long)(buf + slot * bs);
+				cb->aio_nbytes = bs;
+				if (sequential) {
+					cb->aio_offset = next_off;
+					next_off = (next_off + bs) % (size / bs * bs);
+				} else {
+					cb->aio_offset = rand_off(size, bs);
+				}
+				cb->aio_data = slot;
+				submitted[slot] = now();
+			}
+			if (ready) {
+				n = syscall(SYS_io_submit, ctx, ready, ptrs);
+				if (n != ready) {
+					fprintf(stderr, "io_submit: %s\n",
+						n < 0 ? strerror(errno) : "short submit");
+					exit(1);
+				}
+				issued += ready;
+			}
+			n = syscall(SYS_io_getevents, ctx, 1, depth, events, NULL);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("io_getevents");
+				exit(1);
+			}
+			ready = 0;
+			for (i = 0; i < n; i++) {
+				long slot = events[i].data;
+
+				if (events[i].res != bs) {
+					fprintf(stderr, "request at %lld: %s\n",
+						(long long)cbs[slot].aio_offset,
+						events[i].res < 0 ? strerror(-events[i].res)
+								  : "short transfer");
+					exit(1);
+				}
+				lat[completed] = (now() - submitted[slot]) * 1e6;
+				sum += lat[completed++];
+				if (issued + ready < count)
+					ptrs[ready++] = &cbs[slot];
+			}
+		}
+		elapsed = now() - start;
+		syscall(SYS_io_destroy, ctx);
+
+		qsort(lat, count, sizeof(*lat), cmp_double);
+		printf("%6ld %10.0f %10.1f %10.1f %10.1f\n", depth, count / elapsed,
+		       sum / count, lat[count / 2], lat[count * 99 / 100]);
+		free(cbs);
+		free(ptrs);
+		free(events);
+		free(submitted);
+		free(lat);
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * clonebench.c -- open() latency of /dev/scullpriv with many clones
+ *
+ * scullpriv keeps one device per controlling terminal. This grows the
+ * number of clones in steps (10, 100, 1000 ... up to "count") and at
+ * each step times "samples" opens of existing clones, picked at
+ * random, reporting the mean, median and 99th percentile. With a
+ * lookup that scales, the numbers stay flat as the clones multiply.
+ *
+ *	clonebench [-n count] [-s samples] [device]
+ *
+ * Each clone needs a terminal of its own, so the program allocates a
+ * pseudo-terminal per clone and, as a session leader, makes each one
+ * its controlling terminal in turn (TIOCSCTTY, then TIOCNOTTY). It
+ * keeps every pty and one descriptor per clone open, since a clone is
+ * freed when its last opener closes it: that is three descriptors per
+ * clone (raise the limit, as root, if need be) and as many ptys as
+ * clones, so 10000 needs kernel.pty.max raised above its default 4096.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Make "tty" our controlling terminal, in place of the current one */
+static void become(int tty, int *current)
+{
+	if (*current >= 0 && ioctl(*current, TIOCNOTTY) < 0) {
+		perror("TIOCNOTTY");
+		exit(1);
+	}
+	if (ioctl(tty, TIOCSCTTY, 0) < 0) {
+		perror("TIOCSCTTY");
+		exit(1);
+	}
+	*current = tty;
+}
+
+static int bench(const char *device, long count, long samples)
+{
+	int *ttys = calloc(count, sizeof(int)), *clones = calloc(count, sizeof(int));
+	double *lat = calloc(samples, sizeof(double)), start, sum;
+	int current = -1;
+	long made = 0, had, step, i;
+
+	if (!ttys || !clones || !lat) {
+		perror("calloc");
+		return 1;
+	}
+	/* losing a controlling terminal hangs up its foreground group: us */
+	signal(SIGHUP, SIG_IGN);
+
+	printf("%8s %10s %10s %10s %10s\n", "clones", "create us", "open us",
+	       "p50 us", "p99 us");
+	for (step = 10; ; step = step * 10 > count ? count : step * 10) {
+		/* grow to "step" clones, each held open through its own tty */
+		had = made;
+		start = now();
+		for (; made < step; made++) {
+			/* the master stays open too, or the slave is hung up */
+			int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+			if (master < 0 || grantpt(master) || unlockpt(master)) {
+				perror("posix_openpt");
+				return 1;
+			}
+			ttys[made] = open(ptsname(master), O_RDWR | O_NOCTTY);
+			if (ttys[made] < 0) {
+				perror(ptsname(master));
+				return 1;
+			}
+			become(ttys[made], &current);
+			clones[made] = open(device, O_RDONLY);
+			if (clones[made] < 0) {
+				perror(device);
+				return 1;
+			}
+		}
+		sum = now() - start;
+
+		/* then time opens of clones that already exist */
+		srandom(step);
+		for (i = 0; i < samples; i++) {
+			int fd;
+
+			become(ttys[random() % made], &current);
+			start = now();
+			fd = open(device, O_RDONLY);
+			lat[i] = (now() - start) * 1e6;
+			if (fd < 0) {
+				perror(device);
+				return 1;
+			}
+			close(fd); /* ours isn't the last reference */
+		}
+		qsort(lat, samples, sizeof(double), cmp_double);
+		for (start = 0, i = 0; i < samples; i++)
+			start += lat[i];
+		printf("%8ld %10.1f %10.2f %10.2f %10.2f\n", made,
+		       sum * 1e6 / (made - had),
+		       start / samples, lat[samples / 2], lat[samples * 99 / 100]);
+		if (step == count)
+			break;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scullpriv";
+	long count = 10000, samples = 10000;
+	struct rlimit lim;
+	int opt, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n': count = atol(optarg); break;
+		case 's': samples = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-n count] [-s samples] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (count < 1 || samples < 1) {
+		fprintf(stderr, "%s: bad count or samples\n", argv[0]);
+		exit(1);
+	}
+
+	/* three descriptors per clone, and some to spare */
+	getrlimit(RLIMIT_NOFILE, &lim);
+	if (lim.rlim_cur < 3 * count + 64) {
+		lim.rlim_cur = 3 * count + 64;
+		if (lim.rlim_max < lim.rlim_cur)
+			lim.rlim_max = lim.rlim_cur;
+		if (setrlimit(RLIMIT_NOFILE, &lim) < 0) {
+			perror("setrlimit (too many clones for this user?)");
+			exit(1);
+		}
+	}
+
+	/* run in a session of our own, so terminals can be taken and dropped */
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		if (setsid() < 0) {
+			perror("setsid");
+			exit(1);
+		}
+		exit(bench(device, count, samples));
+	}
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
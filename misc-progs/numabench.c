@@ -0,0 +1,209 @@
+/*
+ * numabench.c -- scullp/scullv bandwidth under each NUMA placement policy
+ *
+ * For every policy the module's "numa" parameter accepts (none, local,
+ * interleave and each node in turn), and for every node that has CPUs,
+ * this pins itself to that node's CPUs, fills the device with "size_mb"
+ * megabytes and then, pinned to each node in turn, reads them back.
+ * Each line gives the policy, the writer's node, the write bandwidth
+ * and the read bandwidth from every node:
+ *
+ *	numabench [-s size_mb] [-b bs] [-m module] [device]
+ *
+ * The module defaults to the device's name without its number, so
+ *
+ *	numabench /dev/scullv0
+ *
+ * sets /sys/module/scullv/parameters/numa, which needs root. The
+ * policy in force when the run started is put back at the end.
+ */
+
+#define _GNU_SOURCE /* sched_setaffinity() */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+
+#define MAXNODES 64
+
+static char param[256];
+static long bs = 1 << 20;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read node "node"'s CPU list ("0-3,8-11") into a set; false if it has none */
+static int node_cpus(int node, cpu_set_t *set)
+{
+	char path[64], list[4096], *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (!fgets(list, sizeof(list), f))
+		list[0] = '\0';
+	fclose(f);
+
+	CPU_ZERO(set);
+	for (p = list; isdigit(*p); ) {
+		long first = strtol(p, &p, 10), last = first;
+
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		if (*p == ',')
+			p++;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+static void pin(cpu_set_t *set)
+{
+	if (sched_setaffinity(0, sizeof(*set), set) < 0) {
+		perror("sched_setaffinity");
+		exit(1);
+	}
+}
+
+static void set_policy(const char *policy)
+{
+	FILE *f = fopen(param, "w");
+
+	if (!f || fprintf(f, "%s\n", policy) < 0 || fclose(f)) {
+		perror(param);
+		exit(1);
+	}
+}
+
+/* Write (trimming first) or read "total" bytes; returns MB/s */
+static double transfer(const char *device, char *buf, long long total, int writing)
+{
+	long long done = 0;
+	double start;
+	int fd = open(device, writing ? O_WRONLY : O_RDONLY);
+
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	start = now();
+	while (done < total) {
+		long want = total - done < bs ? total - done : bs;
+		ssize_t n = writing ? write(fd, buf, want) : read(fd, buf, want);
+
+		if (n <= 0) {
+			fprintf(stderr, "%s: %s\n", writing ? "write" : "read",
+				n < 0 ? strerror(errno) : "early end of data");
+			exit(1);
+		}
+		done += n;
+	}
+	start = now() - start;
+	close(fd);
+	return total / start / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scullp0", *module = NULL, old[64] = "none", policy[16];
+	cpu_set_t cpus[MAXNODES];
+	int nodes[MAXNODES], nnodes = 0, opt, i, w, r;
+	long size_mb = 256;
+	long long total;
+	char *buf;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "s:b:m:")) != -1) {
+		switch (opt) {
+		case 's': size_mb = atol(optarg); break;
+		case 'b': bs = atol(optarg); break;
+		case 'm': module = optarg; break;
+		default:
+			fprintf(stderr, "use: %s [-s size_mb] [-b bs] [-m module] [device]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (size_mb <= 0 || bs <= 0) {
+		fprintf(stderr, "%s: bad size\n", argv[0]);
+		exit(1);
+	}
+	if (!module) { /* "/dev/scullv0" -> "scullv" */
+		char *p;
+
+		module = strdup(strrchr(device, '/') ? strrchr(device, '/') + 1 : device);
+		for (p = module + strlen(module); p > module && isdigit(p[-1]); p--)
+			p[-1] = '\0';
+	}
+	snprintf(param, sizeof(param), "/sys/module/%s/parameters/numa", module);
+	f = fopen(param, "r");
+	if (!f || !fgets(old, sizeof(old), f)) {
+		perror(param);
+		exit(1);
+	}
+	fclose(f);
+	old[strcspn(old, "\n")] = '\0';
+
+	for (i = 0; i < MAXNODES; i++)
+		if (node_cpus(i, cpus + nnodes))
+			nodes[nnodes++] = i;
+	if (!nnodes) {
+		fprintf(stderr, "%s: no NUMA nodes with CPUs found in sysfs\n", argv[0]);
+		exit(1);
+	}
+
+	total = (long long)size_mb << 20;
+	buf = malloc(bs);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 0x5a, bs);
+
+	printf("%s: %ld MB in %ld-byte transfers; MB/s\n", device, size_mb, bs);
+	printf("%-12s %6s %9s", "policy", "writer", "write");
+	for (r = 0; r < nnodes; r++)
+		printf("   read@%-3d", nodes[r]);
+	printf("\n");
+
+	for (i = -3; i < nnodes; i++) {
+		if (i == -3)
+			strcpy(policy, "none");
+		else if (i == -2)
+			strcpy(policy, "local");
+		else if (i == -1)
+			strcpy(policy, "interleave");
+		else
+			snprintf(policy, sizeof(policy), "%d", nodes[i]);
+		set_policy(policy);
+
+		for (w = 0; w < nnodes; w++) {
+			pin(cpus + w);
+			printf("%-12s %6d %9.0f", policy, nodes[w],
+			       transfer(device, buf, total, 1));
+			for (r = 0; r < nnodes; r++) {
+				pin(cpus + r);
+				printf(" %10.0f", transfer(device, buf, total, 0));
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	set_policy(old);
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * pipebench.c -- push data through scullpipe, or a real pipe, and time it
+ *
+ * A child process writes "size" megabytes in "bs"-byte writes while the
+ * parent reads them back up to "rbs" bytes at a time (bs by default),
+ * spot-checking the byte pattern as it goes (the first and last byte
+ * of each read, so the check doesn't swamp what is being measured).
+ * With a device name the two ends are that device opened write-only
+ * and read-only; with "-" they are the two ends of pipe(2), for
+ * comparison.
+ *
+ *	pipebench [-b bs] [-r rbs] [-s size_mb] [-p pipe_size] [-l lowat]
+ *		  [-h hiwat] [device | -]
+ *
+ * -p resizes the pipe first, with the scullpipe resize ioctl or with
+ * F_SETPIPE_SZ; -l and -h set scullpipe's watermarks. The context
+ * switches of both sides are reported too, so that
+ *
+ *	pipebench -b 16 -r 4096 -s 16
+ *	pipebench -b 16 -r 4096 -s 16 -l 4096
+ *
+ * show what a low watermark saves a reader fed by small writes.
+ *
+ * To compare scullpipe's modes, set /sys/module/scull/parameters/scull_p_spsc
+ * to 0 or 1 before the run: it takes effect when the pipe is next opened
+ * with nobody else holding it.
+ */
+
+#define _GNU_SOURCE /* F_SETPIPE_SZ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+/* from scull/scull.h */
+#define SCULL_P_IOCTPIPESIZE _IO('k', 15)
+#define SCULL_P_IOCTLOWAT    _IO('k', 17)
+#define SCULL_P_IOCTHIWAT    _IO('k', 19)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scullpipe0";
+	long size_mb = 256, bs = 4096, pipe_size = 0, lowat = 0, hiwat = 0, rbs = 0, i;
+	long long total, done = 0, calls = 0;
+	int opt, rfd, wfd, status;
+	struct rusage reader, writer;
+	unsigned char *buf;
+	double start, elapsed;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "b:r:s:p:l:h:")) != -1) {
+		switch (opt) {
+		case 'b': bs = atol(optarg); break;
+		case 'r': rbs = atol(optarg); break;
+		case 's': size_mb = atol(optarg); break;
+		case 'p': pipe_size = atol(optarg); break;
+		case 'l': lowat = atol(optarg); break;
+		case 'h': hiwat = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-b bs] [-r rbs] [-s size_mb] [-p pipe_size] "
+				"[-l lowat] [-h hiwat] [device | -]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (!rbs)
+		rbs = bs;
+	if (bs <= 0 || rbs <= 0 || size_mb <= 0) {
+		fprintf(stderr, "%s: bad block or total size\n", argv[0]);
+		exit(1);
+	}
+	total = (long long)size_mb << 20;
+
+	/* byte n of the stream is n & 0xff, so any window starts at buf + n % 256 */
+	buf = malloc((bs > rbs ? bs : rbs) + 256);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < bs + 256; i++) /* the reader only needs space */
+		buf[i] = (unsigned char)i;
+
+	if (!strcmp(device, "-")) {
+		int fds[2];
+
+		if (pipe(fds) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+		rfd = fds[0];
+		wfd = fds[1];
+	} else {
+		/* the reader first, so the writer isn't the one allocating */
+		rfd = open(device, O_RDONLY);
+		wfd = open(device, O_WRONLY);
+		if (rfd < 0 || wfd < 0) {
+			perror(device);
+			exit(1);
+		}
+	}
+
+	if (pipe_size) {
+		long got = strcmp(device, "-") ?
+			ioctl(rfd, SCULL_P_IOCTPIPESIZE, pipe_size) :
+			fcntl(rfd, F_SETPIPE_SZ, pipe_size);
+
+		if (got < 0) {
+			perror("resize");
+			exit(1);
+		}
+		pipe_size = got;
+	}
+	if (lowat || hiwat) {
+		if (!strcmp(device, "-")) {
+			fprintf(stderr, "%s: watermarks need a scullpipe device\n", argv[0]);
+			exit(1);
+		}
+		if ((lowat && ioctl(rfd, SCULL_P_IOCTLOWAT, lowat) < 0) ||
+		    (hiwat && ioctl(rfd, SCULL_P_IOCTHIWAT, hiwat) < 0)) {
+			perror("watermarks");
+			exit(1);
+		}
+	}
+
+	start = now();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) { /* the writer */
+		long long sent = 0;
+
+		close(rfd);
+		while (sent < total) {
+			long want = total - sent < bs ? total - sent : bs;
+			ssize_t n = write(wfd, buf + (sent & 0xff), want);
+
+			if (n <= 0) {
+				perror("write");
+				exit(1);
+			}
+			sent += n;
+		}
+		exit(0);
+	}
+
+	close(wfd);
+	while (done < total) {
+		ssize_t n = read(rfd, buf, rbs);
+
+		calls++;
+		if (n <= 0) {
+			fprintf(stderr, "read: %s\n", n < 0 ? strerror(errno) : "early end of data");
+			kill(pid, SIGKILL);
+			exit(1);
+		}
+		if (buf[0] != (unsigned char)done ||
+		    buf[n - 1] != (unsigned char)(done + n - 1)) {
+			fprintf(stderr, "bad data near byte %lld\n", done);
+			kill(pid, SIGKILL);
+			exit(1);
+		}
+		done += n;
+	}
+	elapsed = now() - start;
+	waitpid(pid, &status, 0);
+	getrusage(RUSAGE_SELF, &reader);
+	getrusage(RUSAGE_CHILDREN, &writer);
+
+	printf("%s: %ld MB in %ld-byte writes: %.1f MB/s, %.0f bytes/read",
+	       strcmp(device, "-") ? device : "pipe(2)", size_mb, bs,
+	       size_mb / elapsed, (double)done / calls);
+	if (pipe_size)
+		printf(", %ld-byte pipe", pipe_size);
+	printf("\n    context switches: reader %ld, writer %ld\n",
+	       reader.ru_nvcsw + reader.ru_nivcsw, writer.ru_nvcsw + writer.ru_nivcsw);
+	return 0;
+}
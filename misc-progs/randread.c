@@ -0,0 +1,120 @@
+/*
+ * randread.c -- time random reads across a scull device
+ *
+ * Fills the device with "size" megabytes (unless -n is given, to reuse
+ * what is already there) and then issues "count" preads of "bs" bytes
+ * at random offsets, reporting reads per second and the mean latency.
+ * A short read is completed with further preads, so drivers that stop
+ * at a quantum boundary are timed for the whole block.
+ *
+ *	randread [-n] [-s size_mb] [-b bs] [-c count] [device]
+ *
+ * The default is 1024 MB of /dev/scull0 read 4096 bytes at a time.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scull0";
+	long size_mb = 1024, bs = 4096, count = 100000, i;
+	int opt, fill = 1, fd;
+	long long size, calls = 0;
+	char *buf;
+	double start, elapsed;
+
+	while ((opt = getopt(argc, argv, "ns:b:c:")) != -1) {
+		switch (opt) {
+		case 'n': fill = 0; break;
+		case 's': size_mb = atol(optarg); break;
+		case 'b': bs = atol(optarg); break;
+		case 'c': count = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-n] [-s size_mb] [-b bs] [-c count] [device]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	size = (long long)size_mb << 20;
+	if (bs <= 0 || size < bs) {
+		fprintf(stderr, "%s: device must hold at least one block\n", argv[0]);
+		exit(1);
+	}
+
+	buf = malloc(bs > (1 << 20) ? bs : (1 << 20));
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if (fill) {
+		/* opening write-only trims the device first */
+		fd = open(device, O_WRONLY);
+		if (fd < 0) {
+			perror(device);
+			exit(1);
+		}
+		memset(buf, 0x5a, 1 << 20);
+		start = now();
+		for (i = 0; i < size_mb; i++) {
+			long done = 0;
+			while (done < (1 << 20)) {
+				ssize_t n = write(fd, buf + done, (1 << 20) - done);
+				if (n <= 0) {
+					perror("write");
+					exit(1);
+				}
+				done += n;
+			}
+		}
+		elapsed = now() - start;
+		printf("filled %ld MB in %.2f s (%.1f MB/s)\n", size_mb, elapsed,
+		       size_mb / elapsed);
+		close(fd);
+	}
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	srandom(1);
+	start = now();
+	for (i = 0; i < count; i++) {
+		off_t off = ((long long)random() << 16 ^ random()) % (size - bs + 1);
+		long done = 0;
+
+		while (done < bs) {
+			ssize_t n = pread(fd, buf + done, bs - done, off + done);
+			calls++;
+			if (n <= 0) {
+				fprintf(stderr, "pread at %lld: %s\n", (long long)off + done,
+					n < 0 ? strerror(errno) : "unexpected end of data");
+				exit(1);
+			}
+			done += n;
+		}
+	}
+	elapsed = now() - start;
+	printf("%ld random %ld-byte reads over %ld MB: %.0f reads/s, %.2f us/read, "
+	       "%.2f syscalls/read\n", count, bs, size_mb, count / elapsed,
+	       elapsed * 1e6 / count, (double)calls / count);
+	close(fd);
+	return 0;
+}
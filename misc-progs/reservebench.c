@@ -0,0 +1,135 @@
+/*
+ * reservebench.c -- write latency with and without reserving ahead
+ *
+ * Writes "size_mb" megabytes to a scull-family device in "bs"-byte
+ * writes, timing every one, first into an empty device (so the writes
+ * allocate as they go) and then into one where the range was reserved
+ * beforehand with the driver's IOCRESERVE ioctl. For each it reports
+ * the time the reservation took and the write latency: median, 99th
+ * percentile and worst, plus the overall bandwidth.
+ *
+ *	reservebench [-s size_mb] [-b bs] [device]
+ *
+ * The bare scull devices (/dev/scull0 ...) use SCULL_IOCRESERVE; any
+ * other name is taken for scullc, scullp, scullv or sculld, which all
+ * share their ioctl numbers.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+/* as in scull-shared/scull-reserve.h */
+struct scull_reserve {
+	uint64_t offset;
+	uint64_t length;
+};
+
+#define SCULL_IOCRESERVE  _IOW('k', 21, struct scull_reserve)
+#define SCULLX_IOCRESERVE _IOW('K', 13, struct scull_reserve)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Is this a bare scull device, "scull" and a number? */
+static int bare_scull(const char *device)
+{
+	const char *name = strrchr(device, '/') ? strrchr(device, '/') + 1 : device;
+
+	return !strncmp(name, "scull", 5) && isdigit(name[5]);
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scull0", *buf;
+	long size_mb = 256, bs = 4096, n, i;
+	unsigned long cmd;
+	struct scull_reserve r;
+	double *lat, start, total, reserve;
+	int opt, fd, pass;
+
+	while ((opt = getopt(argc, argv, "s:b:")) != -1) {
+		switch (opt) {
+		case 's': size_mb = atol(optarg); break;
+		case 'b': bs = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-s size_mb] [-b bs] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (size_mb <= 0 || bs <= 0) {
+		fprintf(stderr, "%s: bad size\n", argv[0]);
+		exit(1);
+	}
+	cmd = bare_scull(device) ? SCULL_IOCRESERVE : SCULLX_IOCRESERVE;
+	n = ((long long)size_mb << 20) / bs;
+	buf = malloc(bs);
+	lat = calloc(n, sizeof(double));
+	if (!buf || !lat || !n) {
+		fprintf(stderr, "%s: can't allocate, or nothing to write\n", argv[0]);
+		exit(1);
+	}
+	memset(buf, 0x5a, bs);
+
+	printf("%s: %ld writes of %ld bytes\n", device, n, bs);
+	printf("%-9s %10s %10s %10s %10s %10s\n", "", "reserve ms",
+	       "p50 us", "p99 us", "max us", "MB/s");
+	for (pass = 0; pass < 2; pass++) {
+		fd = open(device, O_WRONLY); /* empties the device */
+		if (fd < 0) {
+			perror(device);
+			exit(1);
+		}
+		reserve = 0;
+		if (pass) {
+			r.offset = 0;
+			r.length = (uint64_t)n * bs;
+			start = now();
+			if (ioctl(fd, cmd, &r) < 0) {
+				perror("IOCRESERVE");
+				exit(1);
+			}
+			reserve = now() - start;
+		}
+
+		total = now();
+		for (i = 0; i < n; i++) {
+			start = now();
+			if (write(fd, buf, bs) != bs) {
+				fprintf(stderr, "write: %s\n", strerror(errno));
+				exit(1);
+			}
+			lat[i] = (now() - start) * 1e6;
+		}
+		total = now() - total;
+		close(fd);
+
+		qsort(lat, n, sizeof(double), cmp_double);
+		printf("%-9s %10.1f %10.2f %10.2f %10.2f %10.0f\n",
+		       pass ? "reserved" : "on demand", reserve * 1e3,
+		       lat[n / 2], lat[n * 99 / 100], lat[n - 1],
+		       (double)n * bs / total / (1 << 20));
+	}
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * sparsebench.c -- copying a sparse device whole, and by its extents
+ *
+ * Makes the device "size_mb" megabytes long with only one quantum in
+ * every "stride" written (the rest are holes), then copies it to
+ * /dev/null two ways, timing each:
+ *
+ *	whole	 read from start to end, holes and all (they read as zeros)
+ *	extents	 SEEK_DATA/SEEK_HOLE to find the data and read only that,
+ *		 as cp --sparse=always and tar --sparse do
+ *
+ * "extents" should take time in proportion to the data, "whole" in
+ * proportion to the size. The data found is checked against what was
+ * written.
+ *
+ *	sparsebench [-s size_mb] [-q quantum] [-n stride] [device]
+ *
+ * The quantum must be the device's, as for zerobench.
+ */
+
+#define _GNU_SOURCE /* SEEK_DATA, SEEK_HOLE */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* Read "len" bytes at "off"; returns how many were not zero */
+static long long copy_range(int fd, char *buf, long bs, off_t off, long long len)
+{
+	long long nonzero = 0;
+	long i;
+
+	while (len > 0) {
+		ssize_t n = pread(fd, buf, len < bs ? len : bs, off);
+
+		if (n <= 0) {
+			fprintf(stderr, "read: %s\n", n < 0 ? strerror(errno) : "early end of data");
+			exit(1);
+		}
+		for (i = 0; i < n; i++)
+			nonzero += buf[i] != 0;
+		off += n;
+		len -= n;
+	}
+	return nonzero;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scull0", *buf;
+	long size_mb = 1024, quantum = 4096, stride = 64, extents = 0;
+	long long total, written = 0, found;
+	off_t data, hole, pos;
+	double t;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "s:q:n:")) != -1) {
+		switch (opt) {
+		case 's': size_mb = atol(optarg); break;
+		case 'q': quantum = atol(optarg); break;
+		case 'n': stride = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-s size_mb] [-q quantum] [-n stride] [device]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (size_mb <= 0 || quantum <= 0 || stride <= 0) {
+		fprintf(stderr, "%s: bad size, quantum or stride\n", argv[0]);
+		exit(1);
+	}
+	total = ((long long)size_mb << 20) / quantum * quantum;
+	buf = malloc(quantum);
+	if (!buf || !total) {
+		fprintf(stderr, "%s: can't allocate, or nothing to write\n", argv[0]);
+		exit(1);
+	}
+	memset(buf, 0x5a, quantum);
+
+	/* one quantum in every "stride", and the last byte to set the size */
+	fd = open(device, O_WRONLY); /* empties the device */
+	if (fd < 0)
+		die(device);
+	for (pos = 0; pos < total; pos += (off_t)quantum * stride) {
+		if (pwrite(fd, buf, quantum, pos) != quantum)
+			die("write");
+		written += quantum;
+	}
+	if (pwrite(fd, buf, 1, total - 1) != 1)
+		die("write");
+	close(fd);
+	if ((total - 1) / quantum % stride)
+		written++;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		die(device);
+	printf("%s: %lld MB, %lld bytes of data\n", device, total >> 20, written);
+	printf("%-8s %10s %10s %10s\n", "", "seconds", "extents", "data ok");
+
+	t = now();
+	found = copy_range(fd, buf, quantum, 0, total);
+	t = now() - t;
+	printf("%-8s %10.3f %10s %10s\n", "whole", t, "-", found == written ? "yes" : "NO");
+
+	t = now();
+	found = 0;
+	for (pos = 0; ; pos = hole) {
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break; /* no more data */
+			die("SEEK_DATA");
+		}
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			die("SEEK_HOLE");
+		found += copy_range(fd, buf, quantum, data, hole - data);
+		extents++;
+	}
+	t = now() - t;
+	printf("%-8s %10.3f %10ld %10s\n", "extents", t, extents,
+	       found == written ? "yes" : "NO");
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * stripebench.c -- parallel pwrite/pread on one scull device
+ *
+ * For 1, 2, 4 ... "maxthreads" threads, each thread spends "secs"
+ * seconds doing "bs"-byte pwrites (or preads, with -r) at random
+ * block-aligned offsets within its own "region" kilobytes of the
+ * device, so no two threads touch the same data. The aggregate rate
+ * and the speedup over one thread show how far the device lets
+ * disjoint I/O run in parallel: compare scull loaded plain with
+ * scull loaded with scull_stripes=512, which with 4 KB quanta and the
+ * default 1 MB regions gives 32 threads stripes of their own.
+ *
+ *	stripebench [-r] [-b bs] [-k region_kb] [-t maxthreads] [-d secs] [device]
+ *
+ * The device is filled first, so that reads find data everywhere.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+static int fd, reading;
+static long bs = 4096, region = 1 << 20;
+static volatile int running;
+static pthread_barrier_t start_line;
+
+struct worker {
+	pthread_t thread;
+	long index;
+	long long ops;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = w->index + 1;
+	long blocks = region / bs;
+	char *buf = malloc(bs);
+
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 0x5a, bs);
+	pthread_barrier_wait(&start_line);
+	while (running) {
+		off_t off = w->index * region + (rand_r(&seed) % blocks) * bs;
+		ssize_t n = reading ? pread(fd, buf, bs, off) : pwrite(fd, buf, bs, off);
+
+		if (n != bs) {
+			fprintf(stderr, "%s at %lld: %s\n", reading ? "pread" : "pwrite",
+				(long long)off, n < 0 ? strerror(errno) : "short transfer");
+			exit(1);
+		}
+		w->ops++;
+	}
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scull0";
+	long maxthreads = 32, secs = 2, nthreads, i;
+	double base = 0, rate, elapsed;
+	struct worker *workers;
+	char *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rb:k:t:d:")) != -1) {
+		switch (opt) {
+		case 'r': reading = 1; break;
+		case 'b': bs = atol(optarg); break;
+		case 'k': region = atol(optarg) * 1024; break;
+		case 't': maxthreads = atol(optarg); break;
+		case 'd': secs = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-r] [-b bs] [-k region_kb] [-t maxthreads] "
+				"[-d secs] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (bs <= 0 || region < bs || maxthreads <= 0 || secs <= 0) {
+		fprintf(stderr, "%s: bad block size, region, threads or time\n", argv[0]);
+		exit(1);
+	}
+
+	/* opening write-only trims the device first */
+	fd = open(device, O_WRONLY);
+	buf = calloc(1, region);
+	if (fd < 0 || !buf) {
+		perror(device);
+		exit(1);
+	}
+	for (i = 0; i < maxthreads; i++) {
+		long done = 0;
+
+		while (done < region) {
+			ssize_t n = write(fd, buf + done, region - done);
+
+			if (n <= 0) {
+				perror("write");
+				exit(1);
+			}
+			done += n;
+		}
+	}
+	close(fd);
+	free(buf);
+
+	fd = open(device, O_RDWR);
+	workers = calloc(maxthreads, sizeof(*workers));
+	if (fd < 0 || !workers) {
+		perror(device);
+		exit(1);
+	}
+
+	printf("%s: %ld-byte random %s, %ld KB per thread\n", device, bs,
+	       reading ? "preads" : "pwrites", region / 1024);
+	printf("%8s %12s %10s %8s\n", "threads", "ops/s", "MB/s", "speedup");
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+		long long ops = 0;
+
+		pthread_barrier_init(&start_line, NULL, nthreads + 1);
+		running = 1;
+		for (i = 0; i < nthreads; i++) {
+			workers[i].index = i;
+			workers[i].ops = 0;
+			if (pthread_create(&workers[i].thread, NULL, work, workers + i)) {
+				fprintf(stderr, "pthread_create failed\n");
+				exit(1);
+			}
+		}
+		pthread_barrier_wait(&start_line);
+		elapsed = now();
+		sleep(secs);
+		running = 0;
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(workers[i].thread, NULL);
+			ops += workers[i].ops;
+		}
+		elapsed = now() - elapsed;
+		pthread_barrier_destroy(&start_line);
+
+		rate = ops / elapsed;
+		if (nthreads == 1)
+			base = rate;
+		printf("%8ld %12.0f %10.1f %7.2fx\n", nthreads, rate,
+		       rate * bs / (1 << 20), rate / base);
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * trimbench.c -- how long open() takes to trim a full scull device
+ *
+ * Opening a scull device write-only empties it. For sizes of 1, 4,
+ * 16 ... up to "size_mb" megabytes, this fills the device and then
+ * times the open() that trims it, "runs" times over, reporting the
+ * best and the mean. Freeing the data inside open() makes that time
+ * grow with the size; with the old data handed to the background,
+ * it should stay flat.
+ *
+ *	trimbench [-s size_mb] [-n runs] [device]
+ *
+ * Each run also checks that the device reads back empty right after
+ * the open, however much there was to free.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(const char *device, char *buf, long bs, long long total)
+{
+	long long done = 0;
+	int fd = open(device, O_WRONLY);
+
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	while (done < total) {
+		ssize_t n = write(fd, buf, total - done < bs ? total - done : bs);
+
+		if (n <= 0) {
+			perror("write");
+			exit(1);
+		}
+		done += n;
+	}
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scull0";
+	long size_mb = 1024, runs = 5, bs = 1 << 20, mb, i;
+	double best, sum, t;
+	char *buf;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+		switch (opt) {
+		case 's': size_mb = atol(optarg); break;
+		case 'n': runs = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-s size_mb] [-n runs] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (size_mb < 1 || runs < 1) {
+		fprintf(stderr, "%s: bad size or run count\n", argv[0]);
+		exit(1);
+	}
+	buf = malloc(bs);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 0x5a, bs);
+
+	printf("%8s %12s %12s\n", "MB", "best us", "mean us");
+	for (mb = 1; ; mb = mb * 4 > size_mb ? size_mb : mb * 4) {
+		best = 0;
+		sum = 0;
+		for (i = 0; i < runs; i++) {
+			fill(device, buf, bs, (long long)mb << 20);
+
+			t = now();
+			fd = open(device, O_WRONLY);
+			t = (now() - t) * 1e6;
+			if (fd < 0) {
+				perror(device);
+				exit(1);
+			}
+			close(fd);
+			if (!i || t < best)
+				best = t;
+			sum += t;
+
+			fd = open(device, O_RDONLY);
+			if (fd < 0 || read(fd, buf, 1) != 0) {
+				fprintf(stderr, "%s: not empty after trimming\n", device);
+				exit(1);
+			}
+			close(fd);
+		}
+		printf("%8ld %12.1f %12.1f\n", mb, best, sum / runs);
+		if (mb == size_mb)
+			break;
+	}
+	return 0;
+}
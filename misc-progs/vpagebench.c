@@ -0,0 +1,150 @@
+/*
+ * vpagebench.c -- scullv with vmalloc()ed quanta against paged quanta
+ *
+ * For each of scullv's two modes (a vmalloc area per quantum, and an
+ * array of separate pages per quantum, see scullv_paged), this fills
+ * the device with "size_mb" megabytes, which allocates every quantum,
+ * reads it all back "passes" times, and empties it again, reporting:
+ *
+ *	fill	MB/s of the writes that allocate the quanta
+ *	read	MB/s reading it back, best of the passes
+ *	trim	milliseconds to free it all, as seen by open()
+ *
+ *	vpagebench [-s size_mb] [-b bs] [-n passes] [device]
+ *
+ * The mode is switched through /sys/module/scullv/parameters/scullv_paged
+ * (root only) and takes effect when the device is next emptied; the
+ * setting found at the start is put back at the end.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define PARAM "/sys/module/scullv/parameters/scullv_paged"
+
+static long bs = 1 << 20;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_mode(const char *mode)
+{
+	FILE *f = fopen(PARAM, "w");
+
+	if (!f || fprintf(f, "%s\n", mode) < 0 || fclose(f)) {
+		perror(PARAM);
+		exit(1);
+	}
+}
+
+/* Open the device, timing the open (which trims when write-only) */
+static int open_timed(const char *device, int flags, double *took)
+{
+	double start = now();
+	int fd = open(device, flags);
+
+	*took = now() - start;
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	return fd;
+}
+
+/* Write or read "total" bytes; returns the seconds it took */
+static double transfer(int fd, char *buf, long long total, int writing)
+{
+	long long done = 0;
+	double start = now();
+
+	while (done < total) {
+		long want = total - done < bs ? total - done : bs;
+		ssize_t n = writing ? write(fd, buf, want) : read(fd, buf, want);
+
+		if (n <= 0) {
+			fprintf(stderr, "%s: %s\n", writing ? "write" : "read",
+				n < 0 ? strerror(errno) : "early end of data");
+			exit(1);
+		}
+		done += n;
+	}
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scullv0", old[16] = "N", *buf;
+	long size_mb = 256, passes = 3, i;
+	double t, best, trim, mb;
+	long long total;
+	int opt, mode, fd;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "s:b:n:")) != -1) {
+		switch (opt) {
+		case 's': size_mb = atol(optarg); break;
+		case 'b': bs = atol(optarg); break;
+		case 'n': passes = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-s size_mb] [-b bs] [-n passes] [device]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (size_mb <= 0 || bs <= 0 || passes <= 0) {
+		fprintf(stderr, "%s: bad size or pass count\n", argv[0]);
+		exit(1);
+	}
+	f = fopen(PARAM, "r");
+	if (!f || !fgets(old, sizeof(old), f)) {
+		perror(PARAM);
+		exit(1);
+	}
+	fclose(f);
+	old[strcspn(old, "\n")] = '\0';
+
+	total = (long long)size_mb << 20;
+	mb = size_mb;
+	buf = malloc(bs);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 0x5a, bs);
+
+	printf("%s: %ld MB in %ld-byte transfers\n", device, size_mb, bs);
+	printf("%-8s %10s %10s %10s\n", "mode", "fill MB/s", "read MB/s", "trim ms");
+	for (mode = 0; mode < 2; mode++) {
+		set_mode(mode ? "Y" : "N");
+		/* empty the device, so the new mode is in force, then fill it */
+		fd = open_timed(device, O_WRONLY, &t);
+		t = transfer(fd, buf, total, 1);
+		close(fd);
+		printf("%-8s %10.0f", mode ? "paged" : "vmalloc", mb / t);
+
+		for (i = 0, best = 0; i < passes; i++) {
+			fd = open_timed(device, O_RDONLY, &t);
+			t = transfer(fd, buf, total, 0);
+			close(fd);
+			if (!i || t < best)
+				best = t;
+		}
+		fd = open_timed(device, O_WRONLY, &trim);
+		close(fd);
+		printf(" %10.0f %10.1f\n", mb / best, trim * 1e3);
+	}
+	set_mode(old);
+	return 0;
+}
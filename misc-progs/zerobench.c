@@ -0,0 +1,117 @@
+/*
+ * zerobench.c -- what zeroing new quanta costs sequential writers
+ *
+ * A quantum written whole as it is allocated needn't be zeroed first;
+ * one that is only partly written must be. This writes "size_mb"
+ * megabytes three ways, timing each and the system time it takes:
+ *
+ *	whole	 writes of one quantum each, into an empty device: every
+ *		 quantum is allocated and filled in one go, never zeroed
+ *	halves	 writes of half a quantum, into an empty device: every
+ *		 quantum is zeroed, then filled in two steps
+ *	rewrite	 whole quanta again, over the data already there: no
+ *		 allocation at all, the floor for the other two
+ *
+ * Zeroing means writing every byte of memory twice, so "whole" should
+ * beat "halves" on bandwidth and, more clearly, on system time per GB.
+ *
+ *	zerobench [-s size_mb] [-q quantum] [device]
+ *
+ * The quantum must be the device's: 4096 (a page) for scull, scullc,
+ * scullp and sculld as loaded by default, 65536 for scullv.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double system_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Write "total" bytes in "bs"-byte writes, printing a line of results */
+static void run(const char *name, const char *device, int flags, char *buf,
+		long bs, long long total)
+{
+	long long done = 0;
+	double start, sys;
+	int fd = open(device, flags); /* O_WRONLY alone empties the device */
+
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	sys = system_time();
+	start = now();
+	while (done < total) {
+		ssize_t n = write(fd, buf, total - done < bs ? total - done : bs);
+
+		if (n <= 0) {
+			fprintf(stderr, "write: %s\n", n < 0 ? strerror(errno) : "no progress");
+			exit(1);
+		}
+		done += n;
+	}
+	start = now() - start;
+	sys = system_time() - sys;
+	close(fd);
+	printf("%-8s %10ld %10.0f %12.3f\n", name, bs,
+	       total / start / (1 << 20), sys / (total / (double)(1 << 30)));
+}
+
+int main(int argc, char **argv)
+{
+	char *device = "/dev/scull0", *buf;
+	long size_mb = 1024, quantum = 4096;
+	long long total;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:q:")) != -1) {
+		switch (opt) {
+		case 's': size_mb = atol(optarg); break;
+		case 'q': quantum = atol(optarg); break;
+		default:
+			fprintf(stderr, "use: %s [-s size_mb] [-q quantum] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (size_mb <= 0 || quantum < 2) {
+		fprintf(stderr, "%s: bad size or quantum\n", argv[0]);
+		exit(1);
+	}
+	/* whole quanta only, so every pass writes the same bytes */
+	total = ((long long)size_mb << 20) / quantum * quantum;
+	buf = malloc(quantum);
+	if (!buf || !total) {
+		fprintf(stderr, "%s: can't allocate, or nothing to write\n", argv[0]);
+		exit(1);
+	}
+	memset(buf, 0x5a, quantum);
+
+	printf("%s: %lld MB, quantum %ld\n", device, total >> 20, quantum);
+	printf("%-8s %10s %10s %12s\n", "", "write size", "MB/s", "sys s per GB");
+	run("whole", device, O_WRONLY, buf, quantum, total);
+	run("halves", device, O_WRONLY, buf, quantum / 2, total);
+	run("rewrite", device, O_RDWR, buf, quantum, total);
+	return 0;
+}
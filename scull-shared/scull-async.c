@@ -22,67 +22,302 @@
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
-#include <linux/proc_fs.h>
 #include <linux/seq_file.h>
-#include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
-#include <linux/uaccess.h>
 #include <linux/uio.h>	/* iov_iter* */
+#include <linux/workqueue.h>
+#include <linux/sched/mm.h>	/* mmget(), mmput() */
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+#include <linux/kthread.h>	/* kthread_use_mm() */
+#else
+#include <linux/mmu_context.h>	/* use_mm() */
+#define kthread_use_mm(mm)	use_mm(mm)
+#define kthread_unuse_mm(mm)	unuse_mm(mm)
+#endif
 
+#include "scull-async.h"
 
 /*
  * A simple asynchronous I/O implementation.
+ *
+ * Every request is carried out by the driver's own iov_iter method. By
+ * default an AIO request is simply completed before io_submit() returns,
+ * which is always allowed; with aio=1 it goes on the device's queue and
+ * is completed from a workqueue through ki_complete, leaving the
+ * submitter free to queue more.
  */
 
-struct async_work {
-	struct delayed_work work;
+static bool scull_aio = false;
+module_param_named(aio, scull_aio, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aio, "Complete AIO requests from a workqueue");
+
+static unsigned int scull_aio_depth = 64;
+module_param_named(aio_depth, scull_aio_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(aio_depth, "AIO requests a device keeps in flight");
+
+static struct workqueue_struct *scull_aio_wq;
+
+struct scull_async_req {
+	struct list_head list;		/* on the queue's free or pending list */
 	struct kiocb *iocb;
-	struct iov_iter *tofrom;
+	struct iov_iter tofrom;		/* our copy of the caller's iterator... */
+	const void *vec;		/* ...and of its segment array */
+	struct mm_struct *mm;		/* the address space the segments point into */
+	scull_iter_op op;
+	loff_t pos;			/* the range asked for, as submitted */
+	size_t len;
+	ssize_t result;
 };
 
+static void scull_complete(struct kiocb *iocb, long result)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	iocb->ki_complete(iocb, result);
+#else
+	iocb->ki_complete(iocb, result, 0);
+#endif
+}
+
 /*
- * "Complete" an asynchronous operation.
+ * Run one request with the device mutex, the way a synchronous caller
+ * does. Also the fallback whenever a request can't be queued.
  */
-static void scull_do_deferred_op(struct work_struct *work)
+static ssize_t scull_async_inline(struct scull_async_queue *q,
+		struct kiocb *iocb, struct iov_iter *tofrom, scull_iter_op op)
 {
-	struct async_work *stuff = container_of(work, struct async_work, work.work);
-	if( iov_iter_rw(stuff->tofrom) == WRITE ) {
-		generic_file_write_iter(stuff->iocb, stuff->tofrom);
-	} else {
-		generic_file_read_iter(stuff->iocb, stuff->tofrom);
+	ssize_t result;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(q->dev_lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(q->dev_lock))
+		return -ERESTARTSYS;
+	result = op(iocb, tofrom);
+	mutex_unlock(q->dev_lock);
+	return result;
+}
+
+/*
+ * Whether "next" carries on where "req" leaves off: the same operation
+ * on the same file, starting at the byte after req's range.
+ */
+static bool scull_async_contiguous(struct scull_async_req *req,
+		struct scull_async_req *next)
+{
+	return next->op == req->op && next->iocb->ki_filp == req->iocb->ki_filp &&
+		req->pos + req->len == next->pos;
+}
+
+/*
+ * Complete a batch of n contiguous requests under one hold of the
+ * device mutex, switching address spaces only when the submitter
+ * changes; completions are signalled after the mutex is dropped.
+ */
+static void scull_async_batch(struct scull_async_queue *q, struct list_head *batch,
+		unsigned int n)
+{
+	struct scull_async_req *req, *next;
+	struct mm_struct *mm = NULL;
+
+	mutex_lock(q->dev_lock);
+	list_for_each_entry(req, batch, list) {
+		if (req->mm != mm) {
+			if (mm)
+				kthread_unuse_mm(mm);
+			mm = req->mm;
+			if (mm)
+				kthread_use_mm(mm);
+		}
+		req->result = req->op(req->iocb, &req->tofrom);
+	}
+	if (mm)
+		kthread_unuse_mm(mm);
+	mutex_unlock(q->dev_lock);
+
+	list_for_each_entry(req, batch, list) {
+		scull_complete(req->iocb, req->result);
+		if (req->mm)
+			mmput(req->mm);
+		kfree(req->vec);
+	}
+
+	spin_lock(&q->lock);
+	list_for_each_entry_safe(req, next, batch, list)
+		list_move(&req->list, &q->free);
+	q->inflight -= n;
+	q->queued += n;
+	q->batches++;
+	if (n > q->max_batch)
+		q->max_batch = n;
+	spin_unlock(&q->lock);
+}
+
+/*
+ * Complete everything queued so far, a run of contiguous requests at a
+ * time. Anything else gets the mutex to itself, so a synchronous caller
+ * can get in between.
+ */
+static void scull_async_work(struct work_struct *work)
+{
+	struct scull_async_queue *q = container_of(work, struct scull_async_queue, work);
+	struct scull_async_req *last, *next;
+	LIST_HEAD(pending);
+
+	spin_lock(&q->lock);
+	list_splice_init(&q->pending, &pending);
+	spin_unlock(&q->lock);
+
+	while (!list_empty(&pending)) {
+		unsigned int n = 1;
+		LIST_HEAD(batch);
+
+		last = list_first_entry(&pending, struct scull_async_req, list);
+		while (!list_is_last(&last->list, &pending)) {
+			next = list_next_entry(last, list);
+			if (!scull_async_contiguous(last, next))
+				break;
+			last = next;
+			n++;
+		}
+		list_cut_position(&batch, &pending, &last->list);
+		scull_async_batch(q, &batch, n);
 	}
-	kfree(stuff);
+}
+
+/*
+ * Allocate the request pool on first use. Devices that never see AIO
+ * (and scullpriv clones, set up under a spinlock) don't pay for it.
+ */
+static int scull_async_pool(struct scull_async_queue *q)
+{
+	struct scull_async_req *pool;
+	unsigned int i, depth = max(scull_aio_depth, 1U);
+
+	pool = kcalloc(depth, sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+
+	spin_lock(&q->lock);
+	if (q->pool) { /* somebody beat us to it */
+		spin_unlock(&q->lock);
+		kfree(pool);
+		return 0;
+	}
+	for (i = 0; i < depth; i++)
+		list_add_tail(&pool[i].list, &q->free);
+	q->depth = depth;
+	q->pool = pool;
+	spin_unlock(&q->lock);
+	return 0;
 }
 
 
-static int scull_defer_op(struct kiocb *iocb, struct iov_iter *tofrom)
+void scull_async_queue_init(struct scull_async_queue *q, struct mutex *dev_lock)
 {
-	struct async_work *stuff;
-	int result;
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	INIT_DELAYED_WORK(&stuff->work, scull_do_deferred_op);
-	schedule_delayed_work(&stuff->work, HZ/100);
-	return -EIOCBQUEUED;
+	q->dev_lock = dev_lock;
+	spin_lock_init(&q->lock);
+	INIT_LIST_HEAD(&q->pending);
+	INIT_LIST_HEAD(&q->free);
+	q->pool = NULL;
+	q->depth = q->inflight = 0;
+	INIT_WORK(&q->work, scull_async_work);
+	q->queued = q->batches = q->overflow = 0;
+	q->max_batch = 0;
+}
+
+void scull_async_queue_release(struct scull_async_queue *q)
+{
+	/* a request still in flight holds its file open, so this is quick */
+	flush_work(&q->work);
+	kfree(q->pool);
+	q->pool = NULL;
+	INIT_LIST_HEAD(&q->free);
 }
 
 
-ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+ssize_t scull_async_rw(struct scull_async_queue *q, struct kiocb *iocb,
+		struct iov_iter *tofrom, scull_iter_op op)
 {
+	struct scull_async_req *req;
+
 	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb)) {
-		return generic_file_read_iter(iocb,to);
+	if (is_sync_kiocb(iocb) || !scull_aio || !scull_aio_wq)
+		return scull_async_inline(q, iocb, tofrom, op);
+
+	if (!READ_ONCE(q->pool) && scull_async_pool(q))
+		return scull_async_inline(q, iocb, tofrom, op); /* No memory, just complete now */
+
+	spin_lock(&q->lock);
+	req = list_first_entry_or_null(&q->free, struct scull_async_req, list);
+	if (req) {
+		list_del(&req->list);
+		q->inflight++;
+	} else {
+		q->overflow++;
 	}
-	return scull_defer_op(iocb, to);
+	spin_unlock(&q->lock);
+	if (!req) /* at the depth limit: the submitter does the work */
+		return scull_async_inline(q, iocb, tofrom, op);
+
+	/* the segment array may live on the submitter's stack: copy it */
+	req->vec = dup_iter(&req->tofrom, tofrom, GFP_KERNEL);
+	if (!req->vec && (iter_is_iovec(tofrom) || iov_iter_is_kvec(tofrom) ||
+			iov_iter_is_bvec(tofrom))) {
+		spin_lock(&q->lock);
+		list_add(&req->list, &q->free);
+		q->inflight--;
+		spin_unlock(&q->lock);
+		return scull_async_inline(q, iocb, tofrom, op);
+	}
+	req->mm = NULL;
+	if (current->mm) {
+		mmget(current->mm);
+		req->mm = current->mm;
+	}
+	req->iocb = iocb;
+	req->op = op;
+	req->pos = iocb->ki_pos;
+	req->len = iov_iter_count(tofrom);
+
+	spin_lock(&q->lock);
+	list_add_tail(&req->list, &q->pending);
+	spin_unlock(&q->lock);
+	queue_work(scull_aio_wq, &q->work);
+	return -EIOCBQUEUED;
 }
 
-ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+
+void scull_async_show(struct seq_file *m, struct scull_async_queue *q)
 {
-	if (is_sync_kiocb(iocb)) {
-		return generic_file_write_iter(iocb,from);
-	}
-	return scull_defer_op(iocb, from);
+	unsigned long queued, batches, overflow;
+	unsigned int inflight, max_batch;
+
+	spin_lock(&q->lock);
+	queued = q->queued;
+	batches = q->batches;
+	overflow = q->overflow;
+	inflight = q->inflight;
+	max_batch = q->max_batch;
+	spin_unlock(&q->lock);
+
+	if (queued || inflight || overflow)
+		seq_printf(m, "  aio: %lu queued in %lu batches (largest %u), "
+				"%u in flight, %lu done inline when full\n",
+				queued, batches, max_batch, inflight, overflow);
+}
+
+
+int scull_async_init(void)
+{
+	scull_aio_wq = alloc_workqueue("%s-aio", WQ_UNBOUND, 0, KBUILD_MODNAME);
+	return scull_aio_wq ? 0 : -ENOMEM;
+}
+
+void scull_async_cleanup(void)
+{
+	/* waits for anything still queued */
+	if (scull_aio_wq)
+		destroy_workqueue(scull_aio_wq);
+	scull_aio_wq = NULL;
 }
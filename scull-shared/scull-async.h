@@ -17,9 +17,60 @@
 #ifndef SCULL_SHARED_SCULL_ASYNC_H_
 #define SCULL_SHARED_SCULL_ASYNC_H_
 
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
-ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
-ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+struct seq_file;
+struct scull_async_req;
 
+/*
+ * A driver's read or write on an iov_iter, called with the device mutex
+ * held: it transfers from iocb->ki_pos, advances it and returns the byte
+ * count or an error.
+ */
+typedef ssize_t (*scull_iter_op)(struct kiocb *iocb, struct iov_iter *tofrom);
+
+/*
+ * Every device queues its AIO requests here. The worker takes whatever
+ * has piled up in one go and serves each run of contiguous requests (the
+ * same operation on the same file, each starting where the one before
+ * ends) as a batch, under a single hold of the device mutex.
+ * Requests come from a pool of aio_depth entries, allocated the first
+ * time the device sees AIO; with all of them in flight, the submitter
+ * carries out further requests itself before io_submit() returns.
+ */
+struct scull_async_queue {
+	struct mutex *dev_lock;		/* the device's own mutex */
+	spinlock_t lock;		/* protects everything below */
+	struct list_head pending;
+	struct list_head free;
+	struct scull_async_req *pool;
+	unsigned int depth;		/* entries in the pool */
+	unsigned int inflight;
+	struct work_struct work;
+	unsigned long queued;		/* requests completed by the worker */
+	unsigned long batches;		/* and the mutex holds it took */
+	unsigned int max_batch;
+	unsigned long overflow;		/* done inline with the queue full */
+};
+
+void    scull_async_queue_init(struct scull_async_queue *q, struct mutex *dev_lock);
+void    scull_async_queue_release(struct scull_async_queue *q);
+
+/*
+ * The body of a read_iter/write_iter method: runs op now for synchronous
+ * requests, and for AIO ones too unless the "aio" parameter is set.
+ */
+ssize_t scull_async_rw(struct scull_async_queue *q, struct kiocb *iocb,
+		struct iov_iter *tofrom, scull_iter_op op);
+
+void    scull_async_show(struct seq_file *m, struct scull_async_queue *q);
+
+int  scull_async_init(void);
+void scull_async_cleanup(void);
 
 #endif /* SCULL_SHARED_SCULL_ASYNC_H_ */
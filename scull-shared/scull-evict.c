@@ -0,0 +1,255 @@
+/*
+ * scull-evict.c
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>		/* kmalloc(), kfree_rcu() */
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/shrinker.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+#include "scull-evict.h"
+
+static bool scull_evict_on = false;
+module_param_named(evict, scull_evict_on, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(evict, "Let memory pressure discard cold quanta (from the next trim)");
+
+/* One entry per tracked quantum, on the module's LRU list */
+struct scull_evict_item {
+	struct list_head lru;
+	struct scull_evict *owner;
+	unsigned long index;
+	bool referenced;		/* used since the clock last came by */
+	struct rcu_head rcu;		/* lookups run under RCU alone */
+};
+
+/* The list, coldest first; the lock also covers the counts */
+static LIST_HEAD(scull_lru);
+static DEFINE_SPINLOCK(scull_lru_lock);
+static unsigned long scull_lru_count;
+
+
+void scull_evict_dev_init(struct scull_evict *e, struct mutex *dev_lock,
+		scull_discard_fn discard)
+{
+	e->dev_lock = dev_lock;
+	e->discard = discard;
+	e->on = discard && READ_ONCE(scull_evict_on);
+	xa_init(&e->items);
+	e->tracked = e->discarded = e->busy = 0;
+}
+
+/* Take all of a device's quanta off the list */
+static void scull_evict_forget(struct scull_evict *e)
+{
+	struct scull_evict_item *item;
+	unsigned long index;
+
+	xa_for_each(&e->items, index, item) {
+		spin_lock(&scull_lru_lock);
+		list_del(&item->lru);
+		scull_lru_count--;
+		spin_unlock(&scull_lru_lock);
+		kfree_rcu(item, rcu);
+	}
+	xa_destroy(&e->items);
+	e->tracked = 0;
+}
+
+void scull_evict_reset(struct scull_evict *e)
+{
+	scull_evict_forget(e);
+	e->on = e->discard && READ_ONCE(scull_evict_on);
+}
+
+void scull_evict_dev_release(struct scull_evict *e)
+{
+	scull_evict_forget(e);
+	e->on = false;
+}
+
+/*
+ * Track a newly allocated quantum. Should there be no memory for
+ * that, it simply stays put for good.
+ */
+int scull_evict_add(struct scull_evict *e, unsigned long index)
+{
+	struct scull_evict_item *item;
+
+	if (!e->on)
+		return 0;
+	item = kmalloc(sizeof(*item), GFP_KERNEL);
+	if (!item)
+		return -ENOMEM;
+	item->owner = e;
+	item->index = index;
+	item->referenced = false;
+	if (xa_is_err(xa_store(&e->items, index, item, GFP_KERNEL))) {
+		kfree(item);
+		return -ENOMEM;
+	}
+
+	spin_lock(&scull_lru_lock);
+	list_add_tail(&item->lru, &scull_lru);
+	scull_lru_count++;
+	e->tracked++;
+	spin_unlock(&scull_lru_lock);
+	return 0;
+}
+
+void scull_evict_touch(struct scull_evict *e, unsigned long index)
+{
+	struct scull_evict_item *item;
+
+	if (!e->on)
+		return;
+	rcu_read_lock();
+	item = xa_load(&e->items, index);
+	if (item && !READ_ONCE(item->referenced))
+		WRITE_ONCE(item->referenced, true);
+	rcu_read_unlock();
+}
+
+void scull_evict_show(struct seq_file *m, struct scull_evict *e)
+{
+	if (e->on || e->discarded)
+		seq_printf(m, "  evict: %lu quanta on the LRU, %lu discarded, "
+				"%lu passed over busy\n",
+				e->tracked, e->discarded, e->busy);
+}
+
+
+/*
+ * The shrinker. Entries are taken from the cold end: one used since
+ * the last pass, or whose device is busy, goes round again; otherwise
+ * the device mutex is taken (never waited for: the allocation that got
+ * us here may be made with it held) and the driver discards the quantum.
+ */
+static unsigned long scull_evict_count(struct shrinker *s, struct shrink_control *sc)
+{
+	return READ_ONCE(scull_lru_count);
+}
+
+static unsigned long scull_evict_scan(struct shrinker *s, struct shrink_control *sc)
+{
+	struct scull_evict_item *item;
+	struct scull_evict *e;
+	unsigned long scanned, freed = 0;
+	bool done;
+
+	for (scanned = 0; scanned < sc->nr_to_scan; scanned++) {
+		spin_lock(&scull_lru_lock);
+		item = list_first_entry_or_null(&scull_lru, struct scull_evict_item, lru);
+		if (!item) {
+			spin_unlock(&scull_lru_lock);
+			break;
+		}
+		e = item->owner;
+		if (item->referenced || !mutex_trylock(e->dev_lock)) {
+			if (!item->referenced)
+				e->busy++;
+			item->referenced = false;
+			list_move_tail(&item->lru, &scull_lru);
+			spin_unlock(&scull_lru_lock);
+			continue;
+		}
+		/*
+		 * The device mutex keeps out trim and release, the only
+		 * other places an entry is freed. It doesn't keep out I/O
+		 * in scull's striped mode, though, so see below.
+		 */
+		list_del(&item->lru);
+		scull_lru_count--;
+		e->tracked--;
+		spin_unlock(&scull_lru_lock);
+
+		done = e->discard(e, item->index);
+		if (done) {
+			/*
+			 * Once discard() has returned, a striped writer may
+			 * have made the quantum anew and tracked it with a new
+			 * entry at the same index: take out only our own.
+			 */
+			xa_cmpxchg(&e->items, item->index, item, NULL, 0);
+			kfree_rcu(item, rcu);
+			e->discarded++;
+			freed++;
+		} else {
+			spin_lock(&scull_lru_lock);
+			list_add_tail(&item->lru, &scull_lru);
+			scull_lru_count++;
+			e->tracked++;
+			e->busy++;
+			spin_unlock(&scull_lru_lock);
+		}
+		mutex_unlock(e->dev_lock);
+	}
+	return freed ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+static struct shrinker *scull_shrinker;
+
+int scull_evict_init(void)
+{
+	scull_shrinker = shrinker_alloc(0, "%s-evict", KBUILD_MODNAME);
+	if (!scull_shrinker)
+		return -ENOMEM;
+	scull_shrinker->count_objects = scull_evict_count;
+	scull_shrinker->scan_objects = scull_evict_scan;
+	shrinker_register(scull_shrinker);
+	return 0;
+}
+
+void scull_evict_cleanup(void)
+{
+	/* waits for a scan in progress */
+	if (scull_shrinker)
+		shrinker_free(scull_shrinker);
+	scull_shrinker = NULL;
+}
+#else
+static struct shrinker scull_shrinker = {
+	.count_objects = scull_evict_count,
+	.scan_objects = scull_evict_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+static bool scull_shrinker_registered;
+
+int scull_evict_init(void)
+{
+	int err;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	err = register_shrinker(&scull_shrinker, "%s-evict", KBUILD_MODNAME);
+#else
+	err = register_shrinker(&scull_shrinker);
+#endif
+	scull_shrinker_registered = !err;
+	return err;
+}
+
+void scull_evict_cleanup(void)
+{
+	/* waits for a scan in progress */
+	if (scull_shrinker_registered)
+		unregister_shrinker(&scull_shrinker);
+	scull_shrinker_registered = false;
+}
+#endif
@@ -0,0 +1,73 @@
+/*
+ * scull-evict.h
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef SCULL_SHARED_SCULL_EVICT_H_
+#define SCULL_SHARED_SCULL_EVICT_H_
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+
+struct seq_file;
+struct scull_evict;
+
+/*
+ * Free quantum number "index" of the device, called with the device
+ * mutex held. Returns false if it can't be done right now (the device
+ * is mapped, say); the quantum then stays where it is.
+ */
+typedef bool (*scull_discard_fn)(struct scull_evict *e, unsigned long index);
+
+/*
+ * Evictable mode, turned on with the "evict" parameter, lets the kernel
+ * take a device's data back under memory pressure, as from a cache:
+ * the module registers a shrinker, every quantum allocated goes on one
+ * LRU list for the module, and the coldest quanta are discarded when
+ * the shrinker asks, to read back as holes. Use marks a quantum
+ * referenced, which earns it another trip round the list (the "clock"
+ * approximation of LRU), so lookups never take the list lock.
+ */
+struct scull_evict {
+	struct mutex *dev_lock;		/* the device's own mutex */
+	scull_discard_fn discard;	/* NULL if never evictable */
+	bool on;			/* quanta allocated now are tracked */
+	struct xarray items;		/* quantum number -> its LRU entry */
+	unsigned long tracked;		/* quanta on the LRU */
+	unsigned long discarded;	/* and taken off it by the shrinker */
+	unsigned long busy;		/* passed over, device in use */
+};
+
+void scull_evict_dev_init(struct scull_evict *e, struct mutex *dev_lock,
+		scull_discard_fn discard);
+void scull_evict_dev_release(struct scull_evict *e);
+
+/*
+ * With the device mutex held, and the driver's I/O shut out: forget
+ * every quantum, as the device is emptied, and pick up the current
+ * setting of the "evict" parameter.
+ */
+void scull_evict_reset(struct scull_evict *e);
+
+/* A quantum was allocated, or used: cheap no-ops unless evictable */
+int  scull_evict_add(struct scull_evict *e, unsigned long index);
+void scull_evict_touch(struct scull_evict *e, unsigned long index);
+
+void scull_evict_show(struct seq_file *m, struct scull_evict *e);
+
+/* The shrinker: register it before the devices go live, remove it first */
+int  scull_evict_init(void);
+void scull_evict_cleanup(void);
+
+#endif /* SCULL_SHARED_SCULL_EVICT_H_ */
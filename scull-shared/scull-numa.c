@@ -0,0 +1,162 @@
+/*
+ * scull-numa.c
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>	/* sprintf(), kstrtoint() */
+#include <linux/slab.h>		/* kcalloc() */
+#include <linux/mm.h>		/* alloc_pages_node() */
+#include <linux/vmalloc.h>	/* vmalloc_node(), vmalloc_to_page() */
+#include <linux/nodemask.h>
+#include <linux/topology.h>	/* numa_mem_id() */
+#include <linux/string.h>	/* sysfs_streq() */
+#include <linux/seq_file.h>
+
+#include "scull-numa.h"
+
+/*
+ * Quantum placement for the drivers that get their memory from the
+ * page allocator or vmalloc. The policy is a single int, so that it
+ * can change under the drivers' feet: a node, or one of these.
+ */
+#define SCULL_NUMA_NONE		-1
+#define SCULL_NUMA_LOCAL	-2
+#define SCULL_NUMA_INTERLEAVE	-3
+
+static int scull_numa = SCULL_NUMA_NONE;
+static int scull_numa_last;	/* the node interleaving used last */
+
+static int scull_numa_set(const char *val, const struct kernel_param *kp)
+{
+	int node;
+
+	if (sysfs_streq(val, "none"))
+		node = SCULL_NUMA_NONE;
+	else if (sysfs_streq(val, "local"))
+		node = SCULL_NUMA_LOCAL;
+	else if (sysfs_streq(val, "interleave"))
+		node = SCULL_NUMA_INTERLEAVE;
+	else if (kstrtoint(val, 0, &node) || node < 0 || node >= nr_node_ids ||
+			!node_state(node, N_MEMORY))
+		return -EINVAL;
+	WRITE_ONCE(scull_numa, node);
+	return 0;
+}
+
+static int scull_numa_get(char *buffer, const struct kernel_param *kp)
+{
+	int node = READ_ONCE(scull_numa);
+
+	switch (node) {
+	case SCULL_NUMA_NONE:
+		return sprintf(buffer, "none\n");
+	case SCULL_NUMA_LOCAL:
+		return sprintf(buffer, "local\n");
+	case SCULL_NUMA_INTERLEAVE:
+		return sprintf(buffer, "interleave\n");
+	}
+	return sprintf(buffer, "%d\n", node);
+}
+
+static const struct kernel_param_ops scull_numa_ops = {
+	.set = scull_numa_set,
+	.get = scull_numa_get,
+};
+module_param_cb(numa, &scull_numa_ops, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(numa, "Quantum placement: none, local, interleave or a node number");
+
+/* The node for the next quantum, or NUMA_NO_NODE for no hint */
+static int scull_numa_node(int local)
+{
+	int node = READ_ONCE(scull_numa);
+
+	switch (node) {
+	case SCULL_NUMA_NONE:
+		return NUMA_NO_NODE;
+	case SCULL_NUMA_LOCAL:
+		return local; /* the nearest node with memory */
+	case SCULL_NUMA_INTERLEAVE:
+		/* racing writers may pick the same node: it's only a hint */
+		node = next_node_in(READ_ONCE(scull_numa_last), node_states[N_MEMORY]);
+		WRITE_ONCE(scull_numa_last, node);
+		return node;
+	}
+	return node;
+}
+
+struct page *scull_numa_alloc_pages_on(gfp_t gfp, unsigned int order, int local)
+{
+	int node = scull_numa_node(local);
+
+	if (node == NUMA_NO_NODE)
+		return alloc_pages(gfp, order);
+	return alloc_pages_node(node, gfp, order);
+}
+
+void *scull_numa_vmalloc_on(unsigned long size, int local)
+{
+	int node = scull_numa_node(local);
+
+	if (node == NUMA_NO_NODE)
+		return vmalloc(size);
+	return vmalloc_node(size, node);
+}
+
+struct page *scull_numa_alloc_pages(gfp_t gfp, unsigned int order)
+{
+	return scull_numa_alloc_pages_on(gfp, order, numa_mem_id());
+}
+
+void *scull_numa_vmalloc(unsigned long size)
+{
+	return scull_numa_vmalloc_on(size, numa_mem_id());
+}
+
+
+unsigned long *scull_numa_count_start(void)
+{
+	return kcalloc(nr_node_ids, sizeof(unsigned long), GFP_KERNEL);
+}
+
+void scull_numa_count_page(unsigned long *count, struct page *page)
+{
+	if (count) /* no memory to count with: show nothing */
+		count[page_to_nid(page)]++;
+}
+
+void scull_numa_count(unsigned long *count, const void *addr, unsigned long size)
+{
+	unsigned long off;
+
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		if (is_vmalloc_addr(addr))
+			scull_numa_count_page(count, vmalloc_to_page(addr + off));
+		else
+			scull_numa_count_page(count, virt_to_page(addr + off));
+	}
+}
+
+void scull_numa_show(struct seq_file *m, unsigned long *count)
+{
+	int node;
+
+	if (!count)
+		return;
+	seq_printf(m, "  pages per node:");
+	for_each_node_state(node, N_MEMORY)
+		seq_printf(m, " %d:%lu", node, count[node]);
+	seq_printf(m, "\n");
+	kfree(count);
+}
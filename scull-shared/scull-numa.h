@@ -0,0 +1,56 @@
+/*
+ * scull-numa.h
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef SCULL_SHARED_SCULL_NUMA_H_
+#define SCULL_SHARED_SCULL_NUMA_H_
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+struct seq_file;
+
+/*
+ * Where a driver's quanta go, set with the "numa" parameter (writable
+ * at run time through sysfs):
+ *
+ *	none		no hint: the writer's memory policy decides (default)
+ *	local		the node of the CPU doing the write
+ *	interleave	every node with memory in turn, quantum by quantum
+ *	<n>		node n, falling back to others when it is full
+ */
+
+/* The pages of one quantum, and a vmalloc()ed quantum */
+struct page *scull_numa_alloc_pages(gfp_t gfp, unsigned int order);
+void *scull_numa_vmalloc(unsigned long size);
+
+/*
+ * The same on behalf of another thread, such as a reserve worker:
+ * "local" is the node "local" means, numa_mem_id() of the thread the
+ * quantum is really for.
+ */
+struct page *scull_numa_alloc_pages_on(gfp_t gfp, unsigned int order, int local);
+void *scull_numa_vmalloc_on(unsigned long size, int local);
+
+/*
+ * Per-node usage for /proc: start a count, add the pages at "addr"
+ * (linear-mapped or vmalloc()ed) or single pages, then print and
+ * free it.
+ */
+unsigned long *scull_numa_count_start(void);
+void scull_numa_count(unsigned long *count, const void *addr, unsigned long size);
+void scull_numa_count_page(unsigned long *count, struct page *page);
+void scull_numa_show(struct seq_file *m, unsigned long *count);
+
+#endif /* SCULL_SHARED_SCULL_NUMA_H_ */
@@ -0,0 +1,102 @@
+/*
+ * scull-reserve.c
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>		/* MAX_LFS_FILESIZE */
+#include <linux/slab.h>
+#include <linux/sched.h>	/* cond_resched() */
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+
+#include "scull-reserve.h"
+
+/* Fewer quanta than this aren't worth a thread of their own */
+#define SCULL_RESERVE_PER_WORKER 32
+
+int scull_reserve_get(struct scull_reserve *r, const void __user *arg)
+{
+	if (copy_from_user(r, arg, sizeof(*r)))
+		return -EFAULT;
+	if (!r->length || r->offset > MAX_LFS_FILESIZE ||
+	    r->length > MAX_LFS_FILESIZE - r->offset)
+		return -EINVAL;
+	return 0;
+}
+
+struct scull_reserve_work {
+	struct work_struct work;
+	void **quanta;
+	unsigned long n;
+	unsigned long failed;
+	scull_reserve_fn alloc;
+	void *arg;
+};
+
+static void scull_reserve_run(struct scull_reserve_work *w)
+{
+	unsigned long i;
+
+	for (i = 0; i < w->n; i++) {
+		w->quanta[i] = w->alloc(w->arg);
+		if (!w->quanta[i])
+			w->failed++;
+		cond_resched();
+	}
+}
+
+static void scull_reserve_work_fn(struct work_struct *work)
+{
+	scull_reserve_run(container_of(work, struct scull_reserve_work, work));
+}
+
+unsigned long scull_reserve_alloc(void **quanta, unsigned long n,
+		scull_reserve_fn alloc, void *arg)
+{
+	struct scull_reserve_work one, *w = &one;
+	unsigned long per, failed = 0;
+	int i, workers;
+
+	workers = min_t(unsigned long, num_online_cpus(),
+			DIV_ROUND_UP(n, SCULL_RESERVE_PER_WORKER));
+	if (workers > 1)
+		w = kcalloc(workers, sizeof(*w), GFP_KERNEL);
+	if (workers <= 1 || !w) {
+		w = &one;
+		workers = 1;
+	}
+
+	per = DIV_ROUND_UP(n, workers);
+	for (i = 0; i < workers; i++) {
+		w[i].quanta = quanta + i * per;
+		w[i].n = i * per < n ? min(per, n - i * per) : 0;
+		w[i].failed = 0;
+		w[i].alloc = alloc;
+		w[i].arg = arg;
+		if (i) {
+			INIT_WORK(&w[i].work, scull_reserve_work_fn);
+			queue_work(system_unbound_wq, &w[i].work);
+		}
+	}
+	scull_reserve_run(w); /* share 0 is ours */
+	for (i = 0; i < workers; i++) {
+		if (i)
+			flush_work(&w[i].work);
+		failed += w[i].failed;
+	}
+	if (w != &one)
+		kfree(w);
+	return failed;
+}
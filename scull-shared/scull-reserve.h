@@ -0,0 +1,49 @@
+/*
+ * scull-reserve.h
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef SCULL_SHARED_SCULL_RESERVE_H_
+#define SCULL_SHARED_SCULL_RESERVE_H_
+
+#include <linux/types.h>
+
+/*
+ * The argument of the drivers' IOCRESERVE ioctls: a byte range to give
+ * memory to ahead of time, zero-filled, so that writing it later never
+ * allocates. The size of the device is left alone, as with fallocate()
+ * and FALLOC_FL_KEEP_SIZE; reserved memory goes at the next trim.
+ */
+struct scull_reserve {
+	__u64 offset;
+	__u64 length;
+};
+
+/* Quanta a driver reserves at a time, with the device locked */
+#define SCULL_RESERVE_BATCH 1024
+
+/* Copy in a range: -EINVAL if empty, or past what a file can hold */
+int scull_reserve_get(struct scull_reserve *r, const void __user *arg);
+
+/*
+ * Fill quanta[0..n-1] with alloc(arg), a zeroed quantum each. A batch
+ * of any size is shared out among worker threads, one per online CPU
+ * at most, so that the zeroing runs in parallel; the caller's own
+ * thread does a share too. Slots that couldn't be had are left NULL,
+ * and counted in the return value.
+ */
+typedef void *(*scull_reserve_fn)(void *arg);
+unsigned long scull_reserve_alloc(void **quanta, unsigned long n,
+		scull_reserve_fn alloc, void *arg);
+
+#endif /* SCULL_SHARED_SCULL_RESERVE_H_ */
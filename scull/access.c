@@ -28,6 +28,9 @@
 #include <linux/tty.h>
 #include <asm/atomic.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/kref.h>
 #include <linux/cred.h> /* current_uid(), current_euid() */
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
@@ -81,8 +84,8 @@ static int scull_s_release(struct inode *inode, struct file *filp)
 struct file_operations scull_sngl_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =     	scull_llseek,
-	.read =       	scull_read,
-	.write =      	scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
@@ -143,8 +146,8 @@ static int scull_u_release(struct inode *inode, struct file *filp)
 struct file_operations scull_user_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
@@ -216,8 +219,8 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 struct file_operations scull_wusr_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
@@ -226,52 +229,108 @@ struct file_operations scull_wusr_fops = {
 /************************************************************************
  *
  * Finally the `cloned' private device. This is trickier because it
- * involves list management, and dynamic allocation.
+ * involves a lookup table, reference counts and dynamic allocation.
  */
 
-/* The clone-specific data structure includes a key field */
+/*
+ * The clone-specific data structure includes a key field, and a count
+ * of the files that have it open: the device goes away on last close.
+ */
 
 struct scull_listitem {
 	struct scull_dev device;
 	dev_t key;
-	struct list_head list;
-    
+	struct kref ref;
+	struct hlist_node node;
+	struct rcu_head rcu;
 };
 
-/* The list of devices, and a lock to protect it */
-static LIST_HEAD(scull_c_list);
+/*
+ * The devices, hashed by key. Lookups run under RCU alone; the lock is
+ * only taken to add or remove one, so opens by different terminals
+ * don't serialize on it and the cost doesn't grow with their number.
+ */
+#define SCULL_C_HASH_BITS 10
+static DEFINE_HASHTABLE(scull_c_table, SCULL_C_HASH_BITS);
 static DEFINE_SPINLOCK(scull_c_lock);
 
 /* A placeholder scull_dev which really just holds the cdev stuff. */
 static struct scull_dev scull_c_device;   
 
-/* Look for a device or create one if missing */
-static struct scull_dev *scull_c_lookfor_device(dev_t key)
+/*
+ * Find a device and take a reference to it. Called under RCU or the
+ * lock; one whose count already dropped to zero is on its way out.
+ */
+static struct scull_listitem *scull_c_find(dev_t key)
 {
 	struct scull_listitem *lptr;
 
-	list_for_each_entry(lptr, &scull_c_list, list) {
-		if (lptr->key == key)
-			return &(lptr->device);
+	hash_for_each_possible_rcu(scull_c_table, lptr, node, key) {
+		if (lptr->key == key && kref_get_unless_zero(&lptr->ref))
+			return lptr;
 	}
+	return NULL;
+}
 
-	/* not found */
-	lptr = kmalloc(sizeof(struct scull_listitem), GFP_KERNEL);
-	if (!lptr)
-		return NULL;
+/* Look for a device or create one if missing */
+static struct scull_dev *scull_c_lookfor_device(dev_t key)
+{
+	struct scull_listitem *lptr, *new;
 
-	/* initialize the device */
-	memset(lptr, 0, sizeof(struct scull_listitem));
-	lptr->key = key;
-	scull_trim(&(lptr->device)); /* initialize it */
-	mutex_init(&lptr->device.lock);
+	rcu_read_lock();
+	lptr = scull_c_find(key);
+	rcu_read_unlock();
+	if (lptr)
+		return &(lptr->device);
 
-	/* place it in the list */
-	list_add(&lptr->list, &scull_c_list);
+	/* not found: build one without holding the lock */
+	new = kzalloc(sizeof(struct scull_listitem), GFP_KERNEL);
+	if (!new)
+		return NULL;
+	new->key = key;
+	kref_init(&new->ref);
+	if (scull_data_init(&new->device)) {
+		kfree(new);
+		return NULL;
+	}
+	/* not evictable: a clone goes anyway when its last user does */
+	scull_evict_dev_init(&new->device.evict, &new->device.lock, NULL);
+	scull_trim(&(new->device)); /* initialize it */
+	mutex_init(&new->device.lock);
+	scull_async_queue_init(&new->device.aio, &new->device.lock);
+
+	/* and place it in the table, unless another open beat us to it */
+	spin_lock(&scull_c_lock);
+	lptr = scull_c_find(key);
+	if (!lptr) {
+		hash_add_rcu(scull_c_table, &new->node, key);
+		lptr = new;
+		new = NULL;
+	}
+	spin_unlock(&scull_c_lock);
 
+	if (new) {
+		scull_data_free(&new->device);
+		scull_async_queue_release(&new->device.aio);
+		kfree(new);
+	}
 	return &(lptr->device);
 }
 
+/* Called by kref_put_lock() with the lock held, on last close */
+static void scull_c_free(struct kref *ref)
+{
+	struct scull_listitem *lptr = container_of(ref, struct scull_listitem, ref);
+
+	hash_del_rcu(&lptr->node);
+	spin_unlock(&scull_c_lock);
+
+	/* nobody else can reach it now; RCU readers may still be looking */
+	scull_data_free(&(lptr->device));
+	scull_async_queue_release(&lptr->device.aio);
+	kfree_rcu(lptr, rcu);
+}
+
 static int scull_c_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev;
@@ -283,27 +342,28 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 	}
 	key = tty_devnum(current->signal->tty);
 
-	/* look for a scullc device in the list */
-	spin_lock(&scull_c_lock);
+	/* look for a scullc device in the table */
 	dev = scull_c_lookfor_device(key);
-	spin_unlock(&scull_c_lock);
-
 	if (!dev)
 		return -ENOMEM;
 
 	/* then, everything else is copied from the bare scull device */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		mutex_lock(&dev->lock);
 		scull_trim(dev);
+		mutex_unlock(&dev->lock);
+	}
 	filp->private_data = dev;
 	return 0;          /* success */
 }
 
 static int scull_c_release(struct inode *inode, struct file *filp)
 {
-	/*
-	 * Nothing to do, because the device is persistent.
-	 * A `real' cloned device should be freed on last close
-	 */
+	struct scull_listitem *lptr;
+
+	/* drop our reference; the last one frees the device */
+	lptr = container_of(filp->private_data, struct scull_listitem, device);
+	kref_put_lock(&lptr->ref, scull_c_free, &scull_c_lock);
 	return 0;
 }
 
@@ -315,8 +375,8 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 struct file_operations scull_priv_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
@@ -350,7 +410,13 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	/* Initialize the device structure */
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
+	if (scull_data_init(dev)) {
+		printk(KERN_NOTICE "Out of memory setting up %s\n", devinfo->name);
+		return;
+	}
 	mutex_init(&dev->lock);
+	scull_async_queue_init(&dev->aio, &dev->lock);
+	scull_evict_dev_init(&dev->evict, &dev->lock, scull_discard);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -390,20 +456,26 @@ int scull_access_init(dev_t firstdev)
  */
 void scull_access_cleanup(void)
 {
-	struct scull_listitem *lptr, *next;
+	struct scull_listitem *lptr;
+	struct hlist_node *next;
 	int i;
 
 	/* Clean up the static devs */
 	for (i = 0; i < SCULL_N_ADEVS; i++) {
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
+		if (!dev->data)
+			continue; /* never set up */
 		cdev_del(&dev->cdev);
-		scull_trim(scull_access_devs[i].sculldev);
+		scull_evict_dev_release(&dev->evict);
+		scull_data_free(dev);
+		scull_async_queue_release(&dev->aio);
 	}
 
-    	/* And all the cloned devices */
-	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
-		list_del(&lptr->list);
-		scull_trim(&(lptr->device));
+    	/* And any cloned devices (all closed by now, so normally none) */
+	hash_for_each_safe(scull_c_table, i, next, lptr, node) {
+		hash_del(&lptr->node);
+		scull_data_free(&(lptr->device));
+		scull_async_queue_release(&lptr->device.aio);
 		kfree(lptr);
 	}
 
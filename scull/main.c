@@ -27,8 +27,15 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/mm.h>		/* alloc_pages() */
+#include <linux/rwsem.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+#include <linux/workqueue.h>
+#include <linux/sched/signal.h>
+#include <linux/math64.h>	/* div_u64() */
 
 #include <linux/uaccess.h>	/* copy_*_user */
+#include <linux/uio.h>		/* iov_iter */
 
 #include "scull.h"		/* local definitions */
 #include "access_ok_version.h"
@@ -43,45 +50,219 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_stripes = 0;		/* range locks per device, 0 for none */
+static int scull_stripe_quanta = 16;	/* quanta covered by each */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_stripes, int, S_IRUGO);
+module_param(scull_stripe_quanta, int, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
+static struct rw_semaphore *scull_stripe_locks; /* all devices' stripes */
 
 
+/*
+ * Quanta are page-aligned blocks from the page allocator, each a
+ * compound page so the mapping code can hand out its pages one by
+ * one. They start zeroed, "zero" aside: whatever the device has not
+ * been written may still be read or mapped. Only a quantum about to
+ * be written whole (see scull_write_quantum()) can skip that.
+ */
+static void *scull_alloc_quantum(int quantum, bool zero)
+{
+	struct page *page;
+
+	page = alloc_pages(GFP_KERNEL | __GFP_COMP | (zero ? __GFP_ZERO : 0),
+			get_order(quantum));
+	return page ? page_address(page) : NULL;
+}
+
+static void scull_free_quantum(void *data, int quantum)
+{
+	__free_pages(virt_to_page(data), get_order(quantum));
+}
+
+/*
+ * A device's quanta hang off a tree of their own, so that trimming can
+ * swap in an empty one and leave the old one to be freed in the
+ * background: a writer opening a device with gigabytes in it should
+ * not wait while they are given back.
+ */
+struct scull_tree {
+	struct xarray xa;
+	int quantum;		/* the size of its quanta, once detached */
+	struct list_head reap;
+};
+
+/* Quanta freed per pass of the reaper, before it lets others run */
+#define SCULL_REAP_BATCH 1024
+
+static LIST_HEAD(scull_reap_list);	/* detached trees, oldest first */
+static DEFINE_SPINLOCK(scull_reap_lock);
+static void scull_reap_work_fn(struct work_struct *work);
+static DECLARE_WORK(scull_reap_work, scull_reap_work_fn);
+
+static struct scull_tree *scull_new_tree(void)
+{
+	struct scull_tree *tree = kmalloc(sizeof(*tree), GFP_KERNEL);
+
+	if (tree)
+		xa_init(&tree->xa);
+	return tree;
+}
+
+/* Queue a tree that nobody can reach any more for freeing */
+static void scull_reap_tree(struct scull_tree *tree, int quantum)
+{
+	tree->quantum = quantum;
+	spin_lock(&scull_reap_lock);
+	list_add_tail(&tree->reap, &scull_reap_list);
+	spin_unlock(&scull_reap_lock);
+	queue_work(system_unbound_wq, &scull_reap_work);
+}
+
+/*
+ * Free a batch of quanta from the oldest detached tree. Only the
+ * reaper takes trees off the list, so it can work on one unlocked.
+ * Returns true if there is more to do.
+ */
+static bool scull_reap_some(void)
+{
+	struct scull_tree *tree;
+	unsigned long index;
+	void *quantum;
+	int count = 0;
+	bool more;
+
+	spin_lock(&scull_reap_lock);
+	tree = list_first_entry_or_null(&scull_reap_list, struct scull_tree, reap);
+	spin_unlock(&scull_reap_lock);
+	if (!tree)
+		return false;
+
+	xa_for_each(&tree->xa, index, quantum) {
+		xa_erase(&tree->xa, index);
+		scull_free_quantum(quantum, tree->quantum);
+		if (++count == SCULL_REAP_BATCH)
+			break;
+	}
+
+	spin_lock(&scull_reap_lock);
+	if (xa_empty(&tree->xa))
+		list_del(&tree->reap);
+	else
+		tree = NULL;
+	more = !list_empty(&scull_reap_list);
+	spin_unlock(&scull_reap_lock);
+	kfree(tree);
+	return more;
+}
+
+static void scull_reap_work_fn(struct work_struct *work)
+{
+	if (scull_reap_some())
+		queue_work(system_unbound_wq, &scull_reap_work);
+}
+
+/* Free whatever is left at once: for unloading */
+static void scull_reap_all(void)
+{
+	cancel_work_sync(&scull_reap_work);
+	while (scull_reap_some())
+		cond_resched();
+}
+
+/*
+ * Give a device an empty tree of quanta, and take it away again
+ * (along with any data) when the device goes.
+ */
+int scull_data_init(struct scull_dev *dev)
+{
+	struct scull_tree *tree = scull_new_tree();
+
+	if (!tree)
+		return -ENOMEM;
+	dev->data = &tree->xa;
+	return 0;
+}
+
+void scull_data_free(struct scull_dev *dev)
+{
+	if (!dev->data)
+		return;
+	scull_reap_tree(container_of(dev->data, struct scull_tree, xa), dev->quantum);
+	dev->data = NULL;
+}
+
 /*
  * Empty out the scull device; must be called with the device
- * semaphore held.
+ * semaphore held. Striped I/O doesn't take that, so it is shut out
+ * here as well. The old data is detached in one go and freed later;
+ * only if there is no memory for an empty tree is it freed here.
  */
 int scull_trim(struct scull_dev *dev)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
-		}
-		next = dptr->next;
-		kfree(dptr);
+	struct scull_tree *old = NULL, *new = NULL;
+	int old_quantum = dev->quantum;
+	unsigned long index;
+	void *quantum;
+
+	if (atomic_read(&dev->vmas)) /* don't trim: there are active mappings */
+		return -EBUSY;
+
+	if (dev->data && !xa_empty(dev->data))
+		new = scull_new_tree();
+
+	if (dev->stripes)
+		down_write(&dev->trim_sem);
+	if (new) {
+		old = container_of(dev->data, struct scull_tree, xa);
+		dev->data = &new->xa;
+	} else if (dev->data) {
+		xa_for_each(dev->data, index, quantum)
+			scull_free_quantum(quantum, dev->quantum);
+		xa_destroy(dev->data);
 	}
+	scull_evict_reset(&dev->evict);
 	dev->size = 0;
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	dev->data = NULL;
+	if (dev->stripes)
+		up_write(&dev->trim_sem);
+
+	if (old)
+		scull_reap_tree(old, old_quantum);
 	return 0;
 }
+/*
+ * Evictable mode: give back quantum "index" under memory pressure,
+ * with the device mutex held. Striped I/O is kept off with trim_sem,
+ * and a mapped device keeps everything.
+ */
+bool scull_discard(struct scull_evict *e, unsigned long index)
+{
+	struct scull_dev *dev = container_of(e, struct scull_dev, evict);
+	void *quantum;
+
+	if (atomic_read(&dev->vmas))
+		return false;
+	if (dev->stripes && !down_write_trylock(&dev->trim_sem))
+		return false;
+	quantum = xa_erase(dev->data, index);
+	if (quantum)
+		scull_free_quantum(quantum, dev->quantum);
+	if (dev->stripes)
+		up_write(&dev->trim_sem);
+	return true;
+}
+
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
  * The proc filesystem: function to read and entry
@@ -89,25 +270,23 @@ int scull_trim(struct scull_dev *dev)
 
 int scull_read_procmem(struct seq_file *s, void *v)
 {
-        int i, j;
+        int i;
         int limit = s->size - 80; /* Don't print more than this */
 
         for (i = 0; i < scull_nr_devs && s->count <= limit; i++) {
                 struct scull_dev *d = &scull_devices[i];
-                struct scull_qset *qs = d->data;
+                unsigned long index;
+                void *quantum;
                 if (mutex_lock_interruptible(&d->lock))
                         return -ERESTARTSYS;
                 seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li\n",
                              i, d->qset, d->quantum, d->size);
-                for (; qs && s->count <= limit; qs = qs->next) { /* scan the list */
-                        seq_printf(s, "  item at %p, qset at %p\n",
-                                     qs, qs->data);
-                        if (qs->data && !qs->next) /* dump only the last item */
-                                for (j = 0; j < d->qset; j++) {
-                                        if (qs->data[j])
-                                                seq_printf(s, "    % 4i: %8p\n",
-                                                             j, qs->data[j]);
-                                }
+                scull_async_show(s, &d->aio);
+                scull_evict_show(s, &d->evict);
+                xa_for_each(d->data, index, quantum) { /* scan the tree */
+                        if (s->count > limit)
+                                break;
+                        seq_printf(s, "    % 4lu: %8p\n", index, quantum);
                 }
                 mutex_unlock(&scull_devices[i].lock);
         }
@@ -143,23 +322,19 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
 	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
-	int i;
+	unsigned long index, first = 0;
+	void *quantum;
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 			(int) (dev - scull_devices), dev->qset,
 			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) { /* scan the list */
-		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "    % 4i: %8p\n",
-							i, d->data[i]);
-			}
-	}
+	/* dump only the last qset's worth of quanta */
+	if (dev->size / dev->quantum > dev->qset)
+		first = dev->size / dev->quantum - dev->qset;
+	xa_for_each_start(dev->data, index, quantum, first)
+		seq_printf(s, "    % 4lu: %8p\n", index, quantum);
 	mutex_unlock(&dev->lock);
 	return 0;
 }
@@ -260,132 +435,308 @@ int scull_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 /*
- * Follow the list
+ * Look up quantum number "index", allocating it if "create" is set.
+ * Must be called with the device mutex, or the quantum's stripe lock
+ * for writing, held.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+static void *scull_lookup_quantum(struct scull_dev *dev, unsigned long index, bool create)
 {
-	struct scull_qset *qs = dev->data;
+	void *quantum = xa_load(dev->data, index);
 
-        /* Allocate first qset explicitly if need be */
-	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-		if (qs == NULL)
-			return NULL;  /* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
+	if (quantum)
+		scull_evict_touch(&dev->evict, index);
+	if (quantum || !create)
+		return quantum;
+
+	quantum = scull_alloc_quantum(dev->quantum, true);
+	if (!quantum)
+		return NULL;
+	if (xa_is_err(xa_store(dev->data, index, quantum, GFP_KERNEL))) {
+		scull_free_quantum(quantum, dev->quantum);
+		return NULL;
 	}
+	scull_evict_add(&dev->evict, index);
+	return quantum;
+}
 
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
-		}
-		qs = qs->next;
-		continue;
+/*
+ * Write new quantum "index" whole, from "from". As the data covers
+ * it, the quantum isn't zeroed first, just whatever a fault leaves
+ * uncopied; and it only goes in the tree once it is filled, since
+ * mappings look quanta up without locking. Returns the bytes copied,
+ * or -ENOMEM with nothing consumed.
+ */
+static ssize_t scull_write_quantum(struct scull_dev *dev, unsigned long index,
+		struct iov_iter *from)
+{
+	void *quantum = scull_alloc_quantum(dev->quantum, false);
+	size_t copied;
+
+	if (!quantum)
+		return -ENOMEM;
+	copied = copy_from_iter(quantum, dev->quantum, from);
+	if (copied < dev->quantum)
+		memset(quantum + copied, 0, dev->quantum - copied);
+	if (xa_is_err(xa_store(dev->data, index, quantum, GFP_KERNEL))) {
+		scull_free_quantum(quantum, dev->quantum);
+		iov_iter_revert(from, copied);
+		return -ENOMEM;
 	}
-	return qs;
+	scull_evict_add(&dev->evict, index);
+	return copied;
 }
 
 /*
- * Data management: read and write
+ * Striped mode. With scull_stripes set, the bare devices don't funnel
+ * I/O through the device mutex: every run of scull_stripe_quanta
+ * quanta maps to one of scull_stripes read/write semaphores, taken
+ * shared to read and exclusive to write, so transfers to different
+ * regions of a device go ahead in parallel. A transfer that crosses
+ * regions holds one stripe at a time, so it is atomic per region
+ * only. Everything that changes the device as a whole (trim, and
+ * with it a change of quantum) holds trim_sem exclusive; striped I/O
+ * holds it shared. The xarray has its own lock for the tree itself.
  */
+static struct rw_semaphore *scull_stripe(struct scull_dev *dev, unsigned long index)
+{
+	if (!dev->stripes)
+		return NULL; /* the caller holds the device mutex */
+	return dev->stripes + ((index / scull_stripe_quanta) & (scull_stripes - 1));
+}
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/* Move from holding stripe "*held" to holding "next" */
+static void scull_stripe_switch(struct rw_semaphore **held,
+		struct rw_semaphore *next, bool write)
 {
-	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
+	if (*held == next)
+		return;
+	if (*held && write)
+		up_write(*held);
+	else if (*held)
+		up_read(*held);
+	if (next && write)
+		down_write(next);
+	else if (next)
+		down_read(next);
+	*held = next;
+}
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+/* Writers to different stripes may both grow the device */
+static void scull_extend(struct scull_dev *dev, unsigned long end)
+{
+	unsigned long size = READ_ONCE(dev->size), old;
 
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+	while (size < end) {
+		old = cmpxchg(&dev->size, size, end);
+		if (old == size)
+			break;
+		size = old;
+	}
+}
 
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
+/*
+ * Data management: read and write. Both work on an iov_iter, so a
+ * readv() or writev() is served in one pass, however many segments
+ * and quanta it spans. scull_async_rw() takes the device mutex around
+ * them, once per request or once per batch of AIO; in striped mode
+ * they lock as they go instead.
+ */
 
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
+static ssize_t scull_do_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_dev *dev = iocb->ki_filp->private_data; 
+	int quantum = dev->quantum;
+	size_t count = iov_iter_count(to);
+	unsigned long index, size = READ_ONCE(dev->size);
+	int q_pos;
+	size_t chunk, copied, done = 0;
+	struct rw_semaphore *held = NULL;
+	void *data;
+	ssize_t retval = 0;
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	if (iocb->ki_pos >= size)
+		return 0;
+	if (iocb->ki_pos + count > size)
+		count = size - iocb->ki_pos;
+
+	/* find the first quantum and the offset in it */
+	index = (long)iocb->ki_pos / quantum;
+	q_pos = (long)iocb->ki_pos % quantum;
+
+	/* then copy quantum by quantum, under the one lock or stripe by stripe */
+	while (done < count) {
+		scull_stripe_switch(&held, scull_stripe(dev, index), false);
+		data = scull_lookup_quantum(dev, index, false);
+
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		if (data)
+			copied = copy_to_iter(data + q_pos, chunk, to);
+		else /* a hole reads as zeros */
+			copied = iov_iter_zero(chunk, to);
+		done += copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		index++;
+		q_pos = 0;
+	}
+	scull_stripe_switch(&held, NULL, false);
+	/* a fault after some progress is reported as a short read */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
+	}
+	return retval;
+}
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+static ssize_t scull_do_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scull_dev *dev = iocb->ki_filp->private_data;
+	int quantum = dev->quantum;
+	size_t count = iov_iter_count(from);
+	unsigned long index;
+	int q_pos;
+	size_t chunk, copied, done = 0;
+	struct rw_semaphore *held = NULL;
+	void *data;
+	ssize_t retval = -ENOMEM; /* value used if nothing is written */
+
+	if (!count)
+		return 0;
+
+	/* find the first quantum and the offset in it */
+	index = (long)iocb->ki_pos / quantum;
+	q_pos = (long)iocb->ki_pos % quantum;
+
+	/* then fill quantum by quantum, allocating as we go */
+	while (done < count) {
+		scull_stripe_switch(&held, scull_stripe(dev, index), true);
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		/* a new quantum written whole needn't be zeroed */
+		data = scull_lookup_quantum(dev, index, chunk < quantum);
+		if (data) {
+			copied = copy_from_iter(data + q_pos, chunk, from);
+		} else if (chunk == quantum) {
+			ssize_t ret = scull_write_quantum(dev, index, from);
+
+			if (ret < 0)
+				break;
+			copied = ret;
+		} else {
+			break;
+		}
+		done += copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		index++;
+		q_pos = 0;
+	}
+	scull_stripe_switch(&held, NULL, true);
+	/* running out of memory or faulting part way is a short write */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	*f_pos += count;
-	retval = count;
 
-  out:
-	mutex_unlock(&dev->lock);
+        /* update the size */
+	scull_extend(dev, iocb->ki_pos);
 	return retval;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/* Striped I/O only needs to keep trim away */
+static ssize_t scull_striped_rw(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *iter, scull_iter_op op)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+	ssize_t retval;
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!down_read_trylock(&dev->trim_sem))
+			return -EAGAIN;
+	} else if (down_read_killable(&dev->trim_sem))
 		return -ERESTARTSYS;
+	retval = op(iocb, iter);
+	up_read(&dev->trim_sem);
+	return retval;
+}
 
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_dev *dev = iocb->ki_filp->private_data;
 
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	*f_pos += count;
-	retval = count;
+	if (dev->stripes)
+		return scull_striped_rw(dev, iocb, to, scull_do_read);
+	return scull_async_rw(&dev->aio, iocb, to, scull_do_read);
+}
 
-        /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scull_dev *dev = iocb->ki_filp->private_data;
 
-  out:
-	mutex_unlock(&dev->lock);
+	if (dev->stripes)
+		return scull_striped_rw(dev, iocb, from, scull_do_write);
+	return scull_async_rw(&dev->aio, iocb, from, scull_do_write);
+}
+
+/*
+ * Reserving: give every missing quantum in the range its memory now,
+ * a window of SCULL_RESERVE_BATCH quanta at a time. Each window's
+ * quanta are allocated (and zeroed) in parallel, with the device
+ * locked as for a write, and the lock is let go between windows so
+ * that I/O gets a look in.
+ */
+static void *scull_reserve_quantum(void *arg)
+{
+	return scull_alloc_quantum(*(int *)arg, true);
+}
+
+static int scull_reserve(struct scull_dev *dev, struct scull_reserve *r)
+{
+	unsigned long *indices, index, last;
+	u64 pos = r->offset, end = r->offset + r->length;
+	void **quanta;
+	int i, n, quantum, retval = 0;
+
+	quanta = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void *), GFP_KERNEL);
+	indices = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(long), GFP_KERNEL);
+	if (!quanta || !indices)
+		retval = -ENOMEM;
+
+	while (!retval && pos < end) {
+		if (signal_pending(current) || mutex_lock_interruptible(&dev->lock)) {
+			retval = -ERESTARTSYS;
+			break;
+		}
+		if (dev->stripes)
+			down_write(&dev->trim_sem);
+		quantum = dev->quantum; /* may have changed since the last window */
+		index = div_u64(pos, quantum);
+		last = min_t(u64, div_u64(end - 1, quantum), index + SCULL_RESERVE_BATCH - 1);
+		for (n = 0; index <= last; index++)
+			if (!xa_load(dev->data, index))
+				indices[n++] = index;
+		pos = (u64)index * quantum;
+
+		if (scull_reserve_alloc(quanta, n, scull_reserve_quantum, &quantum))
+			retval = -ENOMEM;
+		for (i = 0; i < n; i++) {
+			if (!quanta[i])
+				continue;
+			if (xa_is_err(xa_store(dev->data, indices[i], quanta[i], GFP_KERNEL))) {
+				scull_free_quantum(quanta[i], quantum);
+				retval = -ENOMEM;
+				continue;
+			}
+			scull_evict_add(&dev->evict, indices[i]);
+		}
+		if (dev->stripes)
+			up_write(&dev->trim_sem);
+		mutex_unlock(&dev->lock);
+	}
+	kfree(indices);
+	kfree(quanta);
 	return retval;
 }
 
@@ -398,6 +749,7 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 	int err = 0, tmp;
 	int retval = 0;
+	struct scull_reserve r;
     
 	/*
 	 * extract the type and number bitfields, and don't decode
@@ -508,6 +860,14 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	  case SCULL_IOCRESERVE: /* arg points to the range */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		retval = scull_reserve_get(&r, (void __user *)arg);
+		if (retval == 0)
+			retval = scull_reserve(filp->private_data, &r);
+		break;
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -522,6 +882,37 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
  * The "extended" operations -- only seek
  */
 
+/*
+ * SEEK_DATA and SEEK_HOLE: where the first quantum at or after "off"
+ * that is there ("data"), or missing, starts; the end of the device
+ * counts as a hole. Called with the device mutex held, which keeps
+ * the tree from being swapped out by a trim.
+ */
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t off, bool data)
+{
+	unsigned long index, last, i;
+	void *quantum;
+
+	if (off < 0 || off >= dev->size)
+		return -ENXIO;
+	index = div_u64(off, dev->quantum);
+	last = (dev->size - 1) / dev->quantum;
+	if (data) {
+		if (!xa_find(dev->data, &index, last, XA_PRESENT))
+			return -ENXIO;
+	} else {
+		/* walk the run of quanta from "index" to its end */
+		xa_for_each_start(dev->data, i, quantum, index) {
+			if (i != index || index > last)
+				break;
+			index++;
+		}
+		if (index > last)
+			return dev->size;
+	}
+	return max_t(loff_t, off, (loff_t)index * dev->quantum);
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
 	struct scull_dev *dev = filp->private_data;
@@ -540,6 +931,16 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	  case SEEK_DATA:
+	  case SEEK_HOLE:
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		newpos = scull_seek_data(dev, off, whence == SEEK_DATA);
+		mutex_unlock(&dev->lock);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	  default: /* can't happen */
 		return -EINVAL;
 	}
@@ -553,9 +954,10 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
+	.mmap =     scull_mmap,
 	.open =     scull_open,
 	.release =  scull_release,
 };
@@ -574,14 +976,20 @@ void scull_cleanup_module(void)
 	int i;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	/* no more reclaim: the shrinker mustn't see devices go */
+	scull_evict_cleanup();
+
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
-			scull_trim(scull_devices + i);
 			cdev_del(&scull_devices[i].cdev);
+			scull_evict_dev_release(&scull_devices[i].evict);
+			scull_data_free(scull_devices + i);
+			scull_async_queue_release(&scull_devices[i].aio);
 		}
 		kfree(scull_devices);
 	}
+	kfree(scull_stripe_locks);
 
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 	scull_remove_proc();
@@ -593,6 +1001,10 @@ void scull_cleanup_module(void)
 	/* and call the cleanup functions for friend devices */
 	scull_p_cleanup();
 	scull_access_cleanup();
+	scull_async_cleanup();
+
+	/* and free what all of them have left behind */
+	scull_reap_all();
 
 }
 
@@ -635,6 +1047,27 @@ int scull_init_module(void)
 		return result;
 	}
 
+	result = scull_async_init();
+	if (result)
+		goto fail;
+	result = scull_evict_init();
+	if (result)
+		goto fail;
+
+	/* the devices' range locks, if striped */
+	if (scull_stripes > 0) {
+		scull_stripes = roundup_pow_of_two(min(scull_stripes, 1024));
+		scull_stripe_quanta = max(scull_stripe_quanta, 1);
+		scull_stripe_locks = kmalloc_array(scull_nr_devs * scull_stripes,
+				sizeof(struct rw_semaphore), GFP_KERNEL);
+		if (!scull_stripe_locks) {
+			result = -ENOMEM;
+			goto fail;
+		}
+		for (i = 0; i < scull_nr_devs * scull_stripes; i++)
+			init_rwsem(scull_stripe_locks + i);
+	}
+
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -646,11 +1079,30 @@ int scull_init_module(void)
 	}
 	memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
+	/* their trees of quanta, before any device goes live */
+	for (i = 0; i < scull_nr_devs; i++)
+		if (scull_data_init(scull_devices + i))
+			break;
+	if (i < scull_nr_devs) {
+		while (i--)
+			scull_data_free(scull_devices + i);
+		kfree(scull_devices);
+		scull_devices = NULL;
+		result = -ENOMEM;
+		goto fail;
+	}
+
         /* Initialize each device. */
 	for (i = 0; i < scull_nr_devs; i++) {
 		scull_devices[i].quantum = scull_quantum;
 		scull_devices[i].qset = scull_qset;
 		mutex_init(&scull_devices[i].lock);
+		init_rwsem(&scull_devices[i].trim_sem);
+		if (scull_stripe_locks)
+			scull_devices[i].stripes = scull_stripe_locks + i * scull_stripes;
+		scull_async_queue_init(&scull_devices[i].aio, &scull_devices[i].lock);
+		scull_evict_dev_init(&scull_devices[i].evict, &scull_devices[i].lock,
+				scull_discard);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
@@ -0,0 +1,137 @@
+/*  -*- C -*-
+ * mmap.c -- memory mapping for the scull char module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/mm.h>		/* everything */
+#include <linux/errno.h>	/* error codes */
+#include <linux/fs.h>
+#include <linux/version.h>
+#include "scull.h"		/* local definitions */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+typedef int vm_fault_t;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+#define vm_flags_set(vma, flags)	((vma)->vm_flags |= (flags))
+#endif
+
+/*
+ * How many pages one fault maps: the faulting page and the others in
+ * the same aligned window, if they are on the device and in the vma.
+ */
+static unsigned int scull_fault_around = 16;
+module_param(scull_fault_around, uint, S_IRUGO | S_IWUSR);
+
+
+/*
+ * open and close: just keep track of how many times the device is
+ * mapped, to avoid releasing it.
+ */
+
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+/*
+ * The fault method. The page is found with one xarray lookup for its
+ * quantum, without the device mutex: quanta are only added while the
+ * device is mapped, never freed. Neighbouring pages are inserted in the
+ * same pass, so walking a large mapping costs one fault per window
+ * rather than one per page. A hole, or anything past the end of the
+ * device, gets the process a SIGBUS.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_dev *dev = vma->vm_private_data;
+	unsigned long per_quantum = dev->quantum >> PAGE_SHIFT;
+	unsigned long window = max(READ_ONCE(scull_fault_around), 1U);
+	unsigned long first, last, off, index = ULONG_MAX;
+	void *data = NULL;
+	vm_fault_t retval = VM_FAULT_SIGBUS;
+	int err;
+
+	/* the pages we may map: in the vma, on the device, in the window */
+	last = min(vma->vm_pgoff + vma_pages(vma),
+		   DIV_ROUND_UP(READ_ONCE(dev->size), PAGE_SIZE));
+	if (vmf->pgoff >= last)
+		return VM_FAULT_SIGBUS; /* out of range */
+	first = max(vmf->pgoff - vmf->pgoff % window, vma->vm_pgoff);
+	last = min(last, first + window);
+
+	for (off = first; off < last; off++) {
+		if (off / per_quantum != index) {
+			index = off / per_quantum;
+			data = xa_load(dev->data, index);
+		}
+		if (!data) /* a hole */
+			continue;
+
+		err = vm_insert_page(vma, vma->vm_start +
+				((off - vma->vm_pgoff) << PAGE_SHIFT),
+				virt_to_page(data) + off % per_quantum);
+		if (off != vmf->pgoff)
+			continue; /* a neighbour: best effort */
+		/* -EBUSY: a racing fault mapped it first */
+		retval = (err && err != -EBUSY) ? vmf_error(err) : VM_FAULT_NOPAGE;
+	}
+	return retval;
+}
+
+
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open =     scull_vma_open,
+	.close =    scull_vma_close,
+	.fault =    scull_vma_fault,
+};
+
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	/*
+	 * Counting the mapping under the mutex keeps a trim, which may
+	 * change the quantum, from slipping in between.
+	 */
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	/* every page of the device must lie within one quantum */
+	if (dev->quantum % PAGE_SIZE) {
+		mutex_unlock(&dev->lock);
+		return -ENODEV;
+	}
+	vma->vm_ops = &scull_vm_ops;
+	vma->vm_private_data = dev;
+	scull_vma_open(vma);
+	mutex_unlock(&dev->lock);
+
+	/* the fault handler inserts pages itself */
+	vm_flags_set(vma, VM_MIXEDMAP);
+	return 0;
+}
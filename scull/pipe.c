@@ -19,6 +19,7 @@
 
 #include <linux/kernel.h>	/* printk(), min() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* kvmalloc() */
 #include <linux/fs.h>		/* everything... */
 #include <linux/proc_fs.h>
 #include <linux/errno.h>	/* error codes */
@@ -30,16 +31,51 @@
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/seq_file.h>
+#include <linux/log2.h>	/* roundup_pow_of_two() */
+#include <linux/highmem.h>	/* kmap() */
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/version.h>
 
 #include "proc_ops_version.h"
 
 #include "scull.h"		/* local definitions */
 
+/*
+ * The buffer is a ring whose size is a power of two. "rp" and "wp"
+ * count the bytes ever read and written: they are masked to index the
+ * buffer, wp - rp is how much is buffered, and the ring is full when
+ * that equals buffersize.
+ *
+ * Normally every reader and writer takes the mutex. In single
+ * producer/single consumer mode (scull_p_spsc set when the pipe is
+ * first opened) only one reader and one writer may have it open: each
+ * side then owns its own counter and publishes it with a release
+ * store, which the other side picks up with an acquire load, and
+ * neither takes the mutex at all.
+ *
+ * splice() moves whole pages through a mutex-mode pipe without copying
+ * them: the page is queued by reference, together with the value of wp
+ * at the time, and a reader reaching that point in the ring takes the
+ * page's bytes next. Anything else, and everything in lockless mode,
+ * is copied through the ring as usual.
+ */
+struct scull_p_page {
+	struct page *page;
+	unsigned int offset, len;          /* what is left of it */
+	unsigned int at;                   /* the ring's wp when queued */
+};
+
 struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
-        char *buffer, *end;                /* begin of buf, end of buf */
-        int buffersize;                    /* used in pointer arithmetic */
-        char *rp, *wp;                     /* where to read, where to write */
+        char *buffer;                      /* the ring */
+        unsigned int buffersize;           /* a power of two */
+        unsigned int rp ____cacheline_aligned_in_smp; /* bytes read so far */
+        unsigned int wp ____cacheline_aligned_in_smp; /* bytes written so far */
+        bool spsc;                         /* lockless single reader/writer */
+        unsigned int lowat, hiwat;         /* see scull_p_readable() */
+        struct scull_p_page pages[SCULL_P_PAGES]; /* spliced-in pages */
+        unsigned int pin, pout;            /* pages queued, pages consumed */
         int nreaders, nwriters;            /* number of openings for r/w */
         struct fasync_struct *async_queue; /* asynchronous readers */
         struct mutex lock;              /* mutual exclusion mutex */
@@ -49,15 +85,40 @@ struct scull_pipe {
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;	/* buffer size */
+static int scull_p_max_buffer = 1 << 20; /* resizing beyond needs privilege */
+static bool scull_p_spsc = false;	/* lockless mode for new pipes */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);	/* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_max_buffer, int, S_IRUGO | S_IWUSR);
+module_param(scull_p_spsc, bool, S_IRUGO | S_IWUSR);
 
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
-static int spacefree(struct scull_pipe *dev);
+
+/*
+ * The counters are unsigned ints, so the ring must stay well short of
+ * 4 GB. Sizes are rounded up to a power of two, and to at least a page
+ * as F_SETPIPE_SZ does: a ring of a few bytes is no use to anyone.
+ */
+#define SCULL_P_MAXBUFFER (1U << 30)
+
+static unsigned int scull_p_roundsize(unsigned long want)
+{
+	return roundup_pow_of_two(clamp(want, PAGE_SIZE, (unsigned long)SCULL_P_MAXBUFFER));
+}
+
+/* Drop whatever spliced pages are still queued */
+static void scull_p_drop_pages(struct scull_pipe *dev)
+{
+	while (dev->pin != dev->pout) {
+		put_page(dev->pages[dev->pout & (SCULL_P_PAGES - 1)].page);
+		dev->pout++;
+	}
+}
+
 /*
  * Open and close
  */
@@ -73,16 +134,25 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
+		/* allocate the buffer, and pick the mode, on first open */
+		dev->buffersize = scull_p_roundsize(max(scull_p_buffer, 0));
+		dev->buffer = kvmalloc(dev->buffersize, GFP_KERNEL);
 		if (!dev->buffer) {
 			mutex_unlock(&dev->lock);
 			return -ENOMEM;
 		}
+		dev->rp = dev->wp = 0; /* rd and wr from the beginning */
+		dev->lowat = 1;
+		dev->hiwat = ~0U; /* any free space at all */
+		dev->spsc = READ_ONCE(scull_p_spsc);
+	}
+
+	/* the lockless mode relies on there being one of each */
+	if (dev->spsc && (((filp->f_mode & FMODE_READ) && dev->nreaders) ||
+			((filp->f_mode & FMODE_WRITE) && dev->nwriters))) {
+		mutex_unlock(&dev->lock);
+		return -EBUSY;
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
@@ -105,10 +175,15 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 	mutex_lock(&dev->lock);
 	if (filp->f_mode & FMODE_READ)
 		dev->nreaders--;
-	if (filp->f_mode & FMODE_WRITE)
+	if (filp->f_mode & FMODE_WRITE) {
 		dev->nwriters--;
+		/* readers waiting for their low watermark take what there is */
+		if (!dev->nwriters)
+			wake_up_interruptible(&dev->inq);
+	}
 	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
+		scull_p_drop_pages(dev);
+		kvfree(dev->buffer);
 		dev->buffer = NULL; /* the other fields are not checked on open */
 	}
 	mutex_unlock(&dev->lock);
@@ -117,61 +192,232 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 
 
 /*
- * Data management: read and write
+ * Ring helpers. They copy "count" bytes starting at ring position
+ * "pos", in two pieces if the data wraps, and return how many bytes
+ * actually made it across. The user-space pair can fall short; the
+ * kernel pair, used by splice, cannot.
  */
+static size_t scull_p_copy_out(struct scull_pipe *dev, char __user *buf,
+		unsigned int pos, size_t count)
+{
+	unsigned int off = pos & (dev->buffersize - 1);
+	size_t chunk = min_t(size_t, count, dev->buffersize - off);
+	size_t left;
+
+	left = copy_to_user(buf, dev->buffer + off, chunk);
+	if (left || chunk == count)
+		return chunk - left;
+	return count - copy_to_user(buf + chunk, dev->buffer, count - chunk);
+}
 
-static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static size_t scull_p_copy_in(struct scull_pipe *dev, const char __user *buf,
+		unsigned int pos, size_t count)
 {
-	struct scull_pipe *dev = filp->private_data;
+	unsigned int off = pos & (dev->buffersize - 1);
+	size_t chunk = min_t(size_t, count, dev->buffersize - off);
+	size_t left;
+
+	left = copy_from_user(dev->buffer + off, buf, chunk);
+	if (left || chunk == count)
+		return chunk - left;
+	return count - copy_from_user(dev->buffer, buf + chunk, count - chunk);
+}
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
+static void scull_p_ring_get(struct scull_pipe *dev, void *to,
+		unsigned int pos, size_t count)
+{
+	unsigned int off = pos & (dev->buffersize - 1);
+	size_t chunk = min_t(size_t, count, dev->buffersize - off);
+
+	memcpy(to, dev->buffer + off, chunk);
+	memcpy(to + chunk, dev->buffer, count - chunk);
+}
+
+static void scull_p_ring_put(struct scull_pipe *dev, const void *from,
+		unsigned int pos, size_t count)
+{
+	unsigned int off = pos & (dev->buffersize - 1);
+	size_t chunk = min_t(size_t, count, dev->buffersize - off);
+
+	memcpy(dev->buffer + off, from, chunk);
+	memcpy(dev->buffer, from + chunk, count - chunk);
+}
+
+/* How much space is free? */
+static unsigned int spacefree(struct scull_pipe *dev)
+{
+	return dev->buffersize - (dev->wp - dev->rp);
+}
+
+/* Is there nothing at all to read? */
+static bool scull_p_empty(struct scull_pipe *dev)
+{
+	return dev->rp == dev->wp && dev->pin == dev->pout;
+}
+
+/*
+ * Watermarks. Readers sleep, and poll() leaves out POLLIN, until "lowat"
+ * bytes are buffered, a spliced page is queued or the last writer has
+ * gone; a writer that found the ring full is not woken, nor POLLOUT
+ * reported, until no more than "hiwat" bytes are left. Sleepers are only
+ * woken when one of these two conditions turns true, so a trickle of
+ * small writes costs the reader one wakeup per "lowat" bytes rather
+ * than one per write. The defaults, 1 and "anything less than full",
+ * are the plain pipe behaviour.
+ */
+static unsigned int scull_p_lowat(struct scull_pipe *dev)
+{
+	return clamp(READ_ONCE(dev->lowat), 1U, dev->buffersize);
+}
+
+static unsigned int scull_p_hiwat(struct scull_pipe *dev)
+{
+	return min(READ_ONCE(dev->hiwat), dev->buffersize - 1);
+}
 
-	while (dev->rp == dev->wp) { /* nothing to read */
+static bool scull_p_readable(struct scull_pipe *dev)
+{
+	unsigned int fill = READ_ONCE(dev->wp) - READ_ONCE(dev->rp);
+
+	if (READ_ONCE(dev->pin) != READ_ONCE(dev->pout))
+		return true;
+	return fill && (fill >= scull_p_lowat(dev) || !READ_ONCE(dev->nwriters));
+}
+
+static bool scull_p_writable(struct scull_pipe *dev)
+{
+	return READ_ONCE(dev->wp) - READ_ONCE(dev->rp) <= scull_p_hiwat(dev);
+}
+
+/*
+ * The oldest queued page, or NULL. Its bytes come next once the
+ * reader gets to pg->at; until then the ring is read up to there.
+ */
+static struct scull_p_page *scull_p_next_page(struct scull_pipe *dev)
+{
+	if (dev->pin == dev->pout)
+		return NULL;
+	return &dev->pages[dev->pout & (SCULL_P_PAGES - 1)];
+}
+
+/* Use up "count" bytes of a queued page, dropping it when empty */
+static void scull_p_page_advance(struct scull_pipe *dev,
+		struct scull_p_page *pg, unsigned int count)
+{
+	pg->offset += count;
+	pg->len -= count;
+	if (!pg->len) {
+		put_page(pg->page);
+		dev->pout++;
+	}
+}
+
+
+/*
+ * The two halves of a lockless transfer: waiting until there is
+ * something to do, which returns how much there is, and publishing
+ * what was done, waking the other side if its watermark was crossed.
+ */
+static long scull_p_wait_data_spsc(struct scull_pipe *dev, bool nonblock)
+{
+	unsigned int rp = dev->rp; /* ours: nobody else moves it */
+	unsigned int wp;
+
+	while (!scull_p_readable(dev)) {
+		if (nonblock)
+			break; /* take whatever there is */
+		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+		if (wait_event_interruptible(dev->inq, scull_p_readable(dev)))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+	}
+	wp = smp_load_acquire(&dev->wp);
+	return wp == rp ? -EAGAIN : wp - rp;
+}
+
+static void scull_p_done_read_spsc(struct scull_pipe *dev, unsigned int count)
+{
+	unsigned int rp = dev->rp, wp, hiwat;
+
+	/* the bytes are copied out before the writer may reuse them */
+	smp_store_release(&dev->rp, rp + count);
+
+	/* pairs with the barrier in set_current_state() of a sleeping writer */
+	smp_mb();
+	wp = READ_ONCE(dev->wp);
+	hiwat = scull_p_hiwat(dev);
+	if (wp - rp > hiwat && wp - rp - count <= hiwat && waitqueue_active(&dev->outq))
+		wake_up_interruptible(&dev->outq);
+}
+
+static long scull_p_wait_space_spsc(struct scull_pipe *dev, bool nonblock)
+{
+	unsigned int wp = dev->wp; /* ours: nobody else moves it */
+	unsigned int rp;
+
+	/* full while the reader is a whole ring behind */
+	while (wp - (rp = smp_load_acquire(&dev->rp)) == dev->buffersize) {
+		if (nonblock)
+			return -EAGAIN;
+		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
+		if (wait_event_interruptible(dev->outq, scull_p_writable(dev)))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+	}
+	return dev->buffersize - (wp - rp);
+}
+
+/* Returns true if this made the pipe readable */
+static bool scull_p_done_write_spsc(struct scull_pipe *dev, unsigned int count)
+{
+	unsigned int wp = dev->wp, rp, lowat;
+
+	/* the bytes are in place before the reader may look at them */
+	smp_store_release(&dev->wp, wp + count);
+
+	/* pairs with the barrier in set_current_state() of a sleeping reader */
+	smp_mb();
+	rp = READ_ONCE(dev->rp);
+	lowat = scull_p_lowat(dev);
+	if (wp - rp >= lowat || wp - rp + count < lowat)
+		return false;
+	if (waitqueue_active(&dev->inq))
+		wake_up_interruptible(&dev->inq);
+	return true;
+}
+
+
+/*
+ * The same for the mutex mode. Both are called with the mutex held; on
+ * error the mutex will be released before returning.
+ */
+static int scull_getreaddata(struct scull_pipe *dev, bool nonblock)
+{
+	while (!scull_p_readable(dev)) { /* not enough to read */
+		if (nonblock && !scull_p_empty(dev))
+			break; /* take whatever there is */
 		mutex_unlock(&dev->lock); /* release the lock */
-		if (filp->f_flags & O_NONBLOCK)
+		if (nonblock)
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+		if (wait_event_interruptible(dev->inq, scull_p_readable(dev)))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
 		if (mutex_lock_interruptible(&dev->lock))
 			return -ERESTARTSYS;
 	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
-		mutex_unlock (&dev->lock);
-		return -EFAULT;
-	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
-	mutex_unlock (&dev->lock);
-
-	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
-	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
-	return count;
+	return 0;
 }
 
-/* Wait for space for writing; caller must hold device semaphore.  On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+static int scull_getwritespace(struct scull_pipe *dev, bool nonblock)
 {
 	while (spacefree(dev) == 0) { /* full */
 		DEFINE_WAIT(wait);
 		
 		mutex_unlock(&dev->lock);
-		if (filp->f_flags & O_NONBLOCK)
+		if (nonblock)
 			return -EAGAIN;
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		if (!scull_p_writable(dev)) /* wait for the high watermark */
 			schedule();
 		finish_wait(&dev->outq, &wait);
 		if (signal_pending(current))
@@ -182,70 +428,316 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 	return 0;
 }	
 
-/* How much space is free? */
-static int spacefree(struct scull_pipe *dev)
+
+/*
+ * Data management: read and write
+ */
+
+static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_page *pg;
+	bool was_writable, wake;
+	long result;
+
+	if (!count)
+		return 0;
+	if (dev->spsc) {
+		result = scull_p_wait_data_spsc(dev, filp->f_flags & O_NONBLOCK);
+		if (result < 0)
+			return result;
+		count = scull_p_copy_out(dev, buf, dev->rp, min_t(size_t, count, result));
+		if (!count)
+			return -EFAULT;
+		scull_p_done_read_spsc(dev, count);
+		goto out;
+	}
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+
+	/* Make sure there's data to read */
+	result = scull_getreaddata(dev, filp->f_flags & O_NONBLOCK);
+	if (result)
+		return result; /* scull_getreaddata released the lock */
+
+	/* ok, data is there, return something */
+	was_writable = scull_p_writable(dev);
+	pg = scull_p_next_page(dev);
+	if (pg && pg->at == dev->rp) { /* a spliced page comes first */
+		char *from = kmap(pg->page);
+
+		count = min_t(size_t, count, pg->len);
+		count -= copy_to_user(buf, from + pg->offset, count);
+		kunmap(pg->page);
+		if (count)
+			scull_p_page_advance(dev, pg, count);
+	} else {
+		count = min_t(size_t, count, (pg ? pg->at : dev->wp) - dev->rp);
+		count = scull_p_copy_out(dev, buf, dev->rp, count);
+		dev->rp += count;
+	}
+	wake = !was_writable && scull_p_writable(dev); /* pages don't count */
+	mutex_unlock (&dev->lock);
+	if (!count)
+		return -EFAULT;
+
+	/* finally, awake any writers and return */
+	if (wake)
+		wake_up_interruptible(&dev->outq);
+  out:
+	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
+	return count;
 }
 
 static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
-	int result;
+	bool was_readable, woke;
+	long result;
+
+	if (!count)
+		return 0;
+	if (dev->spsc) {
+		result = scull_p_wait_space_spsc(dev, filp->f_flags & O_NONBLOCK);
+		if (result < 0)
+			return result;
+		count = min_t(size_t, count, result);
+		PDEBUG("Going to accept %li bytes at %u from %p\n", (long)count, dev->wp, buf);
+		count = scull_p_copy_in(dev, buf, dev->wp, count);
+		if (!count)
+			return -EFAULT;
+		woke = scull_p_done_write_spsc(dev, count);
+		goto out;
+	}
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 
 	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
+	result = scull_getwritespace(dev, filp->f_flags & O_NONBLOCK);
 	if (result)
-		return result; /* scull_getwritespace called up(&dev->sem) */
+		return result; /* scull_getwritespace released the lock */
 
 	/* ok, space is there, accept something */
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-	else /* the write pointer has wrapped, fill up to rp-1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
+	was_readable = scull_p_readable(dev);
+	count = min_t(size_t, count, spacefree(dev));
+	PDEBUG("Going to accept %li bytes at %u from %p\n", (long)count, dev->wp, buf);
+	count = scull_p_copy_in(dev, buf, dev->wp, count);
+	if (!count) {
 		mutex_unlock(&dev->lock);
 		return -EFAULT;
 	}
 	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer; /* wrapped */
+	woke = !was_readable && scull_p_readable(dev);
 	mutex_unlock(&dev->lock);
 
-	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	/* finally, awake any reader if there is now enough for them */
+	if (woke)
+		wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
 
+  out:
 	/* and signal asynchronous readers, explained late in chapter 5 */
-	if (dev->async_queue)
+	if (woke && dev->async_queue)
 		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
 	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
 	return count;
 }
 
+
+/*
+ * splice. Going out, a queued page is handed on by reference and ring
+ * data is copied into a fresh page (once: that page then travels on
+ * by reference). Coming in, whole pages are queued by reference while
+ * there is room in the page queue, and anything else is copied into
+ * the ring. Note that a queued page is shared, not stolen: if it came
+ * from vmsplice() without SPLICE_F_GIFT, later stores by the producer
+ * show through, just as with a real pipe.
+ */
+
+static const struct pipe_buf_operations scull_p_buf_ops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+	.confirm =	generic_pipe_buf_confirm,
+	.steal =	generic_pipe_buf_steal,
+#endif
+	.release =	generic_pipe_buf_release,
+	.get =		generic_pipe_buf_get,
+};
+
+/* Copy "count" ring bytes at "pos" into a new page on the pipe */
+static long scull_p_splice_ring(struct scull_pipe *dev,
+		struct pipe_inode_info *pipe, unsigned int pos, size_t count)
+{
+	struct pipe_buffer buf = {
+		.page =	alloc_page(GFP_KERNEL),
+		.len =	count,
+		.ops =	&scull_p_buf_ops,
+	};
+
+	if (!buf.page)
+		return -ENOMEM;
+	scull_p_ring_get(dev, page_address(buf.page), pos, count);
+	return add_to_pipe(pipe, &buf); /* frees the page on failure */
+}
+
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct scull_pipe *dev = filp->private_data;
+	bool nonblock = (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+	struct scull_p_page *pg;
+	ssize_t done = 0;
+	long result = 0;
+	size_t count;
+	bool was_writable, wake;
+
+	if (!len)
+		return 0;
+	if (dev->spsc) {
+		long avail = scull_p_wait_data_spsc(dev, nonblock);
+
+		if (avail < 0)
+			return avail;
+		while (len && avail) {
+			count = min_t(size_t, min_t(size_t, len, avail), PAGE_SIZE);
+			result = scull_p_splice_ring(dev, pipe, dev->rp, count);
+			if (result < 0)
+				break;
+			scull_p_done_read_spsc(dev, count);
+			done += count;
+			len -= count;
+			avail -= count;
+		}
+		return done ? done : result;
+	}
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	result = scull_getreaddata(dev, nonblock);
+	if (result)
+		return result; /* scull_getreaddata released the lock */
+
+	was_writable = scull_p_writable(dev);
+	while (len && !scull_p_empty(dev)) {
+		pg = scull_p_next_page(dev);
+		if (pg && pg->at == dev->rp) {
+			struct pipe_buffer buf = {
+				.page =		pg->page,
+				.offset =	pg->offset,
+				.ops =		&scull_p_buf_ops,
+			};
+
+			buf.len = count = min_t(size_t, len, pg->len);
+			/* the pipe gets its own reference, dropped on failure */
+			get_page(pg->page);
+			result = add_to_pipe(pipe, &buf);
+			if (result < 0)
+				break;
+			scull_p_page_advance(dev, pg, count);
+		} else {
+			count = min_t(size_t, min_t(size_t, len,
+					(pg ? pg->at : dev->wp) - dev->rp), PAGE_SIZE);
+			result = scull_p_splice_ring(dev, pipe, dev->rp, count);
+			if (result < 0)
+				break;
+			dev->rp += count;
+		}
+		done += count;
+		len -= count;
+	}
+	wake = !was_writable && scull_p_writable(dev);
+	mutex_unlock(&dev->lock);
+
+	if (wake)
+		wake_up_interruptible(&dev->outq);
+	return done ? done : result;
+}
+
+/* Called by splice_from_pipe() for each buffer of the incoming pipe */
+static int scull_p_splice_actor(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct file *filp = sd->u.file;
+	struct scull_pipe *dev = filp->private_data;
+	bool nonblock = (filp->f_flags & O_NONBLOCK) || (sd->flags & SPLICE_F_NONBLOCK);
+	unsigned int count = sd->len;
+	bool was_readable, woke;
+	char *from;
+	long result;
+
+	if (dev->spsc) {
+		result = scull_p_wait_space_spsc(dev, nonblock);
+		if (result < 0)
+			return result;
+		count = min_t(unsigned int, count, result);
+		from = kmap(buf->page);
+		scull_p_ring_put(dev, from + buf->offset, dev->wp, count);
+		kunmap(buf->page);
+		woke = scull_p_done_write_spsc(dev, count);
+		goto out;
+	}
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	if (count == PAGE_SIZE && dev->pin - dev->pout < SCULL_P_PAGES) {
+		/* a whole page: keep a reference instead of copying it */
+		struct scull_p_page *pg = &dev->pages[dev->pin & (SCULL_P_PAGES - 1)];
+
+		was_readable = scull_p_readable(dev);
+		get_page(buf->page);
+		pg->page = buf->page;
+		pg->offset = buf->offset;
+		pg->len = count;
+		pg->at = dev->wp;
+		dev->pin++;
+	} else {
+		result = scull_getwritespace(dev, nonblock);
+		if (result)
+			return result; /* scull_getwritespace released the lock */
+		was_readable = scull_p_readable(dev);
+		count = min_t(unsigned int, count, spacefree(dev));
+		from = kmap(buf->page);
+		scull_p_ring_put(dev, from + buf->offset, dev->wp, count);
+		kunmap(buf->page);
+		dev->wp += count;
+	}
+	woke = !was_readable && scull_p_readable(dev);
+	mutex_unlock(&dev->lock);
+
+	if (woke)
+		wake_up_interruptible(&dev->inq);
+  out:
+	if (woke && dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	return count;
+}
+
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe,
+		struct file *filp, loff_t *ppos, size_t len, unsigned int flags)
+{
+	return splice_from_pipe(pipe, filp, ppos, len, flags, scull_p_splice_actor);
+}
+
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
 	struct scull_pipe *dev = filp->private_data;
 	unsigned int mask = 0;
 
 	/*
-	 * The buffer is circular; it is considered full
-	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * The buffer is circular; it is considered readable and
+	 * writable according to the watermarks, which with the defaults
+	 * means not empty and not full. The lockless mode doesn't take
+	 * the mutex to move "rp" and "wp", so they are read once each.
 	 */
 	mutex_lock(&dev->lock);
 	poll_wait(filp, &dev->inq,  wait);
 	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
+	smp_mb(); /* as a sleeper's set_current_state() would */
+	if (scull_p_readable(dev))
 		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
+	if (scull_p_writable(dev))
 		mask |= POLLOUT | POLLWRNORM;	/* writable */
 	mutex_unlock(&dev->lock);
 	return mask;
@@ -255,6 +747,101 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 
 
 
+/*
+ * Resize a live pipe, keeping what is buffered. Like F_SETPIPE_SZ, it
+ * fails with -EBUSY rather than drop data that wouldn't fit, and
+ * returns the size actually used. The new ring comes from kvmalloc(),
+ * so large sizes are virtually contiguous pages rather than one
+ * high-order allocation. A lockless pipe can't be resized: its two
+ * ends never take the lock.
+ */
+static long scull_p_resize(struct scull_pipe *dev, unsigned long want)
+{
+	unsigned int size, used, i;
+	char *buffer, *old;
+
+	if (want > SCULL_P_MAXBUFFER)
+		return -EINVAL;
+	if (want > max(scull_p_max_buffer, 0) && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+	size = scull_p_roundsize(want);
+
+	/* allocate before taking the lock: vmalloc() may take a while */
+	buffer = kvmalloc(size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+	if (mutex_lock_interruptible(&dev->lock)) {
+		kvfree(buffer);
+		return -ERESTARTSYS;
+	}
+	used = dev->wp - dev->rp;
+	if (dev->spsc || used > size) {
+		mutex_unlock(&dev->lock);
+		kvfree(buffer);
+		return -EBUSY;
+	}
+
+	/* move the data to the start of the new ring and renumber to match */
+	scull_p_ring_get(dev, buffer, dev->rp, used);
+	for (i = dev->pout; i != dev->pin; i++)
+		dev->pages[i & (SCULL_P_PAGES - 1)].at -= dev->rp;
+	old = dev->buffer;
+	dev->buffer = buffer;
+	dev->buffersize = size;
+	dev->rp = 0;
+	dev->wp = used;
+	mutex_unlock(&dev->lock);
+
+	kvfree(old);
+	/* the watermarks are clamped to the size: let sleepers look again */
+	wake_up_interruptible(&dev->inq);
+	wake_up_interruptible(&dev->outq);
+	return size;
+}
+
+/*
+ * The pipe's own ioctl commands; everything else is shared with the
+ * bare scull devices.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_pipe *dev = filp->private_data;
+
+	switch(cmd) {
+
+	  case SCULL_P_IOCTPIPESIZE: /* Tell: arg is the new size */
+		return scull_p_resize(dev, arg);
+
+	  case SCULL_P_IOCQPIPESIZE: /* Query: return it */
+		return READ_ONCE(dev->buffersize);
+
+	  case SCULL_P_IOCTLOWAT: /* Tell: arg is the new watermark */
+	  case SCULL_P_IOCTHIWAT:
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		if (cmd == SCULL_P_IOCTLOWAT)
+			WRITE_ONCE(dev->lowat, min(arg, (unsigned long)UINT_MAX));
+		else
+			WRITE_ONCE(dev->hiwat, min(arg, (unsigned long)UINT_MAX));
+		mutex_unlock(&dev->lock);
+		/* sleepers wait for the old value: let them look again */
+		wake_up_interruptible(&dev->inq);
+		wake_up_interruptible(&dev->outq);
+		return 0;
+
+	  case SCULL_P_IOCQLOWAT: /* Query: the values in effect */
+		return scull_p_lowat(dev);
+
+	  case SCULL_P_IOCQHIWAT:
+		return scull_p_hiwat(dev);
+
+	  case SCULL_IOCRESERVE: /* a pipe has no quanta */
+		return -ENOTTY;
+	}
+	return scull_ioctl(filp, cmd, arg);
+}
+
+
 static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
 	struct scull_pipe *dev = filp->private_data;
@@ -280,9 +867,14 @@ static int scull_read_p_mem(struct seq_file *s, void *v)
 			return -ERESTARTSYS;
 		seq_printf(s, "\nDevice %i: %p\n", i, p);
 /*		seq_printf(s, "   Queues: %p %p\n", p->inq, p->outq);*/
-		seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-		seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
+		seq_printf(s, "   Buffer: %p (%u bytes)%s\n", p->buffer, p->buffersize,
+				p->spsc ? ", lockless" : "");
+		seq_printf(s, "   rp %u   wp %u   spliced pages %u\n", p->rp, p->wp,
+				p->pin - p->pout);
 		seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
+		if (p->buffer)
+			seq_printf(s, "   lowat %u   hiwat %u\n", scull_p_lowat(p),
+					scull_p_hiwat(p));
 		mutex_unlock(&p->lock);
 	}
 	return 0;
@@ -314,8 +906,10 @@ struct file_operations scull_pipe_fops = {
 	.llseek =	noop_llseek,
 	.read =		scull_p_read,
 	.write =	scull_p_write,
+	.splice_read =	scull_p_splice_read,
+	.splice_write =	scull_p_splice_write,
 	.poll =		scull_p_poll,
-	.unlocked_ioctl = scull_ioctl,
+	.unlocked_ioctl = scull_p_ioctl,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -386,8 +980,11 @@ void scull_p_cleanup(void)
 		return; /* nothing else to release */
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
-		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		struct scull_pipe *dev = scull_p_devices + i;
+
+		cdev_del(&dev->cdev);
+		scull_p_drop_pages(dev);
+		kvfree(dev->buffer);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
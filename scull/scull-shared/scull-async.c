@@ -0,0 +1 @@
+../../scull-shared/scull-async.c
\ No newline at end of file
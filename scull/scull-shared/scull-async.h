@@ -0,0 +1 @@
+../../scull-shared/scull-async.h
\ No newline at end of file
@@ -19,6 +19,11 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/xarray.h>
+
+#include "scull-shared/scull-async.h"
+#include "scull-shared/scull-evict.h"
+#include "scull-shared/scull-reserve.h"
 
 /*
  * Macros to help debugging
@@ -54,15 +59,22 @@
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use an xarray (a radix tree) of quanta.
  *
- * "scull_dev->data" points to an array of pointers, each
- * pointer refers to a memory area of SCULL_QUANTUM bytes.
+ * "scull_dev->data" maps a quantum number, that is an offset
+ * divided by the quantum size, to a memory area of SCULL_QUANTUM
+ * bytes. Finding the quantum for any offset is one tree lookup.
+ * Quanta come from the page allocator, so with a quantum that is a
+ * whole number of pages the device can be mapped (see mmap.c).
+ * Trimming swaps in an empty tree; the old one is freed in the
+ * background.
  *
- * The array (quantum-set) is SCULL_QSET long.
+ * SCULL_QSET used to be the length of each block in a linked list
+ * of quantum sets. The xarray doesn't need it; the value is kept
+ * so the qset ioctls and /proc output stay as they were.
  */
 #ifndef SCULL_QUANTUM
-#define SCULL_QUANTUM 4000
+#define SCULL_QUANTUM PAGE_SIZE
 #endif
 
 #ifndef SCULL_QSET
@@ -70,27 +82,33 @@
 #endif
 
 /*
- * The pipe device is a simple circular buffer. Here its default size
+ * The pipe device is a simple circular buffer. Here its default size,
+ * rounded up to a power of two when the buffer is allocated
  */
 #ifndef SCULL_P_BUFFER
 #define SCULL_P_BUFFER 4000
 #endif
 
 /*
- * Representation of scull quantum sets.
+ * Whole pages spliced into a pipe are queued by reference, up to this
+ * many (a power of two) per pipe; beyond that they are copied.
  */
-struct scull_qset {
-	void **data;
-	struct scull_qset *next;
-};
+#ifndef SCULL_P_PAGES
+#define SCULL_P_PAGES 16
+#endif
 
 struct scull_dev {
-	struct scull_qset *data;  /* Pointer to first quantum set */
+	struct xarray *data;      /* quanta, indexed by quantum number */
 	int quantum;              /* the current quantum size */
-	int qset;                 /* the current array size */
+	int qset;                 /* nominal, see above */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
+	atomic_t vmas;            /* active mappings */
 	struct mutex lock;     /* mutual exclusion semaphore     */
+	struct rw_semaphore *stripes; /* range locks, if striped */
+	struct rw_semaphore trim_sem; /* striped I/O vs. trim */
+	struct scull_async_queue aio; /* AIO waiting for the lock */
+	struct scull_evict evict; /* cold quanta, if evictable */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -108,6 +126,7 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_stripes;
 
 extern int scull_p_buffer;	/* pipe.c */
 
@@ -122,11 +141,13 @@ int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
 
 int     scull_trim(struct scull_dev *dev);
+int     scull_data_init(struct scull_dev *dev);
+void    scull_data_free(struct scull_dev *dev);
+bool    scull_discard(struct scull_evict *e, unsigned long index);
+int     scull_mmap(struct file *filp, struct vm_area_struct *vma);
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
@@ -169,8 +190,32 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * Those two are the size given to pipes when they are allocated; these
+ * act on the pipe they are issued on. Telling a size resizes it, keeping
+ * what is buffered, and returns the size used (a power of two, at
+ * least a page).
+ */
+#define SCULL_P_IOCTPIPESIZE _IO(SCULL_IOC_MAGIC, 15)
+#define SCULL_P_IOCQPIPESIZE _IO(SCULL_IOC_MAGIC, 16)
+
+/*
+ * Per-pipe watermarks: readers sleep until LOWAT bytes are buffered,
+ * and a writer blocked on a full pipe until no more than HIWAT are.
+ */
+#define SCULL_P_IOCTLOWAT _IO(SCULL_IOC_MAGIC,  17)
+#define SCULL_P_IOCQLOWAT _IO(SCULL_IOC_MAGIC,  18)
+#define SCULL_P_IOCTHIWAT _IO(SCULL_IOC_MAGIC,  19)
+#define SCULL_P_IOCQHIWAT _IO(SCULL_IOC_MAGIC,  20)
+
+/*
+ * Allocate the quanta of a byte range ahead of time (see
+ * scull-shared/scull-reserve.h); bare devices only, opened for writing.
+ */
+#define SCULL_IOCRESERVE _IOW(SCULL_IOC_MAGIC,  21, struct scull_reserve)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 21
 
 #endif /* _SCULL_H_ */
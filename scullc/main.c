@@ -31,7 +31,9 @@
 #include <linux/uio.h>		/* struct iovec */
 #include <linux/version.h>
 #include <linux/mutex.h>
-#include "scull-shared/scull-async.h"
+#include <linux/log2.h>
+#include <linux/sched/signal.h>
+#include <linux/math64.h>	/* div_u64() */
 #include "scullc.h"		/* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
@@ -53,8 +55,38 @@ struct scullc_dev *scullc_devices; /* allocated in scullc_init */
 int scullc_trim(struct scullc_dev *dev);
 void scullc_cleanup(void);
 
-/* declare one cache pointer: use it for all devices */
-struct kmem_cache *scullc_cache;
+/* one cache per size class, shared by the devices using it */
+static struct kmem_cache *scullc_caches[SCULLC_CLASSES];
+static char scullc_cache_names[SCULLC_CLASSES][16];
+static atomic_long_t scullc_class_quanta[SCULLC_CLASSES]; /* in use */
+static atomic_long_t scullc_class_failed[SCULLC_CLASSES]; /* allocations */
+
+/* The smallest size class that holds a quantum of "size" bytes */
+static int scullc_size_class(int size)
+{
+	if (size <= 1 << SCULLC_MIN_SHIFT)
+		return 0;
+	return min_t(int, order_base_2(size), SCULLC_MAX_SHIFT) - SCULLC_MIN_SHIFT;
+}
+
+/* Quanta are zeroed, unless about to be written whole ("zero" false) */
+static void *scullc_alloc_quantum(struct scullc_dev *dev, bool zero)
+{
+	void *quantum = kmem_cache_alloc(scullc_caches[dev->class],
+			GFP_KERNEL | (zero ? __GFP_ZERO : 0));
+
+	if (quantum)
+		atomic_long_inc(&scullc_class_quanta[dev->class]);
+	else
+		atomic_long_inc(&scullc_class_failed[dev->class]);
+	return quantum;
+}
+
+static void scullc_free_quantum(struct scullc_dev *dev, void *quantum)
+{
+	kmem_cache_free(scullc_caches[dev->class], quantum);
+	atomic_long_dec(&scullc_class_quanta[dev->class]);
+}
 
 
 
@@ -68,31 +100,34 @@ struct kmem_cache *scullc_cache;
 /* FIXME: Do we need this here??  It be ugly  */
 int scullc_read_procmem(struct seq_file *m, void *v)
 {
-	int i, j, quantum, qset;
+	int i, qset;
 	int limit = m->size - 80; /* Don't print more than this */
 	struct scullc_dev *d;
+	unsigned long index;
+	void *quantum;
+
+	seq_printf(m, "Size classes: bytes, quanta in use, failed allocations\n");
+	for (i = 0; i < SCULLC_CLASSES; i++)
+		if (atomic_long_read(&scullc_class_quanta[i]) ||
+		    atomic_long_read(&scullc_class_failed[i]))
+			seq_printf(m, "  %6i %10li %10li\n", 1 << (i + SCULLC_MIN_SHIFT),
+					atomic_long_read(&scullc_class_quanta[i]),
+					atomic_long_read(&scullc_class_failed[i]));
 
 	for(i = 0; i < scullc_devs; i++) {
 		d = &scullc_devices[i];
 		if (mutex_lock_interruptible (&d->lock))
 			return -ERESTARTSYS;
 		qset = d->qset;  /* retrieve the features of each device */
-		quantum=d->quantum;
 		seq_printf(m,"\nDevice %i: qset %i, quantum %i, sz %li\n",
-				i, qset, quantum, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
-			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
+				i, qset, d->quantum, (long)(d->size));
+		scull_async_show(m, &d->aio);
+		scull_evict_show(m, &d->evict);
+		xa_for_each(&d->data, index, quantum) { /* scan the tree */
+			seq_printf(m,"    % 4lu:%8p\n",index,quantum);
 			if (m->count > limit)
-				goto out;
-			if (d->data && !d->next) /* dump only the last item - save space */
-				for (j = 0; j < qset; j++) {
-					if (d->data[j])
-						seq_printf(m,"    % 4i:%8p\n",j,d->data[j]);
-					if (m->count > limit)
-						goto out;
-				}
+				break;
 		}
-	  out:
 		mutex_unlock (&scullc_devices[i].lock);
 		if (m->count > limit)
 			break;
@@ -146,123 +181,231 @@ int scullc_release (struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list 
+ * Data management: read and write. Both are called with the device
+ * mutex held, by way of scull_async_rw().
  */
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n)
+
+/*
+ * Look up quantum number "index", allocating it from the cache if
+ * "create" is set.
+ */
+static void *scullc_lookup_quantum(struct scullc_dev *dev, unsigned long index,
+		bool create)
 {
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullc_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullc_dev));
-		}
-		dev = dev->next;
-		continue;
+	void *quantum = xa_load(&dev->data, index);
+
+	if (quantum)
+		scull_evict_touch(&dev->evict, index);
+	if (quantum || !create)
+		return quantum;
+
+	/* Allocate a quantum using the device's memory cache */
+	quantum = scullc_alloc_quantum(dev, true);
+	if (!quantum)
+		return NULL;
+	if (xa_is_err(xa_store(&dev->data, index, quantum, GFP_KERNEL))) {
+		scullc_free_quantum(dev, quantum);
+		return NULL;
 	}
-	return dev;
+	scull_evict_add(&dev->evict, index);
+	return quantum;
 }
 
 /*
- * Data management: read and write
+ * Write new quantum "index" whole, from "from". As the data covers
+ * it, the quantum isn't zeroed first, just whatever a fault leaves
+ * uncopied; and it only goes in the tree once it is filled, since
+ * mappings look quanta up without locking. Returns the bytes copied,
+ * or -ENOMEM with nothing consumed.
  */
+static ssize_t scullc_write_quantum(struct scullc_dev *dev, unsigned long index,
+		struct iov_iter *from)
+{
+	void *quantum = scullc_alloc_quantum(dev, false);
+	size_t copied;
 
-ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+	if (!quantum)
+		return -ENOMEM;
+	copied = copy_from_iter(quantum, dev->quantum, from);
+	if (copied < dev->quantum)
+		memset(quantum + copied, 0, dev->quantum - copied);
+	if (xa_is_err(xa_store(&dev->data, index, quantum, GFP_KERNEL))) {
+		scullc_free_quantum(dev, quantum);
+		iov_iter_revert(from, copied);
+		return -ENOMEM;
+	}
+	scull_evict_add(&dev->evict, index);
+	return copied;
+}
+
+static ssize_t scullc_do_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct scullc_dev *dev = filp->private_data; /* the first listitem */
-	struct scullc_dev *dptr;
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
 	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(to);
+	unsigned long index;
+	int q_pos;
+	size_t chunk, copied, done = 0;
+	void *data;
 	ssize_t retval = 0;
 
-	if (mutex_lock_interruptible (&dev->lock))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scullc_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
+	if (iocb->ki_pos >= dev->size)
+		return 0;
+	if (iocb->ki_pos + count > dev->size)
+		count = dev->size - iocb->ki_pos;
+
+	/* find the first quantum and the offset in it */
+	index = (long)iocb->ki_pos / quantum;
+	q_pos = (long)iocb->ki_pos % quantum;
+
+	/* then copy quantum by quantum */
+	while (done < count) {
+		data = scullc_lookup_quantum(dev, index, false);
+
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		if (data)
+			copied = copy_to_iter(data + q_pos, chunk, to);
+		else /* a hole reads as zeros */
+			copied = iov_iter_zero(chunk, to);
+		done += copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		index++;
+		q_pos = 0;
+	}
+	/* a fault after some progress is reported as a short read */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	mutex_unlock (&dev->lock);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock (&dev->lock);
 	return retval;
 }
 
 
 
-ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t scullc_do_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scullc_dev *dev = filp->private_data;
-	struct scullc_dev *dptr;
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
 	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(from);
+	unsigned long index;
+	int q_pos;
+	size_t chunk, copied, done = 0;
+	void *data;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
-	if (mutex_lock_interruptible (&dev->lock))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scullc_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using the memory cache */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, scullc_quantum);
+	if (!count)
+		return 0;
+
+	/* find the first quantum and the offset in it */
+	index = (long)iocb->ki_pos / quantum;
+	q_pos = (long)iocb->ki_pos % quantum;
+
+	/* then fill quantum by quantum, allocating as we go */
+	while (done < count) {
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		/* a new quantum written whole needn't be zeroed */
+		data = scullc_lookup_quantum(dev, index, chunk < quantum);
+		if (data) {
+			copied = copy_from_iter(data + q_pos, chunk, from);
+		} else if (chunk == quantum) {
+			ssize_t ret = scullc_write_quantum(dev, index, from);
+
+			if (ret < 0)
+				break;
+			copied = ret;
+		} else {
+			break;
+		}
+		done += copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		index++;
+		q_pos = 0;
 	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
+	/* running out of memory or faulting part way is a short write */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	*f_pos += count;
- 
+
     	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock (&dev->lock);
-	return count;
+	if (dev->size < iocb->ki_pos)
+		dev->size = iocb->ki_pos;
+	return retval;
+}
+
+ssize_t scullc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, to, scullc_do_read);
+}
+
+ssize_t scullc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, from, scullc_do_write);
+}
+
+/*
+ * Reserving: give every missing quantum in the range its memory now,
+ * a window of SCULL_RESERVE_BATCH quanta at a time, allocated from the
+ * cache in parallel with the device locked. The lock is let go between
+ * windows, so that I/O gets a look in.
+ */
+static void *scullc_reserve_quantum(void *arg)
+{
+	return scullc_alloc_quantum(arg, true);
+}
 
-  nomem:
-	mutex_unlock (&dev->lock);
+static int scullc_reserve(struct scullc_dev *dev, struct scull_reserve *r)
+{
+	unsigned long *indices, index, last;
+	u64 pos = r->offset, end = r->offset + r->length;
+	void **quanta;
+	int i, n, retval = 0;
+
+	quanta = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void *), GFP_KERNEL);
+	indices = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(long), GFP_KERNEL);
+	if (!quanta || !indices)
+		retval = -ENOMEM;
+
+	while (!retval && pos < end) {
+		if (signal_pending(current) || mutex_lock_interruptible(&dev->lock)) {
+			retval = -ERESTARTSYS;
+			break;
+		}
+		/* the quantum may have changed since the last window */
+		index = div_u64(pos, dev->quantum);
+		last = min_t(u64, div_u64(end - 1, dev->quantum),
+				index + SCULL_RESERVE_BATCH - 1);
+		for (n = 0; index <= last; index++)
+			if (!xa_load(&dev->data, index))
+				indices[n++] = index;
+		pos = (u64)index * dev->quantum;
+
+		if (scull_reserve_alloc(quanta, n, scullc_reserve_quantum, dev))
+			retval = -ENOMEM;
+		for (i = 0; i < n; i++) {
+			if (!quanta[i])
+				continue;
+			if (xa_is_err(xa_store(&dev->data, indices[i], quanta[i], GFP_KERNEL))) {
+				scullc_free_quantum(dev, quanta[i]);
+				retval = -ENOMEM;
+				continue;
+			}
+			scull_evict_add(&dev->evict, indices[i]);
+		}
+		mutex_unlock(&dev->lock);
+	}
+	kfree(indices);
+	kfree(quanta);
 	return retval;
 }
 
@@ -274,6 +417,7 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
 	int err = 0, ret = 0, tmp;
+	struct scull_reserve r;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLC_IOC_MAGIC) return -ENOTTY;
@@ -353,6 +497,14 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullc_qset = arg;
 		return tmp;
 
+	case SCULLC_IOCRESERVE: /* arg points to the range */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		ret = scull_reserve_get(&r, (void __user *)arg);
+		if (ret == 0)
+			ret = scullc_reserve(filp->private_data, &r);
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -364,10 +516,40 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
  * The "extended" operations
  */
 
+/*
+ * SEEK_DATA and SEEK_HOLE: where the first quantum at or after "off"
+ * that is there ("data"), or missing, starts; the end of the device
+ * counts as a hole. Called with the device mutex held.
+ */
+static loff_t scullc_seek_data(struct scullc_dev *dev, loff_t off, bool data)
+{
+	unsigned long index, last, i;
+	void *quantum;
+
+	if (off < 0 || off >= dev->size)
+		return -ENXIO;
+	index = div_u64(off, dev->quantum);
+	last = (dev->size - 1) / dev->quantum;
+	if (data) {
+		if (!xa_find(&dev->data, &index, last, XA_PRESENT))
+			return -ENXIO;
+	} else {
+		/* walk the run of quanta from "index" to its end */
+		xa_for_each_start(&dev->data, i, quantum, index) {
+			if (i != index || index > last)
+				break;
+			index++;
+		}
+		if (index > last)
+			return dev->size;
+	}
+	return max_t(loff_t, off, (loff_t)index * dev->quantum);
+}
+
 loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct scullc_dev *dev = filp->private_data;
-	long newpos;
+	loff_t newpos;
 
 	switch(whence) {
 	case 0: /* SEEK_SET */
@@ -382,6 +564,16 @@ loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		newpos = scullc_seek_data(dev, off, whence == SEEK_DATA);
+		mutex_unlock(&dev->lock);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	default: /* can't happen */
 		return -EINVAL;
 	}
@@ -398,40 +590,79 @@ loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 struct file_operations scullc_fops = {
 	.owner =     THIS_MODULE,
 	.llseek =    scullc_llseek,
-	.read =	     scullc_read,
-	.write =     scullc_write,
 	.unlocked_ioctl = scullc_ioctl,
+	.mmap =	     scullc_mmap,
 	.open =	     scullc_open,
 	.release =   scullc_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.read_iter =  scullc_read_iter,
+	.write_iter = scullc_write_iter,
 };
 
 int scullc_trim(struct scullc_dev *dev)
 {
-	struct scullc_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
+	unsigned long index;
+	void *quantum;
 
-	if (dev->vmas) /* don't trim: there are active mappings */
+	if (atomic_read(&dev->vmas)) /* don't trim: there are active mappings */
 		return -EBUSY;
 
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					kmem_cache_free(scullc_cache, dptr->data[i]);
+	xa_for_each(&dev->data, index, quantum)
+		scullc_free_quantum(dev, quantum);
+	xa_destroy(&dev->data);
+	scull_evict_reset(&dev->evict);
+	dev->size = 0;
+	dev->qset = scullc_qset;
+	/* the quantum asked for, rounded up to its size class */
+	dev->class = scullc_size_class(READ_ONCE(scullc_quantum));
+	dev->quantum = 1 << (dev->class + SCULLC_MIN_SHIFT);
+	return 0;
+}
+
+/*
+ * Evictable mode: give quantum "index" back to the cache, with the
+ * device mutex held, unless the device is mapped.
+ */
+static bool scullc_discard(struct scull_evict *e, unsigned long index)
+{
+	struct scullc_dev *dev = container_of(e, struct scullc_dev, evict);
+	void *quantum;
+
+	if (atomic_read(&dev->vmas))
+		return false;
+	quantum = xa_erase(&dev->data, index);
+	if (quantum)
+		scullc_free_quantum(dev, quantum);
+	return true;
+}
+
+static void scullc_destroy_caches(void)
+{
+	int i;
+
+	for (i = 0; i < SCULLC_CLASSES; i++) {
+		if (scullc_caches[i])
+			kmem_cache_destroy(scullc_caches[i]);
+		scullc_caches[i] = NULL;
+	}
+}
 
-			kfree(dptr->data);
-			dptr->data=NULL;
+static int scullc_create_caches(void)
+{
+	int i, size;
+
+	for (i = 0; i < SCULLC_CLASSES; i++) {
+		size = 1 << (i + SCULLC_MIN_SHIFT);
+		snprintf(scullc_cache_names[i], sizeof(scullc_cache_names[i]),
+				"scullc-%i", size);
+		/* whole pages are page-aligned, so that they can be mapped */
+		scullc_caches[i] = kmem_cache_create(scullc_cache_names[i], size,
+				size % PAGE_SIZE ? 0 : PAGE_SIZE,
+				SLAB_HWCACHE_ALIGN, NULL); /* no ctor/dtor */
+		if (!scullc_caches[i]) {
+			scullc_destroy_caches();
+			return -ENOMEM;
 		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
-	dev->size = 0;
-	dev->qset = scullc_qset;
-	dev->quantum = scullc_quantum;
-	dev->next = NULL;
 	return 0;
 }
 
@@ -471,6 +702,16 @@ int scullc_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init();
+	if (result)
+		goto fail_malloc;
+	result = scull_evict_init();
+	if (result)
+		goto fail_malloc;
+	result = scullc_create_caches();
+	if (result)
+		goto fail_malloc;
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -479,29 +720,31 @@ int scullc_init(void)
 	scullc_devices = kmalloc(scullc_devs*sizeof (struct scullc_dev), GFP_KERNEL);
 	if (!scullc_devices) {
 		result = -ENOMEM;
-		goto fail_malloc;
+		goto fail_devices;
 	}
 	memset(scullc_devices, 0, scullc_devs*sizeof (struct scullc_dev));
 	for (i = 0; i < scullc_devs; i++) {
-		scullc_devices[i].quantum = scullc_quantum;
+		scullc_devices[i].class = scullc_size_class(scullc_quantum);
+		scullc_devices[i].quantum = 1 << (scullc_devices[i].class + SCULLC_MIN_SHIFT);
 		scullc_devices[i].qset = scullc_qset;
+		xa_init(&scullc_devices[i].data);
 		mutex_init (&scullc_devices[i].lock);
+		scull_async_queue_init(&scullc_devices[i].aio, &scullc_devices[i].lock);
+		scull_evict_dev_init(&scullc_devices[i].evict, &scullc_devices[i].lock,
+				scullc_discard);
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
 
-	scullc_cache = kmem_cache_create("scullc", scullc_quantum,
-			0, SLAB_HWCACHE_ALIGN, NULL); /* no ctor/dtor */
-	if (!scullc_cache) {
-		scullc_cleanup();
-		return -ENOMEM;
-	}
-
 #ifdef SCULLC_USE_PROC /* only when available */
 	proc_create("scullcmem", 0, NULL, proc_ops_wrapper(&scullc_proc_ops,scullc_pops));
 #endif
 	return 0; /* succeed */
 
+  fail_devices:
+	scullc_destroy_caches();
   fail_malloc:
+	scull_evict_cleanup();
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, scullc_devs);
 	return result;
 }
@@ -515,15 +758,19 @@ void scullc_cleanup(void)
 #ifdef SCULLC_USE_PROC
 	remove_proc_entry("scullcmem", NULL);
 #endif
+	/* no more reclaim: the shrinker mustn't see devices go */
+	scull_evict_cleanup();
 
 	for (i = 0; i < scullc_devs; i++) {
 		cdev_del(&scullc_devices[i].cdev);
 		scullc_trim(scullc_devices + i);
+		scull_evict_dev_release(&scullc_devices[i].evict);
+		scull_async_queue_release(&scullc_devices[i].aio);
 	}
 	kfree(scullc_devices);
+	scull_async_cleanup();
 
-	if (scullc_cache)
-		kmem_cache_destroy(scullc_cache);
+	scullc_destroy_caches();
 	unregister_chrdev_region(MKDEV (scullc_major, 0), scullc_devs);
 }
 
@@ -16,101 +16,128 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
-#include <asm/pgtable.h>
-
+#include <linux/fs.h>
+#include <linux/version.h>
 #include "scullc.h"		/* local definitions */
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+typedef int vm_fault_t;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+#define vm_flags_set(vma, flags)	((vma)->vm_flags |= (flags))
+#endif
+
+/*
+ * How many pages one fault maps: the faulting page and the others in
+ * the same aligned window, if they are on the device and in the vma.
+ */
+static unsigned int scullc_fault_around = 16;
+module_param(scullc_fault_around, uint, S_IRUGO | S_IWUSR);
+
 
 /*
  * open and close: just keep track of how many times the device is
  * mapped, to avoid releasing it.
  */
 
-void scullc_vma_open(struct vm_area_struct *vma)
+static void scullc_vma_open(struct vm_area_struct *vma)
 {
 	struct scullc_dev *dev = vma->vm_private_data;
 
-	dev->vmas++;
+	atomic_inc(&dev->vmas);
 }
 
-void scullc_vma_close(struct vm_area_struct *vma)
+static void scullc_vma_close(struct vm_area_struct *vma)
 {
 	struct scullc_dev *dev = vma->vm_private_data;
 
-	dev->vmas--;
+	atomic_dec(&dev->vmas);
 }
 
 /*
- * The nopage method: the core of the file. It retrieves the
- * page required from the scullc device and returns it to the
- * user. The count for the page must be incremented, because
- * it is automatically decremented at page unmap.
- *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * The fault method. Quanta are slab objects, whose pages can't be
+ * reference counted by user mappings the way scullp's are; they are
+ * mapped by page frame number instead, which is safe because a mapped
+ * device is never trimmed. The quantum is one xarray lookup away, with
+ * no need for the device mutex: quanta are only added while the device
+ * is mapped. Neighbouring pages are inserted in the same pass, so
+ * walking a large mapping costs one fault per window rather than one
+ * per page. A hole, or anything past the end of the device, gets the
+ * process a SIGBUS.
  */
-
-struct page *scullc_vma_nopage(struct vm_area_struct *vma,
-                                unsigned long address, int *type)
+static vm_fault_t scullc_vma_fault(struct vm_fault *vmf)
 {
-	unsigned long offset;
-	struct scullc_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NOPAGE_SIGBUS;
-	void *pageptr = NULL; /* default to "missing" */
-
-	mutex_lock(&dev->lock);
-	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
-
-	/*
-	 * Now retrieve the scullc device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	struct vm_area_struct *vma = vmf->vma;
+	struct scullc_dev *dev = vma->vm_private_data;
+	unsigned long per_quantum = dev->quantum >> PAGE_SHIFT;
+	unsigned long window = max(READ_ONCE(scullc_fault_around), 1U);
+	unsigned long first, last, off, index = ULONG_MAX;
+	void *data = NULL;
+	vm_fault_t retval = VM_FAULT_SIGBUS, ret;
+
+	/* the pages we may map: in the vma, on the device, in the window */
+	last = min(vma->vm_pgoff + vma_pages(vma),
+		   DIV_ROUND_UP(READ_ONCE(dev->size), PAGE_SIZE));
+	if (vmf->pgoff >= last)
+		return VM_FAULT_SIGBUS; /* out of range */
+	first = max(vmf->pgoff - vmf->pgoff % window, vma->vm_pgoff);
+	last = min(last, first + window);
+
+	for (off = first; off < last; off++) {
+		if (off / per_quantum != index) {
+			index = off / per_quantum;
+			data = xa_load(&dev->data, index);
+		}
+		if (!data) /* a hole */
+			continue;
+
+		ret = vmf_insert_pfn(vma, vma->vm_start +
+				((off - vma->vm_pgoff) << PAGE_SHIFT),
+				page_to_pfn(virt_to_page(data)) + off % per_quantum);
+		if (off == vmf->pgoff) /* neighbours are best effort */
+			retval = ret;
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-
-	/* got it, now increment the count */
-	get_page(page);
-	if (type)
-		*type = VM_FAULT_MINOR;
-  out:
-	mutex_unlock(&dev->lock);
-	return page;
+	return retval;
 }
 
 
 
-struct vm_operations_struct scullc_vm_ops = {
+static const struct vm_operations_struct scullc_vm_ops = {
 	.open =     scullc_vma_open,
 	.close =    scullc_vma_close,
-	.nopage =   scullc_vma_nopage,
+	.fault =    scullc_vma_fault,
 };
 
 
 int scullc_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_dentry->d_inode;
+	struct scullc_dev *dev = filp->private_data;
 
-	/* refuse to map if order is not 0 */
-	if (scullc_devices[iminor(inode)].order)
-		return -ENODEV;
+	/* page frames can't be copied on write: no private writable maps */
+	if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE)
+		return -EINVAL;
 
-	/* don't do anything here: "nopage" will set up page table entries */
+	/*
+	 * Counting the mapping under the mutex keeps a trim, which may
+	 * change the quantum, from slipping in between.
+	 */
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	/* every page of the device must lie within one page-aligned quantum */
+	if (dev->quantum % PAGE_SIZE) {
+		mutex_unlock(&dev->lock);
+		return -ENODEV;
+	}
 	vma->vm_ops = &scullc_vm_ops;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_private_data = dev;
 	scullc_vma_open(vma);
+	mutex_unlock(&dev->lock);
+
+	/* the fault handler inserts page frames itself */
+	vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
 	return 0;
 }
-
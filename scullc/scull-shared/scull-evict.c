@@ -0,0 +1 @@
+../../scull-shared/scull-evict.c
\ No newline at end of file
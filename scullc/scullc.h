@@ -15,6 +15,10 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include "scull-shared/scull-async.h"
+#include "scull-shared/scull-evict.h"
+#include "scull-shared/scull-reserve.h"
 
 /*
  * Macros to help debugging
@@ -42,24 +46,34 @@
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use an xarray of quanta, as scull does.
  *
- * "scullc_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * "scullc_dev->data" maps a quantum number to a memory area of
+ * "quantum" bytes from one of the scullc caches. There is a cache per
+ * size class, every power of two from 512 bytes to 64 KB, and a device
+ * picks its class when trimmed: the smallest that holds scullc_quantum.
+ * When the quantum is a whole number of pages the cache hands out
+ * page-aligned objects, and the device can be mapped (see mmap.c).
  *
- * The array (quantum-set) is SCULLC_QSET long.
+ * SCULLC_QSET is nominal, kept for the qset ioctls.
  */
-#define SCULLC_QUANTUM  4000 /* use a quantum size like scull */
+#define SCULLC_QUANTUM  PAGE_SIZE /* use a quantum size like scull */
 #define SCULLC_QSET     500
 
+#define SCULLC_MIN_SHIFT 9        /* 512-byte quanta */
+#define SCULLC_MAX_SHIFT 16       /* to 64 KB */
+#define SCULLC_CLASSES   (SCULLC_MAX_SHIFT - SCULLC_MIN_SHIFT + 1)
+
 struct scullc_dev {
-	void **data;
-	struct scullc_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
+	struct xarray data;       /* quanta, indexed by quantum number */
+	atomic_t vmas;            /* active mappings */
 	int quantum;              /* the current allocation size */
-	int qset;                 /* the current array size */
+	int class;                /* and its size class */
+	int qset;                 /* nominal */
 	size_t size;              /* 32-bit will suffice */
 	struct mutex lock;     /* Mutual exclusion */
+	struct scull_async_queue aio; /* AIO waiting for the lock */
+	struct scull_evict evict; /* memory pressure may take quanta back */
 	struct cdev cdev;
 };
 
@@ -79,7 +93,7 @@ extern int scullc_qset;
  * Prototypes for shared functions
  */
 int scullc_trim(struct scullc_dev *dev);
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
+int scullc_mmap(struct file *filp, struct vm_area_struct *vma);
 
 
 #ifdef SCULLC_DEBUG
@@ -116,7 +130,10 @@ struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
 #define SCULLC_IOCXQSET    _IOWR(SCULLC_IOC_MAGIC,11, int)
 #define SCULLC_IOCHQSET    _IO(SCULLC_IOC_MAGIC,  12)
 
-#define SCULLC_IOC_MAXNR 12
+/* Allocate a byte range ahead of time: see scull-shared/scull-reserve.h */
+#define SCULLC_IOCRESERVE  _IOW(SCULLC_IOC_MAGIC, 13, struct scull_reserve)
+
+#define SCULLC_IOC_MAXNR 13
 
 
 
@@ -28,7 +28,9 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
 #include <linux/uaccess.h>
-#include "scull-shared/scull-async.h"
+#include <linux/sched/signal.h>
+#include <linux/mm.h>		/* alloc_pages_node(), page_address() */
+#include <linux/topology.h>	/* numa_mem_id() */
 #include "sculld.h"		/* local definitions */
 #include "access_ok_version.h"
 
@@ -83,6 +85,8 @@ int sculld_read_procmem(struct seq_file *m, void *v)
 		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
+		scull_async_show(m, &d->aio);
+		scull_evict_show(m, &d->evict);
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -168,105 +172,228 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
  * Data management: read and write
  */
 
-ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t sculld_do_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct sculld_dev *dev = filp->private_data; /* the first listitem */
+	struct sculld_dev *dev = iocb->ki_filp->private_data; /* the first listitem */
 	struct sculld_dev *dptr;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
 	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(to);
+	size_t chunk, copied, done = 0;
 	ssize_t retval = 0;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	if (iocb->ki_pos > dev->size) 
+		return 0;
+	if (iocb->ki_pos + count > dev->size)
+		count = dev->size - iocb->ki_pos;
 	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
+	item = ((long) iocb->ki_pos) / itemsize;
+	rest = ((long) iocb->ki_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = sculld_follow(dev, item);
 
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
+	/* then copy quantum by quantum, moving along the list as we go */
+	while (done < count) {
+		if (s_pos == qset) {
+			dptr = dptr ? dptr->next : NULL;
+			item++;
+			s_pos = 0;
+		}
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		if (dptr && dptr->data && dptr->data[s_pos]) {
+			scull_evict_touch(&dev->evict, (unsigned long)item * qset + s_pos);
+			copied = copy_to_iter(dptr->data[s_pos] + q_pos, chunk, to);
+		} else { /* a hole reads as zeros */
+			copied = iov_iter_zero(chunk, to);
+		}
+		done += copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		s_pos++;
+		q_pos = 0;
+	}
+	/* a fault after some progress is reported as a short read */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	mutex_unlock(&dev->mutex);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock(&dev->mutex);
 	return retval;
 }
 
 
 
-ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t sculld_do_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct sculld_dev *dev = filp->private_data;
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
 	struct sculld_dev *dptr;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
 	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(from);
+	size_t chunk, copied, done = 0;
 	ssize_t retval = -ENOMEM; /* our most likely error */
+	bool unzeroed;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
+	if (!count)
+		return 0;
 
 	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
+	item = ((long) iocb->ki_pos) / itemsize;
+	rest = ((long) iocb->ki_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
 	/* follow the list up to the right position */
 	dptr = sculld_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Here's the allocation of a single quantum */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+
+	/* then fill quantum by quantum, extending the list as we go */
+	while (done < count) {
+		if (s_pos == qset) {
+			dptr = sculld_follow(dptr, 1);
+			item++;
+			s_pos = 0;
+		}
+		if (!dptr->data) {
+			dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+			if (!dptr->data)
+				break;
+			memset(dptr->data, 0, qset * sizeof(char *));
+		}
+		/* Here's the allocation of a single quantum */
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		unzeroed = false;
+		if (!dptr->data[s_pos]) {
+			/* no need to zero a quantum about to be written whole */
+			unzeroed = chunk == quantum;
+			dptr->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL |
+					(unzeroed ? 0 : __GFP_ZERO), dev->order);
+			if (!dptr->data[s_pos])
+				break;
+			scull_evict_add(&dev->evict, (unsigned long)item * qset + s_pos);
+		} else {
+			scull_evict_touch(&dev->evict, (unsigned long)item * qset + s_pos);
+		}
+		copied = copy_from_iter(dptr->data[s_pos] + q_pos, chunk, from);
+		done += copied;
+		if (copied < chunk) {
+			if (unzeroed) /* nobody sees it before we let go of the mutex */
+				memset(dptr->data[s_pos] + copied, 0, quantum - copied);
+			retval = -EFAULT;
+			break;
+		}
+		s_pos++;
+		q_pos = 0;
 	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
+	/* running out of memory or faulting part way is a short write */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	*f_pos += count;
  
     	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock(&dev->mutex);
-	return count;
+	if (dev->size < iocb->ki_pos)
+		dev->size = iocb->ki_pos;
+	return retval;
+}
 
-  nomem:
-	mutex_unlock(&dev->mutex);
+ssize_t sculld_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, to, sculld_do_read);
+}
+
+ssize_t sculld_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, from, sculld_do_write);
+}
+
+/*
+ * Reserving: give every missing quantum in the range its memory now,
+ * a window of SCULL_RESERVE_BATCH quanta at a time. A window's quanta
+ * are allocated in parallel, with the device locked, then put in their
+ * slots; the lock is let go between windows, so that I/O gets a look in.
+ * The workers run on other CPUs, so they are told the caller's node:
+ * a write would have had its quanta there.
+ */
+struct sculld_reserve_arg {
+	struct sculld_dev *dev;
+	int node;		/* numa_mem_id() of the caller */
+};
+
+static void *sculld_reserve_quantum(void *arg)
+{
+	struct sculld_reserve_arg *ra = arg;
+	struct page *page = alloc_pages_node(ra->node, GFP_KERNEL | __GFP_ZERO,
+			ra->dev->order);
+
+	return page ? page_address(page) : NULL;
+}
+
+static int sculld_reserve(struct sculld_dev *dev, struct scull_reserve *r)
+{
+	struct sculld_reserve_arg ra = { .dev = dev, .node = numa_mem_id() };
+	struct sculld_dev *dptr;
+	u64 pos = r->offset, end = r->offset + r->length;
+	unsigned long *indices, index, last;
+	void **quanta, ***slots;
+	int i, n, shift, retval = 0;
+
+	quanta = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void *), GFP_KERNEL);
+	slots = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void **), GFP_KERNEL);
+	indices = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(long), GFP_KERNEL);
+	if (!quanta || !slots || !indices)
+		retval = -ENOMEM;
+
+	while (!retval && pos < end) {
+		if (signal_pending(current) || mutex_lock_interruptible(&dev->mutex)) {
+			retval = -ERESTARTSYS;
+			break;
+		}
+		/* the quantum may have changed since the last window */
+		shift = PAGE_SHIFT + dev->order;
+		index = pos >> shift;
+		last = min_t(u64, (end - 1) >> shift, index + SCULL_RESERVE_BATCH - 1);
+		for (n = 0, dptr = NULL; index <= last; index++) {
+			if (!dptr)
+				dptr = sculld_follow(dev, index / dev->qset);
+			else if (index % dev->qset == 0)
+				dptr = sculld_follow(dptr, 1);
+			if (!dptr->data) {
+				dptr->data = kcalloc(dev->qset, sizeof(void *), GFP_KERNEL);
+				if (!dptr->data) {
+					retval = -ENOMEM;
+					break;
+				}
+			}
+			if (!dptr->data[index % dev->qset]) {
+				slots[n] = dptr->data + index % dev->qset;
+				indices[n++] = index;
+			}
+		}
+		pos = (u64)index << shift;
+
+		if (scull_reserve_alloc(quanta, n, sculld_reserve_quantum, &ra))
+			retval = -ENOMEM;
+		for (i = 0; i < n; i++) {
+			if (!quanta[i])
+				continue;
+			*slots[i] = quanta[i];
+			scull_evict_add(&dev->evict, indices[i]);
+		}
+		mutex_unlock(&dev->mutex);
+	}
+	kfree(indices);
+	kfree(slots);
+	kfree(quanta);
 	return retval;
 }
 
@@ -278,6 +405,7 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
 	int err = 0, ret = 0, tmp;
+	struct scull_reserve r;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLD_IOC_MAGIC) return -ENOTTY;
@@ -357,6 +485,14 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		sculld_qset = arg;
 		return tmp;
 
+	case SCULLD_IOCRESERVE: /* arg points to the range */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		ret = scull_reserve_get(&r, (void __user *)arg);
+		if (ret == 0)
+			ret = sculld_reserve(filp->private_data, &r);
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -368,10 +504,46 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
  * The "extended" operations
  */
 
+/*
+ * SEEK_DATA and SEEK_HOLE: where the first quantum at or after "off"
+ * that is there ("data"), or missing, starts; the end of the device
+ * counts as a hole. Walks the list without extending it; called with
+ * the device mutex held.
+ */
+static loff_t sculld_seek_data(struct sculld_dev *dev, loff_t off, bool data)
+{
+	struct sculld_dev *dptr = dev;
+	long quantum = PAGE_SIZE << dev->order;
+	int qset = dev->qset;
+	unsigned long index, last, item;
+	int s_pos;
+
+	if (off < 0 || off >= dev->size)
+		return -ENXIO;
+	index = (long) off / quantum;
+	last = (dev->size - 1) / quantum;
+	item = index / qset;
+	s_pos = index % qset;
+	while (dptr && item--)
+		dptr = dptr->next;
+
+	for (; index <= last; index++, s_pos++) {
+		if (s_pos == qset) {
+			dptr = dptr ? dptr->next : NULL;
+			s_pos = 0;
+		}
+		if ((dptr && dptr->data && dptr->data[s_pos]) == data)
+			break;
+	}
+	if (index > last)
+		return data ? -ENXIO : dev->size;
+	return max_t(loff_t, off, (loff_t)index * quantum);
+}
+
 loff_t sculld_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct sculld_dev *dev = filp->private_data;
-	long newpos;
+	loff_t newpos;
 
 	switch(whence) {
 	case 0: /* SEEK_SET */
@@ -386,6 +558,16 @@ loff_t sculld_llseek (struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		newpos = sculld_seek_data(dev, off, whence == SEEK_DATA);
+		mutex_unlock(&dev->mutex);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	default: /* can't happen */
 		return -EINVAL;
 	}
@@ -408,14 +590,12 @@ extern int sculld_mmap(struct file *filp, struct vm_area_struct *vma);
 struct file_operations sculld_fops = {
 	.owner =     THIS_MODULE,
 	.llseek =    sculld_llseek,
-	.read =	     sculld_read,
-	.write =     sculld_write,
 	.unlocked_ioctl = sculld_ioctl,
 	.mmap =	     sculld_mmap,
 	.open =	     sculld_open,
 	.release =   sculld_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.read_iter =  sculld_read_iter,
+	.write_iter = sculld_write_iter,
 };
 
 int sculld_trim(struct sculld_dev *dev)
@@ -433,7 +613,7 @@ int sculld_trim(struct sculld_dev *dev)
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
 					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
+							dev->order);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
@@ -441,6 +621,7 @@ int sculld_trim(struct sculld_dev *dev)
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	scull_evict_reset(&dev->evict);
 	dev->size = 0;
 	dev->qset = sculld_qset;
 	dev->order = sculld_order;
@@ -448,6 +629,27 @@ int sculld_trim(struct sculld_dev *dev)
 	return 0;
 }
 
+/*
+ * Evictable mode: free quantum "index" of the device, with the device
+ * mutex held, unless the device is mapped. The list is walked by hand,
+ * since sculld_follow() would extend it.
+ */
+static bool sculld_discard(struct scull_evict *e, unsigned long index)
+{
+	struct sculld_dev *dptr, *dev = container_of(e, struct sculld_dev, evict);
+	unsigned long item = index / dev->qset;
+
+	if (dev->vmas)
+		return false;
+	for (dptr = dev; dptr && item; item--)
+		dptr = dptr->next;
+	if (dptr && dptr->data && dptr->data[index % dev->qset]) {
+		free_pages((unsigned long)dptr->data[index % dev->qset], dev->order);
+		dptr->data[index % dev->qset] = NULL;
+	}
+	return true;
+}
+
 
 static void sculld_setup_cdev(struct sculld_dev *dev, int index)
 {
@@ -502,6 +704,13 @@ int sculld_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init();
+	if (result)
+		goto fail_malloc;
+	result = scull_evict_init();
+	if (result)
+		goto fail_malloc;
+
 	/*
 	 * Register with the driver core.
 	 */
@@ -521,6 +730,9 @@ int sculld_init(void)
 		sculld_devices[i].order = sculld_order;
 		sculld_devices[i].qset = sculld_qset;
 		mutex_init(&sculld_devices[i].mutex);
+		scull_async_queue_init(&sculld_devices[i].aio, &sculld_devices[i].mutex);
+		scull_evict_dev_init(&sculld_devices[i].evict, &sculld_devices[i].mutex,
+				sculld_discard);
 		sculld_setup_cdev(sculld_devices + i, i);
 		sculld_register_dev(sculld_devices + i, i);
 	}
@@ -532,6 +744,8 @@ int sculld_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	scull_evict_cleanup();
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, sculld_devs);
 	return result;
 }
@@ -545,13 +759,18 @@ void sculld_cleanup(void)
 #ifdef SCULLD_USE_PROC
 	remove_proc_entry("sculldmem", NULL);
 #endif
+	/* no more reclaim: the shrinker mustn't see devices go */
+	scull_evict_cleanup();
 
 	for (i = 0; i < sculld_devs; i++) {
 		unregister_ldd_device(&sculld_devices[i].ldev);
 		cdev_del(&sculld_devices[i].cdev);
 		sculld_trim(sculld_devices + i);
+		scull_evict_dev_release(&sculld_devices[i].evict);
+		scull_async_queue_release(&sculld_devices[i].aio);
 	}
 	kfree(sculld_devices);
+	scull_async_cleanup();
 	unregister_ldd_driver(&sculld_driver);
 	unregister_chrdev_region(MKDEV (sculld_major, 0), sculld_devs);
 }
@@ -0,0 +1 @@
+../../scull-shared/scull-reserve.c
\ No newline at end of file
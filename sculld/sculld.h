@@ -17,6 +17,9 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include "../include/lddbus.h"
+#include "scull-shared/scull-async.h"
+#include "scull-shared/scull-evict.h"
+#include "scull-shared/scull-reserve.h"
 
 /*
  * Macros to help debugging
@@ -62,6 +65,8 @@ struct sculld_dev {
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
 	struct mutex mutex;     /* Mutual exclusion */
+	struct scull_async_queue aio; /* AIO waiting for the lock */
+	struct scull_evict evict; /* memory pressure may take quanta back */
 	struct cdev cdev;
 	char devname[20];
 	struct ldd_device ldev;
@@ -120,7 +125,10 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
 #define SCULLD_IOCXQSET    _IOWR(SCULLD_IOC_MAGIC,11, int)
 #define SCULLD_IOCHQSET    _IO(SCULLD_IOC_MAGIC,  12)
 
-#define SCULLD_IOC_MAXNR 12
+/* Allocate a byte range ahead of time: see scull-shared/scull-reserve.h */
+#define SCULLD_IOCRESERVE  _IOW(SCULLD_IOC_MAGIC, 13, struct scull_reserve)
+
+#define SCULLD_IOC_MAXNR 13
 
 
 
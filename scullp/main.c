@@ -29,8 +29,11 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>	/* ivo_iter* */
+#include <linux/mm.h>		/* alloc_pages(), split_page() */
+#include <linux/log2.h>
+#include <linux/topology.h>	/* numa_mem_id() */
+#include <linux/sched/signal.h>
 #include "scullp.h"		/* local definitions */
-#include "scull-shared/scull-async.h"
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
 
@@ -38,11 +41,13 @@ int scullp_major =   SCULLP_MAJOR;
 int scullp_devs =    SCULLP_DEVS;	/* number of bare scullp devices */
 int scullp_qset =    SCULLP_QSET;
 int scullp_order =   SCULLP_ORDER;
+int scullp_adaptive = 0;	/* highest order of adaptive blocks, 0 for off */
 
 module_param(scullp_major, int, 0);
 module_param(scullp_devs, int, 0);
 module_param(scullp_qset, int, 0);
 module_param(scullp_order, int, 0);
+module_param(scullp_adaptive, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -66,7 +71,8 @@ int scullp_read_procmem(struct seq_file *m, void *v)
 {
 	int i, j, order, qset;
 	int limit = m->size - 80; /* Don't print more than this */
-	struct scullp_dev *d;
+	struct scullp_dev *d, *dptr;
+	unsigned long *count;
 
 	for(i = 0; i < scullp_devs; i++) {
 		d = &scullp_devices[i];
@@ -76,6 +82,21 @@ int scullp_read_procmem(struct seq_file *m, void *v)
 		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
+		if (d->adaptive) {
+			seq_printf(m, "  blocks by order:");
+			for (j = 0; j <= d->adaptive; j++)
+				seq_printf(m, " %lu", d->blocks[j]);
+			seq_printf(m, ", fallbacks %lu\n", d->fallbacks);
+		}
+		scull_async_show(m, &d->aio);
+		scull_evict_show(m, &d->evict);
+		count = scull_numa_count_start();
+		for (dptr = d; dptr; dptr = dptr->next)
+			for (j = 0; dptr->data && j < qset; j++)
+				if (dptr->data[j])
+					scull_numa_count(count, dptr->data[j],
+							PAGE_SIZE << order);
+		scull_numa_show(m, count);
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -161,105 +182,299 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
  * Data management: read and write
  */
 
-ssize_t scullp_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Adaptive mode: the order of the block to allocate at slot "s_pos" of
+ * a quantum set, "index" pages into the device. Small files, and files
+ * not written sequentially, get single pages; a file growing at its end
+ * gets blocks of about a quarter of what it holds already. A block must
+ * be aligned within the quantum set, fit in it, and find its slots free.
+ */
+static int scullp_block_order(struct scullp_dev *dev, struct scullp_dev *dptr,
+		int s_pos, unsigned long index, bool sequential)
+{
+	int order, i;
+
+	if (!sequential || index < 8)
+		return 0;
+	order = min_t(int, dev->adaptive, ilog2(index / 4));
+	for (; order; order--) {
+		if ((s_pos & ((1 << order) - 1)) || s_pos + (1 << order) > dev->qset)
+			continue;
+		for (i = 1; i < (1 << order); i++)
+			if (dptr->data[s_pos + i])
+				break;
+		if (i == (1 << order))
+			break;
+	}
+	return order;
+}
+
+/*
+ * Allocate a block of 1 << order zeroed pages for the slots starting at
+ * "slot", page "index" of the device, settling for smaller ones, down to
+ * a single page, when memory is too fragmented. The block is split, so
+ * every page in it can be mapped and freed (or evicted) on its own, like
+ * any other order-0 quantum.
+ */
+static int scullp_alloc_block(struct scullp_dev *dev, void **slot, int order,
+		unsigned long index)
+{
+	struct page *page;
+	int i;
+
+	for (;; order--) {
+		page = scull_numa_alloc_pages(GFP_KERNEL | __GFP_ZERO |
+				(order ? __GFP_NORETRY | __GFP_NOWARN : 0), order);
+		if (page || !order)
+			break;
+		dev->fallbacks++;
+	}
+	if (!page)
+		return -ENOMEM;
+	if (order)
+		split_page(page, order);
+	for (i = 0; i < (1 << order); i++) {
+		slot[i] = page_address(page + i);
+		scull_evict_add(&dev->evict, index + i);
+	}
+	dev->blocks[order]++;
+	return 0;
+}
+
+static ssize_t scullp_do_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct scullp_dev *dev = filp->private_data; /* the first listitem */
+	struct scullp_dev *dev = iocb->ki_filp->private_data; /* the first listitem */
 	struct scullp_dev *dptr;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
 	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(to);
+	size_t chunk, copied, done = 0;
 	ssize_t retval = 0;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	if (iocb->ki_pos > dev->size) 
+		return 0;
+	if (iocb->ki_pos + count > dev->size)
+		count = dev->size - iocb->ki_pos;
 	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
+	item = ((long) iocb->ki_pos) / itemsize;
+	rest = ((long) iocb->ki_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullp_follow(dev, item);
 
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
+	/* then copy quantum by quantum, moving along the list as we go */
+	while (done < count) {
+		if (s_pos == qset) {
+			dptr = dptr ? dptr->next : NULL;
+			item++;
+			s_pos = 0;
+		}
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		if (dptr && dptr->data && dptr->data[s_pos]) {
+			scull_evict_touch(&dev->evict, (unsigned long)item * qset + s_pos);
+			copied = copy_to_iter(dptr->data[s_pos] + q_pos, chunk, to);
+		} else { /* a hole reads as zeros */
+			copied = iov_iter_zero(chunk, to);
+		}
+		done += copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		s_pos++;
+		q_pos = 0;
+	}
+	/* a fault after some progress is reported as a short read */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	mutex_unlock(&dev->mutex);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock(&dev->mutex);
 	return retval;
 }
 
 
 
-ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t scullp_do_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scullp_dev *dev = filp->private_data;
+	struct scullp_dev *dev = iocb->ki_filp->private_data;
 	struct scullp_dev *dptr;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
 	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(from);
+	size_t chunk, copied, done = 0;
 	ssize_t retval = -ENOMEM; /* our most likely error */
+	bool sequential = iocb->ki_pos == dev->size; /* appending */
+	bool unzeroed;
+	unsigned long index;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
+	if (!count)
+		return 0;
 
 	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
+	item = ((long) iocb->ki_pos) / itemsize;
+	rest = ((long) iocb->ki_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
 	/* follow the list up to the right position */
 	dptr = scullp_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Here's the allocation of a single quantum */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+
+	/* then fill quantum by quantum, extending the list as we go */
+	while (done < count) {
+		if (s_pos == qset) {
+			dptr = scullp_follow(dptr, 1);
+			item++;
+			s_pos = 0;
+		}
+		if (!dptr->data) {
+			dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+			if (!dptr->data)
+				break;
+			memset(dptr->data, 0, qset * sizeof(char *));
+		}
+		/* Here's the allocation of a single quantum, or a block */
+		index = (unsigned long)item * qset + s_pos;
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		unzeroed = false;
+		if (dptr->data[s_pos]) {
+			scull_evict_touch(&dev->evict, index);
+		} else if (dev->adaptive) {
+			int order = scullp_block_order(dev, dptr, s_pos,
+					index, sequential);
+
+			if (scullp_alloc_block(dev, dptr->data + s_pos, order, index))
+				break;
+		} else {
+			struct page *page;
+
+			/* no need to zero a quantum about to be written whole */
+			unzeroed = chunk == quantum;
+			page = scull_numa_alloc_pages(GFP_KERNEL |
+					(unzeroed ? 0 : __GFP_ZERO), dev->order);
+			if (!page)
+				break;
+			dptr->data[s_pos] = page_address(page);
+			scull_evict_add(&dev->evict, index);
+		}
+		copied = copy_from_iter(dptr->data[s_pos] + q_pos, chunk, from);
+		done += copied;
+		if (copied < chunk) {
+			if (unzeroed) /* nobody sees it before we let go of the mutex */
+				memset(dptr->data[s_pos] + copied, 0, quantum - copied);
+			retval = -EFAULT;
+			break;
+		}
+		s_pos++;
+		q_pos = 0;
 	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
+	/* running out of memory or faulting part way is a short write */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	*f_pos += count;
  
     	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock(&dev->mutex);
-	return count;
+	if (dev->size < iocb->ki_pos)
+		dev->size = iocb->ki_pos;
+	return retval;
+}
+
+ssize_t scullp_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scullp_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, to, scullp_do_read);
+}
+
+ssize_t scullp_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scullp_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, from, scullp_do_write);
+}
+
+/*
+ * Reserving: give every missing quantum in the range its memory now,
+ * a window of SCULL_RESERVE_BATCH quanta at a time. A window's quanta
+ * are allocated in parallel, with the device locked, then put in their
+ * slots; the lock is let go between windows, so that I/O gets a look in.
+ * The workers run on other CPUs, so they are told the caller's node:
+ * that is where quanta go if they would have for a write.
+ */
+struct scullp_reserve_arg {
+	struct scullp_dev *dev;
+	int node;		/* numa_mem_id() of the caller */
+};
 
-  nomem:
-	mutex_unlock(&dev->mutex);
+static void *scullp_reserve_quantum(void *arg)
+{
+	struct scullp_reserve_arg *ra = arg;
+	struct page *page = scull_numa_alloc_pages_on(GFP_KERNEL | __GFP_ZERO,
+			ra->dev->order, ra->node);
+
+	return page ? page_address(page) : NULL;
+}
+
+static int scullp_reserve(struct scullp_dev *dev, struct scull_reserve *r)
+{
+	struct scullp_reserve_arg ra = { .dev = dev, .node = numa_mem_id() };
+	struct scullp_dev *dptr;
+	u64 pos = r->offset, end = r->offset + r->length;
+	unsigned long *indices, index, last;
+	void **quanta, ***slots;
+	int i, n, shift, retval = 0;
+
+	quanta = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void *), GFP_KERNEL);
+	slots = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void **), GFP_KERNEL);
+	indices = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(long), GFP_KERNEL);
+	if (!quanta || !slots || !indices)
+		retval = -ENOMEM;
+
+	while (!retval && pos < end) {
+		if (signal_pending(current) || mutex_lock_interruptible(&dev->mutex)) {
+			retval = -ERESTARTSYS;
+			break;
+		}
+		/* the quantum may have changed since the last window */
+		shift = PAGE_SHIFT + dev->order;
+		index = pos >> shift;
+		last = min_t(u64, (end - 1) >> shift, index + SCULL_RESERVE_BATCH - 1);
+		for (n = 0, dptr = NULL; index <= last; index++) {
+			if (!dptr)
+				dptr = scullp_follow(dev, index / dev->qset);
+			else if (index % dev->qset == 0)
+				dptr = scullp_follow(dptr, 1);
+			if (!dptr->data) {
+				dptr->data = kcalloc(dev->qset, sizeof(void *), GFP_KERNEL);
+				if (!dptr->data) {
+					retval = -ENOMEM;
+					break;
+				}
+			}
+			if (!dptr->data[index % dev->qset]) {
+				slots[n] = dptr->data + index % dev->qset;
+				indices[n++] = index;
+			}
+		}
+		pos = (u64)index << shift;
+
+		if (scull_reserve_alloc(quanta, n, scullp_reserve_quantum, &ra))
+			retval = -ENOMEM;
+		for (i = 0; i < n; i++) {
+			if (!quanta[i])
+				continue;
+			*slots[i] = quanta[i];
+			scull_evict_add(&dev->evict, indices[i]);
+		}
+		mutex_unlock(&dev->mutex);
+	}
+	kfree(indices);
+	kfree(slots);
+	kfree(quanta);
 	return retval;
 }
 
@@ -271,6 +486,7 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
 	int err = 0, ret = 0, tmp;
+	struct scull_reserve r;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLP_IOC_MAGIC) return -ENOTTY;
@@ -350,6 +566,14 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullp_qset = arg;
 		return tmp;
 
+	case SCULLP_IOCRESERVE: /* arg points to the range */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		ret = scull_reserve_get(&r, (void __user *)arg);
+		if (ret == 0)
+			ret = scullp_reserve(filp->private_data, &r);
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -361,10 +585,46 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
  * The "extended" operations
  */
 
+/*
+ * SEEK_DATA and SEEK_HOLE: where the first quantum at or after "off"
+ * that is there ("data"), or missing, starts; the end of the device
+ * counts as a hole. Walks the list without extending it; called with
+ * the device mutex held.
+ */
+static loff_t scullp_seek_data(struct scullp_dev *dev, loff_t off, bool data)
+{
+	struct scullp_dev *dptr = dev;
+	long quantum = PAGE_SIZE << dev->order;
+	int qset = dev->qset;
+	unsigned long index, last, item;
+	int s_pos;
+
+	if (off < 0 || off >= dev->size)
+		return -ENXIO;
+	index = (long) off / quantum;
+	last = (dev->size - 1) / quantum;
+	item = index / qset;
+	s_pos = index % qset;
+	while (dptr && item--)
+		dptr = dptr->next;
+
+	for (; index <= last; index++, s_pos++) {
+		if (s_pos == qset) {
+			dptr = dptr ? dptr->next : NULL;
+			s_pos = 0;
+		}
+		if ((dptr && dptr->data && dptr->data[s_pos]) == data)
+			break;
+	}
+	if (index > last)
+		return data ? -ENXIO : dev->size;
+	return max_t(loff_t, off, (loff_t)index * quantum);
+}
+
 loff_t scullp_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct scullp_dev *dev = filp->private_data;
-	long newpos;
+	loff_t newpos;
 
 	switch(whence) {
 	case 0: /* SEEK_SET */
@@ -379,6 +639,16 @@ loff_t scullp_llseek (struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		newpos = scullp_seek_data(dev, off, whence == SEEK_DATA);
+		mutex_unlock(&dev->mutex);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	default: /* can't happen */
 		return -EINVAL;
 	}
@@ -401,14 +671,12 @@ extern int scullp_mmap(struct file *filp, struct vm_area_struct *vma);
 struct file_operations scullp_fops = {
 	.owner =     THIS_MODULE,
 	.llseek =    scullp_llseek,
-	.read =	     scullp_read,
-	.write =     scullp_write,
 	.unlocked_ioctl = scullp_ioctl,
 	.mmap =	     scullp_mmap,
 	.open =	     scullp_open,
 	.release =   scullp_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.read_iter =  scullp_read_iter,
+	.write_iter = scullp_write_iter,
 };
 
 int scullp_trim(struct scullp_dev *dev)
@@ -426,7 +694,7 @@ int scullp_trim(struct scullp_dev *dev)
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
 					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
+							dev->order);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
@@ -434,13 +702,38 @@ int scullp_trim(struct scullp_dev *dev)
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	scull_evict_reset(&dev->evict);
 	dev->size = 0;
 	dev->qset = scullp_qset;
-	dev->order = scullp_order;
+	dev->adaptive = scullp_adaptive;
+	dev->order = dev->adaptive ? 0 : scullp_order; /* adaptive quanta are pages */
 	dev->next = NULL;
+	memset(dev->blocks, 0, sizeof(dev->blocks));
+	dev->fallbacks = 0;
 	return 0;
 }
 
+/*
+ * Evictable mode: free page "index" of the device, with the device
+ * mutex held, unless the device is mapped. The list is walked by hand,
+ * since scullp_follow() would extend it.
+ */
+static bool scullp_discard(struct scull_evict *e, unsigned long index)
+{
+	struct scullp_dev *dptr, *dev = container_of(e, struct scullp_dev, evict);
+	unsigned long item = index / dev->qset;
+
+	if (dev->vmas)
+		return false;
+	for (dptr = dev; dptr && item; item--)
+		dptr = dptr->next;
+	if (dptr && dptr->data && dptr->data[index % dev->qset]) {
+		free_pages((unsigned long)dptr->data[index % dev->qset], dev->order);
+		dptr->data[index % dev->qset] = NULL;
+	}
+	return true;
+}
+
 
 static void scullp_setup_cdev(struct scullp_dev *dev, int index)
 {
@@ -478,6 +771,13 @@ int scullp_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init();
+	if (result)
+		goto fail_malloc;
+	result = scull_evict_init();
+	if (result)
+		goto fail_malloc;
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -489,10 +789,15 @@ int scullp_init(void)
 		goto fail_malloc;
 	}
 	memset(scullp_devices, 0, scullp_devs*sizeof (struct scullp_dev));
+	scullp_adaptive = clamp(scullp_adaptive, 0, SCULLP_MAX_ADAPTIVE);
 	for (i = 0; i < scullp_devs; i++) {
-		scullp_devices[i].order = scullp_order;
+		scullp_devices[i].adaptive = scullp_adaptive;
+		scullp_devices[i].order = scullp_adaptive ? 0 : scullp_order;
 		scullp_devices[i].qset = scullp_qset;
 		mutex_init(&scullp_devices[i].mutex);
+		scull_async_queue_init(&scullp_devices[i].aio, &scullp_devices[i].mutex);
+		scull_evict_dev_init(&scullp_devices[i].evict, &scullp_devices[i].mutex,
+				scullp_discard);
 		scullp_setup_cdev(scullp_devices + i, i);
 	}
 
@@ -503,6 +808,8 @@ int scullp_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	scull_evict_cleanup();
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, scullp_devs);
 	return result;
 }
@@ -516,12 +823,17 @@ void scullp_cleanup(void)
 #ifdef SCULLP_USE_PROC
 	remove_proc_entry("scullpmem", NULL);
 #endif
+	/* no more reclaim: the shrinker mustn't see devices go */
+	scull_evict_cleanup();
 
 	for (i = 0; i < scullp_devs; i++) {
 		cdev_del(&scullp_devices[i].cdev);
 		scullp_trim(scullp_devices + i);
+		scull_evict_dev_release(&scullp_devices[i].evict);
+		scull_async_queue_release(&scullp_devices[i].aio);
 	}
 	kfree(scullp_devices);
+	scull_async_cleanup();
 	unregister_chrdev_region(MKDEV (scullp_major, 0), scullp_devs);
 }
 
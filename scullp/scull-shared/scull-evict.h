@@ -0,0 +1 @@
+../../scull-shared/scull-evict.h
\ No newline at end of file
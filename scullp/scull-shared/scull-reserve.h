@@ -0,0 +1 @@
+../../scull-shared/scull-reserve.h
\ No newline at end of file
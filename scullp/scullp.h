@@ -16,6 +16,10 @@
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
+#include "scull-shared/scull-async.h"
+#include "scull-shared/scull-numa.h"
+#include "scull-shared/scull-evict.h"
+#include "scull-shared/scull-reserve.h"
 
 /*
  * Macros to help debugging
@@ -53,14 +57,27 @@
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
 
+/*
+ * In adaptive mode quanta are single pages, but a file written
+ * sequentially gets them in blocks of up to 1 << scullp_adaptive
+ * pages, allocated at once and split. This is the highest order
+ * that may be asked for.
+ */
+#define SCULLP_MAX_ADAPTIVE 9
+
 struct scullp_dev {
 	void **data;
 	struct scullp_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
+	int adaptive;             /* highest block order, 0 if not adaptive */
 	size_t size;              /* 32-bit will suffice */
+	unsigned long blocks[SCULLP_MAX_ADAPTIVE + 1]; /* allocated, by order */
+	unsigned long fallbacks;  /* higher orders we couldn't get */
 	struct mutex mutex;     /* Mutual exclusion */
+	struct scull_async_queue aio; /* AIO waiting for the lock */
+	struct scull_evict evict; /* memory pressure may take quanta back */
 	struct cdev cdev;
 };
 
@@ -75,6 +92,7 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern int scullp_adaptive;
 
 /*
  * Prototypes for shared functions
@@ -117,7 +135,10 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 #define SCULLP_IOCXQSET    _IOWR(SCULLP_IOC_MAGIC,11, int)
 #define SCULLP_IOCHQSET    _IO(SCULLP_IOC_MAGIC,  12)
 
-#define SCULLP_IOC_MAXNR 12
+/* Allocate a byte range ahead of time: see scull-shared/scull-reserve.h */
+#define SCULLP_IOCRESERVE  _IOW(SCULLP_IOC_MAGIC, 13, struct scull_reserve)
+
+#define SCULLP_IOC_MAXNR 13
 
 
 
@@ -29,7 +29,11 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
-#include "scull-shared/scull-async.h"
+#include <linux/mm.h>		/* alloc_pages(), offset_in_page() */
+#include <linux/uio.h>		/* copy_page_to_iter() */
+#include <linux/highmem.h>	/* zero_user() */
+#include <linux/topology.h>	/* numa_mem_id() */
+#include <linux/sched/signal.h>
 #include "scullv.h"		/* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
@@ -38,11 +42,13 @@ int scullv_major =   SCULLV_MAJOR;
 int scullv_devs =    SCULLV_DEVS;	/* number of bare scullv devices */
 int scullv_qset =    SCULLV_QSET;
 int scullv_order =   SCULLV_ORDER;
+bool scullv_paged =  false;	/* page arrays instead of vmalloc */
 
 module_param(scullv_major, int, 0);
 module_param(scullv_devs, int, 0);
 module_param(scullv_qset, int, 0);
 module_param(scullv_order, int, 0);
+module_param(scullv_paged, bool, S_IRUGO | S_IWUSR); /* used from the next trim */
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -61,12 +67,22 @@ void scullv_cleanup(void);
  * The proc filesystem: function to read and entry
  */
 
+/* Count the pages of a quantum by node */
+static void scullv_count_quantum(struct scullv_dev *dev, unsigned long *count, void *data)
+{
+	size_t off;
+
+	for (off = 0; off < (PAGE_SIZE << dev->order); off += PAGE_SIZE)
+		scull_numa_count_page(count, scullv_quantum_page(dev, data, off));
+}
+
 /* FIXME: Do we need this here??  It be ugly  */
 int scullv_read_procmem(struct seq_file *m, void *v)
 {
 	int i, j, order, qset;
 	int limit = m->size - 80; /* Don't print more than this */
-	struct scullv_dev *d;
+	struct scullv_dev *d, *dptr;
+	unsigned long *count;
 
 	for(i = 0; i < scullv_devs; i++) {
 		d = &scullv_devices[i];
@@ -76,6 +92,14 @@ int scullv_read_procmem(struct seq_file *m, void *v)
 		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
+		scull_async_show(m, &d->aio);
+		scull_evict_show(m, &d->evict);
+		count = scull_numa_count_start();
+		for (dptr = d; dptr; dptr = dptr->next)
+			for (j = 0; dptr->data && j < qset; j++)
+				if (dptr->data[j])
+					scullv_count_quantum(d, count, dptr->data[j]);
+		scull_numa_show(m, count);
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -161,104 +185,332 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
  * Data management: read and write
  */
 
-ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Allocate and free one quantum: a vmalloc area, or in paged mode an
+ * array of pages, which needn't be in low memory since they are only
+ * reached through copy_page_{to,from}_iter() and mmap. It is zeroed
+ * unless about to be written whole ("zero" false). "local" is the node
+ * of the thread it is for, as scull_numa_alloc_pages_on() wants it.
+ */
+static void *scullv_alloc_quantum(struct scullv_dev *dev, bool zero, int local)
+{
+	int i, n = 1 << dev->order;
+	struct page **pages;
+	void *data;
+
+	if (!dev->paged) {
+		data = scull_numa_vmalloc_on(PAGE_SIZE << dev->order, local);
+		if (data && zero)
+			memset(data, 0, PAGE_SIZE << dev->order);
+		return data;
+	}
+
+	pages = kcalloc(n, sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		pages[i] = scull_numa_alloc_pages_on(GFP_HIGHUSER |
+				(zero ? __GFP_ZERO : 0), 0, local);
+		if (!pages[i])
+			goto fail;
+	}
+	return pages;
+
+  fail:
+	while (i--)
+		__free_page(pages[i]);
+	kfree(pages);
+	return NULL;
+}
+
+static void scullv_free_quantum(struct scullv_dev *dev, void *data)
+{
+	struct page **pages = data;
+	int i;
+
+	if (!dev->paged) {
+		vfree(data);
+		return;
+	}
+	for (i = 0; i < (1 << dev->order); i++)
+		__free_page(pages[i]);
+	kfree(pages);
+}
+
+/* The page holding byte "offset" of a quantum */
+struct page *scullv_quantum_page(struct scullv_dev *dev, void *data, size_t offset)
+{
+	if (dev->paged)
+		return ((struct page **)data)[offset >> PAGE_SHIFT];
+	return vmalloc_to_page(data + (offset & PAGE_MASK));
+}
+
+/*
+ * Copy "bytes" at "offset" in a quantum to or from the iterator. A
+ * paged quantum goes a page at a time, through temporary kernel
+ * mappings where the pages are high.
+ */
+static size_t scullv_copy(struct scullv_dev *dev, void *data, size_t offset,
+		size_t bytes, struct iov_iter *iter, bool writing)
+{
+	size_t done = 0, chunk, copied;
+	struct page *page;
+
+	if (!dev->paged)
+		return writing ? copy_from_iter(data + offset, bytes, iter) :
+			copy_to_iter(data + offset, bytes, iter);
+
+	while (done < bytes) {
+		page = scullv_quantum_page(dev, data, offset + done);
+		chunk = min_t(size_t, bytes - done,
+				PAGE_SIZE - offset_in_page(offset + done));
+		copied = writing ?
+			copy_page_from_iter(page, offset_in_page(offset + done), chunk, iter) :
+			copy_page_to_iter(page, offset_in_page(offset + done), chunk, iter);
+		done += copied;
+		if (copied < chunk)
+			break;
+	}
+	return done;
+}
+
+/* Zero the "bytes" from "offset" on, where a write fell short */
+static void scullv_zero(struct scullv_dev *dev, void *data, size_t offset,
+		size_t bytes)
 {
-	struct scullv_dev *dev = filp->private_data; /* the first listitem */
+	size_t chunk;
+
+	if (!dev->paged) {
+		memset(data + offset, 0, bytes);
+		return;
+	}
+	for (; bytes; offset += chunk, bytes -= chunk) {
+		chunk = min_t(size_t, bytes, PAGE_SIZE - offset_in_page(offset));
+		zero_user(scullv_quantum_page(dev, data, offset),
+				offset_in_page(offset), chunk);
+	}
+}
+
+static ssize_t scullv_do_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scullv_dev *dev = iocb->ki_filp->private_data; /* the first listitem */
 	struct scullv_dev *dptr;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
 	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(to);
+	size_t chunk, copied, done = 0;
 	ssize_t retval = 0;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	if (iocb->ki_pos > dev->size) 
+		return 0;
+	if (iocb->ki_pos + count > dev->size)
+		count = dev->size - iocb->ki_pos;
 	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
+	item = ((long) iocb->ki_pos) / itemsize;
+	rest = ((long) iocb->ki_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullv_follow(dev, item);
 
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
+	/* then copy quantum by quantum, moving along the list as we go */
+	while (done < count) {
+		if (s_pos == qset) {
+			dptr = dptr ? dptr->next : NULL;
+			item++;
+			s_pos = 0;
+		}
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		if (dptr && dptr->data && dptr->data[s_pos]) {
+			scull_evict_touch(&dev->evict, (unsigned long)item * qset + s_pos);
+			copied = scullv_copy(dev, dptr->data[s_pos], q_pos, chunk, to, false);
+		} else { /* a hole reads as zeros */
+			copied = iov_iter_zero(chunk, to);
+		}
+		done += copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		s_pos++;
+		q_pos = 0;
+	}
+	/* a fault after some progress is reported as a short read */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	mutex_unlock(&dev->mutex);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock(&dev->mutex);
 	return retval;
 }
 
 
 
-ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t scullv_do_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scullv_dev *dev = filp->private_data;
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
 	struct scullv_dev *dptr;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
 	int item, s_pos, q_pos, rest;
+	size_t count = iov_iter_count(from);
+	size_t chunk, copied, done = 0;
 	ssize_t retval = -ENOMEM; /* our most likely error */
+	bool unzeroed;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
+	if (!count)
+		return 0;
 
 	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
+	item = ((long) iocb->ki_pos) / itemsize;
+	rest = ((long) iocb->ki_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
 	/* follow the list up to the right position */
 	dptr = scullv_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using virtual addresses */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+
+	/* then fill quantum by quantum, extending the list as we go */
+	while (done < count) {
+		if (s_pos == qset) {
+			dptr = scullv_follow(dptr, 1);
+			item++;
+			s_pos = 0;
+		}
+		if (!dptr->data) {
+			dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+			if (!dptr->data)
+				break;
+			memset(dptr->data, 0, qset * sizeof(char *));
+		}
+		/* Allocate a quantum using virtual addresses, or pages */
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		unzeroed = false;
+		if (!dptr->data[s_pos]) {
+			/* no need to zero a quantum about to be written whole */
+			unzeroed = chunk == quantum;
+			dptr->data[s_pos] = scullv_alloc_quantum(dev, !unzeroed,
+					numa_mem_id());
+			if (!dptr->data[s_pos])
+				break;
+			scull_evict_add(&dev->evict, (unsigned long)item * qset + s_pos);
+		} else {
+			scull_evict_touch(&dev->evict, (unsigned long)item * qset + s_pos);
+		}
+		copied = scullv_copy(dev, dptr->data[s_pos], q_pos, chunk, from, true);
+		done += copied;
+		if (copied < chunk) {
+			if (unzeroed) /* nobody sees it before we let go of the mutex */
+				scullv_zero(dev, dptr->data[s_pos], copied, quantum - copied);
+			retval = -EFAULT;
+			break;
+		}
+		s_pos++;
+		q_pos = 0;
 	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
+	/* running out of memory or faulting part way is a short write */
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	*f_pos += count;
  
     	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock(&dev->mutex);
-	return count;
+	if (dev->size < iocb->ki_pos)
+		dev->size = iocb->ki_pos;
+	return retval;
+}
+
+ssize_t scullv_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, to, scullv_do_read);
+}
+
+ssize_t scullv_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_rw(&dev->aio, iocb, from, scullv_do_write);
+}
+
+/*
+ * Reserving: give every missing quantum in the range its memory now,
+ * a window of SCULL_RESERVE_BATCH quanta at a time. A window's quanta
+ * are allocated in parallel, with the device locked, then put in their
+ * slots; the lock is let go between windows, so that I/O gets a look in.
+ * The workers run on other CPUs, so they are told the caller's node:
+ * that is where quanta go if they would have for a write.
+ */
+struct scullv_reserve_arg {
+	struct scullv_dev *dev;
+	int node;		/* numa_mem_id() of the caller */
+};
 
-  nomem:
-    mutex_unlock(&dev->mutex);
+static void *scullv_reserve_quantum(void *arg)
+{
+	struct scullv_reserve_arg *ra = arg;
+
+	return scullv_alloc_quantum(ra->dev, true, ra->node);
+}
+
+static int scullv_reserve(struct scullv_dev *dev, struct scull_reserve *r)
+{
+	struct scullv_reserve_arg ra = { .dev = dev, .node = numa_mem_id() };
+	struct scullv_dev *dptr;
+	u64 pos = r->offset, end = r->offset + r->length;
+	unsigned long *indices, index, last;
+	void **quanta, ***slots;
+	int i, n, shift, retval = 0;
+
+	quanta = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void *), GFP_KERNEL);
+	slots = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(void **), GFP_KERNEL);
+	indices = kmalloc_array(SCULL_RESERVE_BATCH, sizeof(long), GFP_KERNEL);
+	if (!quanta || !slots || !indices)
+		retval = -ENOMEM;
+
+	while (!retval && pos < end) {
+		if (signal_pending(current) || mutex_lock_interruptible(&dev->mutex)) {
+			retval = -ERESTARTSYS;
+			break;
+		}
+		/* the quantum may have changed since the last window */
+		shift = PAGE_SHIFT + dev->order;
+		index = pos >> shift;
+		last = min_t(u64, (end - 1) >> shift, index + SCULL_RESERVE_BATCH - 1);
+		for (n = 0, dptr = NULL; index <= last; index++) {
+			if (!dptr)
+				dptr = scullv_follow(dev, index / dev->qset);
+			else if (index % dev->qset == 0)
+				dptr = scullv_follow(dptr, 1);
+			if (!dptr->data) {
+				dptr->data = kcalloc(dev->qset, sizeof(void *), GFP_KERNEL);
+				if (!dptr->data) {
+					retval = -ENOMEM;
+					break;
+				}
+			}
+			if (!dptr->data[index % dev->qset]) {
+				slots[n] = dptr->data + index % dev->qset;
+				indices[n++] = index;
+			}
+		}
+		pos = (u64)index << shift;
+
+		if (scull_reserve_alloc(quanta, n, scullv_reserve_quantum, &ra))
+			retval = -ENOMEM;
+		for (i = 0; i < n; i++) {
+			if (!quanta[i])
+				continue;
+			*slots[i] = quanta[i];
+			scull_evict_add(&dev->evict, indices[i]);
+		}
+		mutex_unlock(&dev->mutex);
+	}
+	kfree(indices);
+	kfree(slots);
+	kfree(quanta);
 	return retval;
 }
 
@@ -270,6 +522,7 @@ long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
 	int err = 0, ret = 0, tmp;
+	struct scull_reserve r;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLV_IOC_MAGIC) return -ENOTTY;
@@ -349,6 +602,14 @@ long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullv_qset = arg;
 		return tmp;
 
+	case SCULLV_IOCRESERVE: /* arg points to the range */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		ret = scull_reserve_get(&r, (void __user *)arg);
+		if (ret == 0)
+			ret = scullv_reserve(filp->private_data, &r);
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -360,10 +621,46 @@ long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
  * The "extended" operations
  */
 
+/*
+ * SEEK_DATA and SEEK_HOLE: where the first quantum at or after "off"
+ * that is there ("data"), or missing, starts; the end of the device
+ * counts as a hole. Walks the list without extending it; called with
+ * the device mutex held.
+ */
+static loff_t scullv_seek_data(struct scullv_dev *dev, loff_t off, bool data)
+{
+	struct scullv_dev *dptr = dev;
+	long quantum = PAGE_SIZE << dev->order;
+	int qset = dev->qset;
+	unsigned long index, last, item;
+	int s_pos;
+
+	if (off < 0 || off >= dev->size)
+		return -ENXIO;
+	index = (long) off / quantum;
+	last = (dev->size - 1) / quantum;
+	item = index / qset;
+	s_pos = index % qset;
+	while (dptr && item--)
+		dptr = dptr->next;
+
+	for (; index <= last; index++, s_pos++) {
+		if (s_pos == qset) {
+			dptr = dptr ? dptr->next : NULL;
+			s_pos = 0;
+		}
+		if ((dptr && dptr->data && dptr->data[s_pos]) == data)
+			break;
+	}
+	if (index > last)
+		return data ? -ENXIO : dev->size;
+	return max_t(loff_t, off, (loff_t)index * quantum);
+}
+
 loff_t scullv_llseek (struct file *filp, loff_t off, int whence)
 {
 	struct scullv_dev *dev = filp->private_data;
-	long newpos;
+	loff_t newpos;
 
 	switch(whence) {
 	case 0: /* SEEK_SET */
@@ -378,6 +675,16 @@ loff_t scullv_llseek (struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		newpos = scullv_seek_data(dev, off, whence == SEEK_DATA);
+		mutex_unlock(&dev->mutex);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	default: /* can't happen */
 		return -EINVAL;
 	}
@@ -399,14 +706,12 @@ extern int scullv_mmap(struct file *filp, struct vm_area_struct *vma);
 struct file_operations scullv_fops = {
 	.owner =     THIS_MODULE,
 	.llseek =    scullv_llseek,
-	.read =	     scullv_read,
-	.write =     scullv_write,
 	.unlocked_ioctl = scullv_ioctl,
 	.mmap =	     scullv_mmap,
 	.open =	     scullv_open,
 	.release =   scullv_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.read_iter =  scullv_read_iter,
+	.write_iter = scullv_write_iter,
 };
 
 int scullv_trim(struct scullv_dev *dev)
@@ -423,7 +728,7 @@ int scullv_trim(struct scullv_dev *dev)
 			/* Release the quantum-set */
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
-					vfree(dptr->data[i]);
+					scullv_free_quantum(dev, dptr->data[i]);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
@@ -431,13 +736,36 @@ int scullv_trim(struct scullv_dev *dev)
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	scull_evict_reset(&dev->evict);
 	dev->size = 0;
 	dev->qset = scullv_qset;
 	dev->order = scullv_order;
+	dev->paged = READ_ONCE(scullv_paged);
 	dev->next = NULL;
 	return 0;
 }
 
+/*
+ * Evictable mode: free quantum "index" of the device, with the device
+ * mutex held, unless the device is mapped. The list is walked by hand,
+ * since scullv_follow() would extend it.
+ */
+static bool scullv_discard(struct scull_evict *e, unsigned long index)
+{
+	struct scullv_dev *dptr, *dev = container_of(e, struct scullv_dev, evict);
+	unsigned long item = index / dev->qset;
+
+	if (dev->vmas)
+		return false;
+	for (dptr = dev; dptr && item; item--)
+		dptr = dptr->next;
+	if (dptr && dptr->data && dptr->data[index % dev->qset]) {
+		scullv_free_quantum(dev, dptr->data[index % dev->qset]);
+		dptr->data[index % dev->qset] = NULL;
+	}
+	return true;
+}
+
 
 static void scullv_setup_cdev(struct scullv_dev *dev, int index)
 {
@@ -474,6 +802,13 @@ int scullv_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init();
+	if (result)
+		goto fail_malloc;
+	result = scull_evict_init();
+	if (result)
+		goto fail_malloc;
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -488,7 +823,11 @@ int scullv_init(void)
 	for (i = 0; i < scullv_devs; i++) {
 		scullv_devices[i].order = scullv_order;
 		scullv_devices[i].qset = scullv_qset;
+		scullv_devices[i].paged = scullv_paged;
 		mutex_init(&scullv_devices[i].mutex);
+		scull_async_queue_init(&scullv_devices[i].aio, &scullv_devices[i].mutex);
+		scull_evict_dev_init(&scullv_devices[i].evict, &scullv_devices[i].mutex,
+				scullv_discard);
 		scullv_setup_cdev(scullv_devices + i, i);
 	}
 
@@ -499,6 +838,8 @@ int scullv_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	scull_evict_cleanup();
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, scullv_devs);
 	return result;
 }
@@ -512,12 +853,17 @@ void scullv_cleanup(void)
 #ifdef SCULLV_USE_PROC
 	remove_proc_entry("scullvmem", NULL);
 #endif
+	/* no more reclaim: the shrinker mustn't see devices go */
+	scull_evict_cleanup();
 
 	for (i = 0; i < scullv_devs; i++) {
 		cdev_del(&scullv_devices[i].cdev);
 		scullv_trim(scullv_devices + i);
+		scull_evict_dev_release(&scullv_devices[i].evict);
+		scull_async_queue_release(&scullv_devices[i].aio);
 	}
 	kfree(scullv_devices);
+	scull_async_cleanup();
 	unregister_chrdev_region(MKDEV (scullv_major, 0), scullv_devs);
 }
 
@@ -51,11 +51,8 @@ void scullv_vma_close(struct vm_area_struct *vma)
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * Unlike scullp, any order will do: a vmalloc area is made of
+ * separate pages anyway, and so is a paged quantum.
  */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
 typedef int vm_fault_t;
@@ -66,8 +63,9 @@ static vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
 	unsigned long offset;
 	struct vm_area_struct *vma = vmf->vma;
 	struct scullv_dev *ptr, *dev = vma->vm_private_data;
+	unsigned long quantum, itemsize;
 	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
+	void *data = NULL; /* default to "missing" */
 	vm_fault_t retval = VM_FAULT_NOPAGE;
 
 	mutex_lock(&dev->mutex);
@@ -75,24 +73,24 @@ static vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
 	if (offset >= dev->size) goto out; /* out of range */
 
 	/*
-	 * Now retrieve the scullv device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
+	 * Now retrieve the scullv device from the list, then the quantum,
+	 * then the page within it. If the device has holes, the process
+	 * receives a SIGBUS when accessing the hole.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
+	quantum = PAGE_SIZE << dev->order;
+	itemsize = quantum * dev->qset;
+	for (ptr = dev; ptr && offset >= itemsize;) {
 		ptr = ptr->next;
-		offset -= dev->qset;
+		offset -= itemsize;
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
+	if (ptr && ptr->data) data = ptr->data[offset / quantum];
+	if (!data) goto out; /* hole or end-of-file */
 
 	/*
-	 * After scullv lookup, "page" is now the address of the page
-	 * needed by the current process. Since it's a vmalloc address,
-	 * turn it into a struct page.
+	 * A vmalloc address or an array of pages: either way, find the
+	 * struct page.
 	 */
-	page = vmalloc_to_page(pageptr);
+	page = scullv_quantum_page(dev, data, offset % quantum);
 
 	/* got it, now increment the count */
 	get_page(page);
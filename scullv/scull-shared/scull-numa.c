@@ -0,0 +1 @@
+../../scull-shared/scull-numa.c
\ No newline at end of file
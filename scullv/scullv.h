@@ -16,6 +16,10 @@
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
+#include "scull-shared/scull-async.h"
+#include "scull-shared/scull-numa.h"
+#include "scull-shared/scull-evict.h"
+#include "scull-shared/scull-reserve.h"
 
 /*
  * Macros to help debugging
@@ -49,6 +53,10 @@
  * pointer refers to a memory page.
  *
  * The array (quantum-set) is SCULLV_QSET long.
+ *
+ * In paged mode (scullv_paged) a quantum is not a vmalloc area but an
+ * array of 1 << order separate pages, copied to and from one by one:
+ * nothing is ever mapped into the vmalloc space.
  */
 #define SCULLV_ORDER    4 /* 16 pages at a time */
 #define SCULLV_QSET     500
@@ -59,8 +67,11 @@ struct scullv_dev {
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
+	bool paged;               /* quanta are page arrays */
 	size_t size;              /* 32-bit will suffice */
 	struct mutex mutex;     /* Mutual exclusion */
+	struct scull_async_queue aio; /* AIO waiting for the lock */
+	struct scull_evict evict; /* memory pressure may take quanta back */
 	struct cdev cdev;
 };
 
@@ -75,12 +86,14 @@ extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern bool scullv_paged;
 
 /*
  * Prototypes for shared functions
  */
 int scullv_trim(struct scullv_dev *dev);
 struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
+struct page *scullv_quantum_page(struct scullv_dev *dev, void *data, size_t offset);
 
 
 #ifdef SCULLV_DEBUG
@@ -117,7 +130,10 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
 #define SCULLV_IOCXQSET    _IOWR(SCULLV_IOC_MAGIC,11, int)
 #define SCULLV_IOCHQSET    _IO(SCULLV_IOC_MAGIC,  12)
 
-#define SCULLV_IOC_MAXNR 12
+/* Allocate a byte range ahead of time: see scull-shared/scull-reserve.h */
+#define SCULLV_IOCRESERVE  _IOW(SCULLV_IOC_MAGIC, 13, struct scull_reserve)
+
+#define SCULLV_IOC_MAXNR 13
 
 
 
@@ -0,0 +1,147 @@
+/*
+ * aesdadmit.c -- connection admission control for aesdsocket
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesdadmit.h"
+
+void aesd_admit_init(struct aesd_admit *admit, unsigned int max_conns,
+                     double rate, double burst)
+{
+    memset(admit, 0, sizeof(*admit));
+    admit->max_conns = max_conns;
+    admit->rate = rate;
+    /* Default to one second's worth, and always allow at least one */
+    admit->burst = burst > 0 ? burst : rate;
+    if (admit->burst < 1)
+        admit->burst = 1;
+    atomic_init(&admit->active, 0);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    /* Coarse is plenty for a rate limit and stays in the vDSO */
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Find the bucket for addr, or claim one for it. A bucket that has had
+ * time to refill completely is indistinguishable from a fresh one, so
+ * it can be handed to another address without changing anybody's
+ * limit; only when none of the probed slots qualifies is the stalest
+ * one evicted early.
+ */
+static struct aesd_bucket *aesd_admit_bucket(struct aesd_admit *admit, in_addr_t addr,
+                                             uint64_t now)
+{
+    unsigned int slot = ((uint32_t)addr * 0x9e3779b1u) >> (32 - AESDADMIT_TABLE_BITS);
+    struct aesd_bucket *reusable = NULL, *stalest = NULL, *b;
+    unsigned int i;
+
+    for (i = 0; i < AESDADMIT_PROBE; i++) {
+        b = &admit->buckets[(slot + i) & (AESDADMIT_TABLE_SIZE - 1)];
+        if (b->addr == addr)
+            return b;
+        if (!reusable && (b->addr == 0 ||
+                          b->tokens + (now - b->stamp_ns) * admit->rate / 1e9 >= admit->burst))
+            reusable = b;
+        if (!stalest || b->stamp_ns < stalest->stamp_ns)
+            stalest = b;
+    }
+
+    b = reusable ? reusable : stalest;
+    b->addr = addr;
+    b->tokens = admit->burst;
+    b->stamp_ns = now;
+    return b;
+}
+
+enum aesd_admit_verdict aesd_admit_check(struct aesd_admit *admit, struct in_addr addr)
+{
+    struct aesd_bucket *b;
+    uint64_t now;
+
+    /* The cap goes first so a full server doesn't spend anyone's tokens */
+    if (admit->max_conns && atomic_load(&admit->active) >= admit->max_conns) {
+        admit->refused_full++;
+        return AESD_ADMIT_FULL;
+    }
+
+    if (admit->rate > 0) {
+        now = now_ns();
+        b = aesd_admit_bucket(admit, addr.s_addr ? addr.s_addr : 1, now);
+        b->tokens += (now - b->stamp_ns) * admit->rate / 1e9;
+        if (b->tokens > admit->burst)
+            b->tokens = admit->burst;
+        b->stamp_ns = now;
+        if (b->tokens < 1) {
+            admit->refused_rate++;
+            return AESD_ADMIT_RATE;
+        }
+        b->tokens -= 1;
+    }
+
+    atomic_fetch_add(&admit->active, 1);
+    return AESD_ADMIT_OK;
+}
+
+void aesd_admit_release(struct aesd_admit *admit)
+{
+    atomic_fetch_sub(&admit->active, 1);
+}
+
+void aesd_admit_refuse(int fd)
+{
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+void aesd_budget_init(struct aesd_budget *budget, double rate, double burst)
+{
+    budget->rate = rate;
+    /* As for connections: one second's worth by default, never under one */
+    budget->burst = burst > 0 ? burst : rate;
+    if (budget->burst < 1)
+        budget->burst = 1;
+    budget->tokens = budget->burst;
+    budget->stamp_ns = now_ns();
+}
+
+unsigned long aesd_budget_take(struct aesd_budget *budget, unsigned long want,
+                               uint64_t *wait_ns)
+{
+    uint64_t now;
+    unsigned long granted;
+
+    if (budget->rate <= 0)
+        return want;
+    now = now_ns();
+    budget->tokens += (now - budget->stamp_ns) * budget->rate / 1e9;
+    if (budget->tokens > budget->burst)
+        budget->tokens = budget->burst;
+    budget->stamp_ns = now;
+
+    granted = budget->tokens < want ? (unsigned long)budget->tokens : want;
+    budget->tokens -= granted;
+    if (granted == 0)
+        *wait_ns = (uint64_t)((1 - budget->tokens) * 1e9 / budget->rate) + 1;
+    return granted;
+}
+
+size_t aesd_budget_span(const char *buf, size_t len, unsigned long n)
+{
+    const char *p = buf, *end = buf + len, *newline;
+
+    while (n-- > 0 && (newline = memchr(p, '\n', end - p)) != NULL)
+        p = newline + 1;
+    return p - buf;
+}
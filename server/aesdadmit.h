@@ -0,0 +1,79 @@
+/*
+ * aesdadmit.h -- connection admission control for aesdsocket
+ *
+ * Decides on every accept() whether a client gets served: a global cap
+ * on concurrent connections and a token bucket per source address.
+ * Refused clients are reset straight away, before any thread or
+ * per-connection state exists. Checks run only on the accepting thread;
+ * the connection count is the one field workers touch.
+ *
+ * Once in, a connection may also have a record budget: a token bucket
+ * of its own, owned by whoever serves the connection, that paces how
+ * many records a second it gets stored and echoed. A client over it is
+ * slowed down, not dropped.
+ */
+
+#ifndef AESDADMIT_H
+#define AESDADMIT_H
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESDADMIT_MAX_CONNS     1024
+#define AESDADMIT_MAX_RECORD    (1024 * 1024)
+#define AESDADMIT_TABLE_BITS    12
+#define AESDADMIT_TABLE_SIZE    (1 << AESDADMIT_TABLE_BITS)    /* per-address buckets */
+#define AESDADMIT_PROBE         8       /* slots searched before evicting */
+
+enum aesd_admit_verdict {
+    AESD_ADMIT_OK,
+    AESD_ADMIT_FULL,        /* at the connection cap */
+    AESD_ADMIT_RATE,        /* source address out of tokens */
+};
+
+struct aesd_bucket {
+    in_addr_t addr;         /* 0: slot unused */
+    double tokens;
+    uint64_t stamp_ns;      /* last refill */
+};
+
+struct aesd_admit {
+    unsigned int max_conns;         /* 0: no cap */
+    double rate, burst;             /* connections/s per address; rate 0: no limit */
+    atomic_uint active;
+    unsigned long refused_full;     /* accepting thread only */
+    unsigned long refused_rate;
+    struct aesd_bucket buckets[AESDADMIT_TABLE_SIZE];
+};
+
+void aesd_admit_init(struct aesd_admit *admit, unsigned int max_conns,
+                     double rate, double burst);
+
+/* Check a new client; on AESD_ADMIT_OK it holds a slot until released */
+enum aesd_admit_verdict aesd_admit_check(struct aesd_admit *admit, struct in_addr addr);
+void aesd_admit_release(struct aesd_admit *admit);
+
+/* Close a refused client with a reset, leaving no TIME_WAIT behind */
+void aesd_admit_refuse(int fd);
+
+struct aesd_budget {
+    double rate, burst;     /* records/s; rate 0: no limit */
+    double tokens;
+    uint64_t stamp_ns;      /* last refill */
+};
+
+void aesd_budget_init(struct aesd_budget *budget, double rate, double burst);
+
+/*
+ * Take up to "want" records' worth of budget and return how many were
+ * granted. When that is 0, *wait_ns is how long until one can be.
+ */
+unsigned long aesd_budget_take(struct aesd_budget *budget, unsigned long want,
+                               uint64_t *wait_ns);
+
+/* Bytes of buf[0..len) making up its first n newline-terminated records */
+size_t aesd_budget_span(const char *buf, size_t len, unsigned long n);
+
+#endif /* AESDADMIT_H */
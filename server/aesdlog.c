@@ -0,0 +1,287 @@
+/*
+ * aesdlog.c -- memory-mapped, segmented append log for aesdsocket
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesdlog.h"
+
+static void aesdlog_segment_path(struct aesdlog *log, unsigned int index, char *path, size_t size)
+{
+    snprintf(path, size, "%s.%u", log->path, index);
+}
+
+/* Create, preallocate and map the next segment; called with segment_lock held */
+static int aesdlog_add_segment(struct aesdlog *log)
+{
+    char path[PATH_MAX];
+    unsigned int index = log->nr_segments;
+    char *base;
+    int fd, err;
+
+    if (index >= AESDLOG_MAX_SEGMENTS)
+        return -ENOSPC;
+
+    aesdlog_segment_path(log, index, path, sizeof(path));
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -errno;
+    /* Reserve the blocks now so page faults on the mapping never allocate */
+    err = posix_fallocate(fd, 0, log->segment_size);
+    if (err) {
+        close(fd);
+        unlink(path);
+        return -err;
+    }
+    base = mmap(NULL, log->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        unlink(path);
+        return -errno;
+    }
+
+    atomic_store_explicit(&log->segments[index], base, memory_order_release);
+    log->nr_segments++;
+    return 0;
+}
+
+/* Return the mapping of segment "index", rolling the log forward if need be */
+static char *aesdlog_segment(struct aesdlog *log, unsigned int index)
+{
+    char *base = atomic_load_explicit(&log->segments[index], memory_order_acquire);
+
+    /*
+     * Keep one segment mapped ahead, so a writer rolling into the next
+     * segment normally finds it ready. Mapping one preallocates it under
+     * segment_lock, which takes a while: writers that already have their
+     * segment don't wait for it, only one that needs the missing segment
+     * itself does (after a burst that outruns the mapping ahead).
+     */
+    if (base) {
+        if (index + 1 >= AESDLOG_MAX_SEGMENTS ||
+            atomic_load_explicit(&log->segments[index + 1], memory_order_acquire))
+            return base;
+        if (pthread_mutex_trylock(&log->segment_lock))
+            return base; /* someone is mapping it already */
+    } else {
+        pthread_mutex_lock(&log->segment_lock);
+    }
+    while (log->nr_segments <= index + 1 && log->nr_segments < AESDLOG_MAX_SEGMENTS)
+        if (aesdlog_add_segment(log))
+            break;
+    pthread_mutex_unlock(&log->segment_lock);
+
+    return atomic_load_explicit(&log->segments[index], memory_order_acquire);
+}
+
+/* msync the range [start, end) of the log, one segment at a time */
+static int aesdlog_msync(struct aesdlog *log, uint64_t start, uint64_t end)
+{
+    uintptr_t page_mask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    int ret = 0;
+
+    while (start < end) {
+        unsigned int index = start / log->segment_size;
+        size_t seg_off = start % log->segment_size;
+        size_t chunk = log->segment_size - seg_off;
+        char *base = atomic_load_explicit(&log->segments[index], memory_order_acquire);
+        uintptr_t from, to;
+
+        if (chunk > end - start)
+            chunk = end - start;
+        if (base) {
+            from = (uintptr_t)(base + seg_off) & page_mask;
+            to = (uintptr_t)(base + seg_off + chunk);
+            if (msync((void *)from, to - from, MS_SYNC))
+                ret = -errno;
+        }
+        start += chunk;
+    }
+    return ret;
+}
+
+static void *aesdlog_sync_thread(void *arg)
+{
+    struct aesdlog *log = arg;
+    uint64_t synced = 0;
+
+    pthread_mutex_lock(&log->segment_lock);
+    while (!log->stopping) {
+        struct timespec deadline;
+        uint64_t committed;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += log->interval_ms / 1000;
+        deadline.tv_nsec += (log->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&log->sync_cond, &log->segment_lock, &deadline);
+
+        committed = atomic_load_explicit(&log->committed, memory_order_acquire);
+        if (committed == synced)
+            continue;
+        pthread_mutex_unlock(&log->segment_lock);
+        aesdlog_msync(log, synced, committed);
+        synced = committed;
+        pthread_mutex_lock(&log->segment_lock);
+    }
+    pthread_mutex_unlock(&log->segment_lock);
+    return NULL;
+}
+
+int aesdlog_open(struct aesdlog *log, const char *path, size_t segment_size,
+                 enum aesdlog_sync sync, unsigned int interval_ms)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    int ret;
+
+    /* Keep segments page-aligned so msync ranges line up */
+    segment_size = (segment_size + page_size - 1) & ~(size_t)(page_size - 1);
+    if (segment_size == 0)
+        return -EINVAL;
+
+    memset(log, 0, sizeof(*log));
+    log->path = path;
+    log->segment_size = segment_size;
+    log->sync = sync;
+    log->interval_ms = interval_ms ? interval_ms : AESDLOG_SYNC_INTERVAL_MS;
+    atomic_init(&log->tail, 0);
+    atomic_init(&log->committed, 0);
+    pthread_mutex_init(&log->segment_lock, NULL);
+    pthread_cond_init(&log->sync_cond, NULL);
+
+    pthread_mutex_lock(&log->segment_lock);
+    ret = aesdlog_add_segment(log);
+    pthread_mutex_unlock(&log->segment_lock);
+    if (ret)
+        goto fail;
+
+    if (sync == AESDLOG_SYNC_INTERVAL) {
+        ret = -pthread_create(&log->sync_thread, NULL, aesdlog_sync_thread, log);
+        if (ret)
+            goto fail;
+    }
+    return 0;
+
+fail:
+    aesdlog_close(log);
+    return ret;
+}
+
+/* Stop the sync thread, unmap every segment and remove the files */
+void aesdlog_close(struct aesdlog *log)
+{
+    char path[PATH_MAX];
+    unsigned int i;
+
+    if (log->sync == AESDLOG_SYNC_INTERVAL && log->sync_thread) {
+        pthread_mutex_lock(&log->segment_lock);
+        log->stopping = true;
+        pthread_cond_signal(&log->sync_cond);
+        pthread_mutex_unlock(&log->segment_lock);
+        pthread_join(log->sync_thread, NULL);
+        log->sync_thread = 0;
+    }
+
+    for (i = 0; i < log->nr_segments; i++) {
+        munmap(log->segments[i], log->segment_size);
+        log->segments[i] = NULL;
+        aesdlog_segment_path(log, i, path, sizeof(path));
+        unlink(path);
+    }
+    log->nr_segments = 0;
+    pthread_cond_destroy(&log->sync_cond);
+    pthread_mutex_destroy(&log->segment_lock);
+}
+
+/* Map every segment [start, end) touches, so a reserved slice always has a home */
+static int aesdlog_prepare(struct aesdlog *log, uint64_t start, uint64_t end)
+{
+    uint64_t off;
+
+    for (off = start; off < end; off += log->segment_size - off % log->segment_size)
+        if (!aesdlog_segment(log, off / log->segment_size))
+            return -ENOMEM;
+    return 0;
+}
+
+int aesdlog_append(struct aesdlog *log, const char *buf, size_t len)
+{
+    uint64_t capacity = (uint64_t)log->segment_size * AESDLOG_MAX_SEGMENTS;
+    uint64_t start, end, off;
+    int ret = 0;
+
+    /*
+     * Reserve our slice; a CAS rather than a plain add so a full log is
+     * never overshot. The segments it lands in are mapped first: once
+     * reserved the slice must be published, and a published slice with
+     * no segment behind it would fail every later history read.
+     */
+    start = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    do {
+        if (start + len > capacity)
+            return -ENOSPC;
+        ret = aesdlog_prepare(log, start, start + len);
+        if (ret)
+            return ret;
+    } while (!atomic_compare_exchange_weak_explicit(&log->tail, &start, start + len,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    end = start + len;
+
+    /* Segments are never unmapped while the log is open */
+    for (off = start; off < end; ) {
+        unsigned int index = off / log->segment_size;
+        size_t seg_off = off % log->segment_size;
+        size_t chunk = log->segment_size - seg_off;
+        char *base = atomic_load_explicit(&log->segments[index], memory_order_acquire);
+
+        if (chunk > end - off)
+            chunk = end - off;
+        memcpy(base + seg_off, buf + (off - start), chunk);
+        off += chunk;
+    }
+
+    /* Publish in reservation order so readers never see a hole */
+    while (atomic_load_explicit(&log->committed, memory_order_acquire) != start)
+        sched_yield();
+    atomic_store_explicit(&log->committed, end, memory_order_release);
+
+    if (!ret && log->sync == AESDLOG_SYNC_BATCH)
+        ret = aesdlog_msync(log, start, end);
+    return ret;
+}
+
+uint64_t aesdlog_size(struct aesdlog *log)
+{
+    return atomic_load_explicit(&log->committed, memory_order_acquire);
+}
+
+const char *aesdlog_peek(struct aesdlog *log, uint64_t off, uint64_t end, size_t *len)
+{
+    unsigned int index = off / log->segment_size;
+    size_t seg_off = off % log->segment_size;
+    size_t chunk = log->segment_size - seg_off;
+    char *base;
+
+    if (off >= end || index >= AESDLOG_MAX_SEGMENTS)
+        return NULL;
+    base = atomic_load_explicit(&log->segments[index], memory_order_acquire);
+    if (!base)
+        return NULL;
+    if (chunk > end - off)
+        chunk = end - off;
+    *len = chunk;
+    return base + seg_off;
+}
@@ -0,0 +1,57 @@
+/*
+ * aesdlog.h -- memory-mapped, segmented append log for aesdsocket
+ *
+ * The log is a sequence of preallocated segment files (path.0, path.1,
+ * ...) mapped shared into memory. Writers reserve their slice of the log
+ * with an atomic add on the tail and copy into the mapping without any
+ * global lock; slices are then published in reservation order so readers
+ * only ever see a gap-free prefix. The segment lock is only taken when
+ * the log rolls over into a new segment.
+ */
+
+#ifndef AESDLOG_H
+#define AESDLOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESDLOG_MAX_SEGMENTS     1024
+#define AESDLOG_SEGMENT_SIZE     (16 * 1024 * 1024)
+#define AESDLOG_SYNC_INTERVAL_MS 1000
+
+enum aesdlog_sync {
+    AESDLOG_SYNC_NONE,      /* leave write-back to the kernel */
+    AESDLOG_SYNC_BATCH,     /* msync each appended batch before returning */
+    AESDLOG_SYNC_INTERVAL,  /* msync everything new from a background thread */
+};
+
+struct aesdlog {
+    const char *path;               /* segment files are path.0, path.1, ... */
+    size_t segment_size;
+    enum aesdlog_sync sync;
+    unsigned int interval_ms;
+    _Atomic uint64_t tail;          /* next offset to hand out */
+    _Atomic uint64_t committed;     /* everything below this is written */
+    char *_Atomic segments[AESDLOG_MAX_SEGMENTS];
+    unsigned int nr_segments;       /* protected by segment_lock */
+    pthread_mutex_t segment_lock;   /* only taken to roll into a new segment */
+    pthread_t sync_thread;          /* AESDLOG_SYNC_INTERVAL only */
+    pthread_cond_t sync_cond;
+    bool stopping;                  /* protected by segment_lock */
+};
+
+int aesdlog_open(struct aesdlog *log, const char *path, size_t segment_size,
+                 enum aesdlog_sync sync, unsigned int interval_ms);
+void aesdlog_close(struct aesdlog *log);
+
+int aesdlog_append(struct aesdlog *log, const char *buf, size_t len);
+
+/* Number of bytes readers may see right now */
+uint64_t aesdlog_size(struct aesdlog *log);
+/* Contiguous mapped bytes at off, at most up to end; NULL on error */
+const char *aesdlog_peek(struct aesdlog *log, uint64_t off, uint64_t end, size_t *len);
+
+#endif /* AESDLOG_H */
@@ -0,0 +1,163 @@
+/*
+ * aesdsocket-bench.c -- throughput benchmark for aesdsocket
+ *
+ * Opens a number of connections one after the other and sends a batch
+ * of newline-delimited records on each, then reports records/s and the
+ * mean time per connection.
+ *
+ * Against a server started with "-p -a" every record is acknowledged
+ * by its own echo, so the client pipelines the whole batch and counts
+ * newlines coming back. With "-e" the client instead sends its records
+ * and reads until the server closes, which is how the classic
+ * one-record-per-connection server behaves.
+ *
+ *   aesdsocket-bench [-H host] [-P port] [-c connections] [-n records] [-s size] [-e]
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE 4096
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run one connection: send "records" copies of "record" and wait for the
+ * replies. Sending and receiving are interleaved with poll() so a long
+ * pipeline can't deadlock on full socket buffers.
+ */
+static int run_connection(struct sockaddr_in *addr, const char *record, size_t record_len,
+                          int records, bool until_eof)
+{
+    char buffer[BUFFER_SIZE];
+    size_t to_send = record_len * records, sent_total = 0;
+    int acked = 0, enabled = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    /* Don't let Nagle hold back the small records of a pipeline */
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+    if (connect(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+
+    while (until_eof || acked < records) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (sent_total < to_send)
+            pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, 5000) <= 0) {
+            fprintf(stderr, "timed out waiting for the server\n");
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            size_t off = sent_total % record_len;
+            ssize_t n = send(sock, record + off, record_len - off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("send");
+                break;
+            }
+            if (n > 0)
+                sent_total += n;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n <= 0)
+                break;
+            if (!until_eof) {
+                ssize_t i;
+                for (i = 0; i < n; i++)
+                    if (buffer[i] == '\n')
+                        acked++;
+            }
+        }
+    }
+    close(sock);
+
+    if (sent_total < to_send || (!until_eof && acked < records))
+        return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    int port = 9000, connections = 100, records = 1, opt, i;
+    size_t record_len = 64;
+    bool until_eof = false;
+    struct sockaddr_in addr;
+    char *record;
+    double start, elapsed;
+
+    while ((opt = getopt(argc, argv, "H:P:c:n:s:e")) != -1) {
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'n': records = atoi(optarg); break;
+        case 's': record_len = strtoul(optarg, NULL, 0); break;
+        case 'e': until_eof = true; break;
+        default:
+            fprintf(stderr, "Usage: %s [-H host] [-P port] [-c connections] "
+                    "[-n records] [-s size] [-e]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (connections < 1 || records < 1 || record_len < 2) {
+        fprintf(stderr, "connections and records must be positive, size at least 2\n");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        return 1;
+    }
+
+    record = malloc(record_len);
+    if (!record)
+        return 1;
+    memset(record, 'x', record_len - 1);
+    record[record_len - 1] = '\n';
+
+    start = now();
+    for (i = 0; i < connections; i++) {
+        if (run_connection(&addr, record, record_len, records, until_eof)) {
+            fprintf(stderr, "connection %d failed\n", i);
+            free(record);
+            return 1;
+        }
+    }
+    elapsed = now() - start;
+
+    printf("%d connections x %d records of %zu bytes: %.3f s, %.0f records/s, %.1f us/connection\n",
+           connections, records, record_len, elapsed,
+           (double)connections * records / elapsed, elapsed * 1e6 / connections);
+    free(record);
+    return 0;
+}
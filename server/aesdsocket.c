@@ -1,8 +1,11 @@
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,13 +26,21 @@
 #define _POSIX_C_SOURCE 200809L
 #define SOCKET_PORT 9000
 #define BUFFER_SIZE 1024
+#define DRAIN_TIMEOUT_MS 2000   /* default time in-flight connections get on shutdown */
 
-#ifdef USE_AESD_CHAR_DEVICE
+#if USE_AESD_CHAR_DEVICE
 #define FILE_PATH "/dev/aesdchar"
 #else
+#include "aesdlog.h"
 #define FILE_PATH "/var/tmp/aesdsocketdata"
 #endif
 
+#ifndef USE_IO_URING
+#define USE_IO_URING 0
+#endif
+#include "aesdadmit.h"
+#include "aesduring.h"
+
 static const char *pidfile = "/var/run/aesdsocket.pid";
 
 static void write_pidfile(void) {
@@ -44,6 +55,12 @@ struct thread_data{
     char *file_path;
     int sock_client;
     pthread_mutex_t *mutex;
+    bool persistent;    /* keep the connection open across records */
+    bool ack_only;      /* reply with the records instead of the full history */
+    atomic_bool idle;   /* blocked in recv() with no partial record held */
+    atomic_bool finished;   /* socket closed, ready to join */
+    atomic_bool cut_off;    /* input ended by a drain shutdown, not the client */
+    struct aesd_budget budget;  /* records/s this connection may have handled */
 };
 
 // Structure for linked list node to track threads
@@ -55,6 +72,24 @@ SLIST_HEAD(node_head, thread_node);
 
 static volatile bool is_terminated = false;
 
+/* Connection mode selected on the command line */
+static bool opt_persistent = false;
+static bool opt_ack_only = false;
+static bool opt_threads = false;    /* -T: skip io_uring even if built in */
+static unsigned int opt_drain_ms = DRAIN_TIMEOUT_MS;
+
+/* Admission limits: -c connections, -r per-address rate[:burst], -m record bytes */
+static struct aesd_admit admit;
+static unsigned int opt_max_conns = AESDADMIT_MAX_CONNS;
+static double opt_rate, opt_burst;
+static size_t opt_max_record = AESDADMIT_MAX_RECORD;
+/* -R: records/s per connection[:burst] */
+static double opt_record_rate, opt_record_burst;
+
+/* Records handled and data-path syscalls issued, for the exit report */
+static struct aesd_stats stats;
+#define COUNT_SYSCALLS(n) atomic_fetch_add_explicit(&stats.syscalls, (n), memory_order_relaxed)
+
 static void handle_signal(int signal)
 {
     is_terminated = true;
@@ -62,73 +97,307 @@ static void handle_signal(int signal)
 
 static pthread_mutex_t mutex;
 
+#if !USE_AESD_CHAR_DEVICE
+/* Non-device mode keeps the data in an mmap'd log instead of a stdio file */
+static struct aesdlog data_log;
+static size_t opt_segment_size = AESDLOG_SEGMENT_SIZE;
+static enum aesdlog_sync opt_sync = AESDLOG_SYNC_NONE;
+static unsigned int opt_sync_interval_ms;
+#endif
+
+/* Send the whole buffer, retrying on short writes and EINTR */
+static int send_all(int socket_client, const char *buf, size_t len)
+{
+    size_t send_bytes = 0;
+
+    while (send_bytes < len) {
+        ssize_t sent = send(socket_client, buf + send_bytes, len - send_bytes, MSG_NOSIGNAL);
+        COUNT_SYSCALLS(1);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue; // Retry sending if interrupted
+            }
+            printf("Failed to send data to client\n");
+            return -1;
+        }
+        send_bytes += sent;
+    }
+    return 0;
+}
+
+/* Send the full content of the file back to the client */
+static int send_history(int socket_client, FILE *file)
+{
+#if USE_AESD_CHAR_DEVICE
+    char buffer[BUFFER_SIZE];
+
+    /* Reset file pointer to the beginning */
+    fseek(file, 0, SEEK_SET);
+    COUNT_SYSCALLS(1);
+    /* Not cut short on shutdown: the drain deadline bounds this instead */
+    while(1) {
+        size_t nread = fread(buffer, 1, sizeof(buffer), file);
+        COUNT_SYSCALLS(1);
+        if (nread > 0 && send_all(socket_client, buffer, nread))
+            return -1;
+        if (nread < sizeof(buffer)) {
+            if (feof(file)) {
+                break; // End of file
+            } else if (ferror(file)) {
+                printf("Failed to read from file\n");
+                return -1;
+            }
+        }
+    }
+#else
+    /* Stream straight out of the log segments, no bounce buffer */
+    uint64_t off = 0, end = aesdlog_size(&data_log);
+
+    while (off < end) {
+        size_t len;
+        const char *chunk = aesdlog_peek(&data_log, off, end, &len);
+        if (chunk == NULL) {
+            printf("Failed to read from log\n");
+            return -1;
+        }
+        if (send_all(socket_client, chunk, len))
+            return -1;
+        off += len;
+    }
+#endif
+    return 0;
+}
+
+/* Append complete records to the file under the shared mutex */
+static int append_records(struct thread_data *data, FILE *file, const char *buf, size_t len)
+{
+#if USE_AESD_CHAR_DEVICE
+    int ret = 0;
+
+    if (pthread_mutex_lock(data->mutex))
+        return -1;
+    /* a+ streams need a positioning call between a read and a write */
+    fseek(file, 0, SEEK_END);
+    if (fwrite(buf, 1, len, file) != len || fflush(file))
+        ret = -1;
+    COUNT_SYSCALLS(2); /* lseek + write */
+    if (pthread_mutex_unlock(data->mutex))
+        ret = -1;
+    return ret;
+#else
+    /* The log orders concurrent appends itself; no mutex needed */
+    return aesdlog_append(&data_log, buf, len) ? -1 : 0;
+#endif
+}
+
+/*
+ * Handle the complete records in buf[0..len), which ends in '\n' unless a
+ * single-shot client closed without one.
+ * In ack mode the whole batch is appended at once and echoed back in a
+ * single send; otherwise each record is appended and followed by the
+ * full history, as a client sending one record per connection expects.
+ */
+static int handle_records(struct thread_data *data, FILE *file, const char *buf, size_t len)
+{
+    const char *record = buf;
+    const char *end = buf + len;
+    unsigned long records = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (buf[i] == '\n')
+            records++;
+    atomic_fetch_add_explicit(&stats.records, records ? records : 1, memory_order_relaxed);
+
+    if (data->ack_only) {
+        if (append_records(data, file, buf, len))
+            return -1;
+        return send_all(data->sock_client, buf, len);
+    }
+
+    /* A single-shot connection treats everything it received as one record */
+    if (!data->persistent) {
+        if (append_records(data, file, buf, len))
+            return -1;
+        return send_history(data->sock_client, file);
+    }
+
+    while (record < end) {
+        const char *newline = memchr(record, '\n', end - record);
+        size_t record_len = newline - record + 1;
+
+        if (append_records(data, file, record, record_len))
+            return -1;
+        if (send_history(data->sock_client, file))
+            return -1;
+        record += record_len;
+    }
+    return 0;
+}
+
+/* Wait out a spent record budget; fails if the drain cuts us off meanwhile */
+static int wait_budget(struct thread_data *data, uint64_t wait_ns)
+{
+    const uint64_t slice_ns = 10 * 1000000ULL;
+
+    atomic_fetch_add_explicit(&stats.throttled, 1, memory_order_relaxed);
+    while (wait_ns > 0) {
+        uint64_t ns = wait_ns < slice_ns ? wait_ns : slice_ns;
+        struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+        if (atomic_load(&data->cut_off))
+            return -1;
+        nanosleep(&ts, NULL);
+        wait_ns -= ns;
+    }
+    return 0;
+}
+
+/*
+ * Handle records within the connection's budget, as many at a time as
+ * it allows. Waiting here stops us reading the socket, so a client over
+ * its budget is held back by TCP flow control. A single-shot request is
+ * one record whatever it holds.
+ */
+static int process_records(struct thread_data *data, FILE *file, const char *buf, size_t len)
+{
+    if (data->budget.rate <= 0)
+        return handle_records(data, file, buf, len);
+    while (len > 0) {
+        unsigned long want = 1, granted;
+        uint64_t wait_ns = 0;
+        size_t chunk = len;
+        size_t i;
+
+        if (data->persistent)
+            for (i = 0, want = 0; i < len; i++)
+                if (buf[i] == '\n')
+                    want++;
+        if (want == 0)
+            want = 1;
+        granted = aesd_budget_take(&data->budget, want, &wait_ns);
+        if (granted == 0) {
+            if (wait_budget(data, wait_ns))
+                return -1;
+            continue;
+        }
+        if (granted < want)
+            chunk = aesd_budget_span(buf, len, granted);
+        if (handle_records(data, file, buf, chunk))
+            return -1;
+        buf += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
 void * thread_func(void* thread_param) {
     struct thread_data *data = (struct thread_data *)thread_param;
     FILE *file = NULL;
     int socket_client = data->sock_client;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
+    char *buffer = NULL;
+    size_t buffer_len = 0;      /* bytes held, including any partial record */
+    size_t buffer_size = 0;
+    ssize_t bytes_received = -1;
 
+#if USE_AESD_CHAR_DEVICE
     /* Open a file to store the received data */
     file = fopen(FILE_PATH, "a+");
+    COUNT_SYSCALLS(1);
     if (file == NULL) {
         printf("Failed to open file\n");
-        return NULL;
-    }
-
-    // Obtain the mutex
-    if ( pthread_mutex_lock(data->mutex) ) {
-        if (file) fclose(file);
-        return NULL;
+        goto out;
     }
+#endif
 
-    /* Receive data from the client and write to the file */
-    while ((bytes_received = recv(socket_client, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, file);
-        /* Check for newline character to end reception */
-        if (buffer[bytes_received - 1] == '\n') {
-            break;
+    /*
+     * Receive data from the client and split it into newline-delimited
+     * records. A record may span any number of recv() calls, and a single
+     * recv() may carry many records; the partial tail is carried over.
+     * Once shutdown starts no new record is begun, but one already
+     * arriving is finished if it makes it before the drain deadline.
+     */
+    while (!is_terminated || buffer_len > 0) {
+        if (buffer_size - buffer_len < BUFFER_SIZE) {
+            size_t new_size = buffer_size ? buffer_size * 2 : BUFFER_SIZE;
+            char *new_buffer = realloc(buffer, new_size);
+            if (new_buffer == NULL) {
+                printf("Failed to allocate receive buffer\n");
+                goto out;
+            }
+            buffer = new_buffer;
+            buffer_size = new_size;
         }
-    }
-
-    fflush(file);
-    if (pthread_mutex_unlock(data->mutex)) { fclose(file); return NULL; }
 
-    /* Send the full content of the file back to the client */
-    size_t send_bytes;
+        /* Between records a drain may shut the socket down under us */
+        atomic_store(&data->idle, buffer_len == 0);
+        /*
+         * Never read past the record size cap: everything held before the
+         * read is one partial record, so a full buffer means it's too long.
+         */
+        size_t room = buffer_size - buffer_len;
+        if (opt_max_record && room > opt_max_record - buffer_len)
+            room = opt_max_record - buffer_len;
+        if (room == 0) {
+            atomic_fetch_add_explicit(&stats.oversized, 1, memory_order_relaxed);
+            syslog(LOG_WARNING, "Record over %zu bytes, closing connection", opt_max_record);
+            goto out;
+        }
 
-    /* Reset file pointer to the beginning */
-    fseek(file, 0, SEEK_SET);
-    while(!is_terminated) {
-        size_t nread = fread(buffer, 1, sizeof(buffer), file);
-        if (nread > 0) {
-            send_bytes = 0;
-            while (send_bytes < nread) {
-                ssize_t sent = send(socket_client, buffer + send_bytes, nread - send_bytes, MSG_NOSIGNAL);
-                if (sent < 0) {
-                    if (errno == EINTR) {
-                        continue; // Retry sending if interrupted
-                    }
-                    printf("Failed to send data to client\n");
-                    return NULL;
+        bytes_received = recv(socket_client, buffer + buffer_len, room, 0);
+        atomic_store(&data->idle, false);
+        COUNT_SYSCALLS(1);
+        if (bytes_received < 0 && errno == EINTR)
+            continue;
+        if (bytes_received <= 0)
+            break;
+        buffer_len += bytes_received;
+
+        /* Find how much of the buffer is made of complete records */
+        size_t complete = 0;
+        if (data->persistent) {
+            size_t i;
+            for (i = buffer_len; i > buffer_len - bytes_received; i--) {
+                if (buffer[i - 1] == '\n') {
+                    complete = i;
+                    break;
                 }
-                send_bytes += sent;
-            }
-        }
-        if (nread < sizeof(buffer)) {
-            if (feof(file)) {
-                break; // End of file
-            } else if (ferror(file)) {
-                printf("Failed to read from file\n");
-                return NULL;
             }
+        } else if (buffer[buffer_len - 1] == '\n') {
+            /* Check for newline character to end reception */
+            complete = buffer_len;
         }
+        if (complete == 0)
+            continue;
+
+        if (process_records(data, file, buffer, complete))
+            goto out;
+        memmove(buffer, buffer + complete, buffer_len - complete);
+        buffer_len -= complete;
+
+        if (!data->persistent)
+            break;
     }
 
-    if (file) fclose(file);
-    if (socket_client >= 0) close(socket_client);
+    /*
+     * A single-shot client that closed without a final newline still gets
+     * its echo, but a recv() ended by a drain shutdown isn't the client
+     * closing: what it holds is a truncated record, so drop it.
+     */
+    if (!data->persistent && bytes_received == 0 && buffer_len > 0 &&
+        !atomic_load(&data->cut_off)) {
+        if (process_records(data, file, buffer, buffer_len))
+            goto out;
+    }
 
     data->thread_complete_success = true;
+out:
+    free(buffer);
+    if (file) fclose(file);
+    if (socket_client >= 0) close(socket_client);
+    COUNT_SYSCALLS(file ? 2 : 1);
+    aesd_admit_release(&admit);
+    atomic_store(&data->finished, true);
     return NULL;
 }
 
@@ -173,6 +442,108 @@ static int install_handlers(void) {
 //     printf("%s", buffer);
 // }
 
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Bring the worker threads to an end in bounded time. Workers idle between
+ * records get their socket shut down for reading right away, so recv()
+ * returns 0 and they exit. The rest get until the drain deadline to finish
+ * the record they're on; whatever is still running then is cut off with
+ * SHUT_RDWR, which fails any blocked send() and makes a blocked recv()
+ * return 0. cut_off is set before every shutdown we issue, so the worker
+ * knows that end of input came from us: "idle" is only a hint, and a
+ * partial record may already be queued behind it.
+ *
+ * A worker sets "finished" only after closing its socket, so we may shut
+ * down an fd number that was just closed. New fds can't be sockets at this
+ * point (the listener is closed), so that fails harmlessly with ENOTSOCK.
+ */
+static void drain_threads(struct node_head *head)
+{
+    struct timespec start;
+    struct thread_node *node;
+    const struct timespec tick = { 0, 10 * 1000000L };
+    bool pending;
+
+    if (SLIST_EMPTY(head))
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    SLIST_FOREACH(node, head, links) {
+        if (atomic_load(&node->data->finished))
+            continue;
+        stats.drained++;
+        if (atomic_load(&node->data->idle)) {
+            atomic_store(&node->data->cut_off, true);
+            shutdown(node->data->sock_client, SHUT_RD);
+        }
+    }
+
+    for (;;) {
+        pending = false;
+        SLIST_FOREACH(node, head, links)
+            if (!atomic_load(&node->data->finished))
+                pending = true;
+        if (!pending || elapsed_ms(&start) >= opt_drain_ms)
+            break;
+        nanosleep(&tick, NULL);
+    }
+
+    SLIST_FOREACH(node, head, links) {
+        if (!atomic_load(&node->data->finished)) {
+            atomic_store(&node->data->cut_off, true);
+            shutdown(node->data->sock_client, SHUT_RDWR);
+            stats.drain_forced++;
+        }
+    }
+    SLIST_FOREACH(node, head, links)
+        pthread_join(node->data->thread_id, NULL);
+    stats.drain_ms = elapsed_ms(&start);
+}
+
+/* Print what the data path cost per record over the life of the server */
+static void report_stats(void)
+{
+    unsigned long records = atomic_load(&stats.records);
+    unsigned long syscalls = atomic_load(&stats.syscalls);
+    struct rusage usage;
+    double cpu_us;
+
+    if (stats.drained) {
+        printf("Drained %u connections in %.1f ms, %u cut off at the deadline\n",
+               stats.drained, stats.drain_ms, stats.drain_forced);
+        syslog(LOG_INFO, "Drained %u connections in %.1f ms, %u cut off at the deadline",
+               stats.drained, stats.drain_ms, stats.drain_forced);
+    }
+    if (admit.refused_full || admit.refused_rate || stats.oversized) {
+        printf("Refused %lu connections at the cap, %lu over the rate limit; "
+               "dropped %lu oversized records\n",
+               admit.refused_full, admit.refused_rate, atomic_load(&stats.oversized));
+        syslog(LOG_INFO, "Refused %lu connections at the cap, %lu over the rate limit; "
+               "dropped %lu oversized records",
+               admit.refused_full, admit.refused_rate, atomic_load(&stats.oversized));
+    }
+    if (atomic_load(&stats.throttled)) {
+        printf("Held back %lu times for a connection's record budget\n",
+               atomic_load(&stats.throttled));
+        syslog(LOG_INFO, "Held back %lu times for a connection's record budget",
+               atomic_load(&stats.throttled));
+    }
+    if (records == 0 || getrusage(RUSAGE_SELF, &usage))
+        return;
+    cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 +
+             usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    printf("%lu records, %.2f syscalls/record, %.2f us CPU/record\n",
+           records, (double)syscalls / records, cpu_us / records);
+    syslog(LOG_INFO, "%lu records, %.2f syscalls/record, %.2f us CPU/record",
+           records, (double)syscalls / records, cpu_us / records);
+}
+
 int main(int argc, char *argv[])
 {
     /* Assignment 6 part 1 implementation */
@@ -181,8 +552,85 @@ int main(int argc, char *argv[])
 
     openlog(NULL, 0, LOG_USER);
 
-    /* Support -d option to run as daemon */
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
+    /*
+     * -d: run as daemon
+     * -p: persistent connections, many newline-delimited records each
+     * -a: acknowledge each record by echoing it instead of the full history
+     * -s: log segment size in bytes (non-device mode)
+     * -f: log sync policy, "none", "batch" or an interval in ms (non-device mode)
+     * -T: use a thread per connection even when built with io_uring
+     * -D: ms in-flight connections get to finish on shutdown (default 2000)
+     * -c: max concurrent connections, 0 for no cap (default 1024)
+     * -r: new connections/s allowed per client address, optionally :burst
+     * -m: max record size in bytes, 0 for no cap (default 1 MB)
+     * -R: records/s each connection gets handled, optionally :burst
+     */
+    bool daemonize = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "dpaTD:c:r:m:R:s:f:")) != -1) {
+        switch (opt) {
+        case 'd': daemonize = true; break;
+        case 'p': opt_persistent = true; break;
+        case 'a': opt_ack_only = true; break;
+        case 'T': opt_threads = true; break;
+        case 'D': opt_drain_ms = strtoul(optarg, NULL, 0); break;
+        case 'c': opt_max_conns = strtoul(optarg, NULL, 0); break;
+        case 'r': {
+            char *burst;
+            opt_rate = strtod(optarg, &burst);
+            if (*burst == ':')
+                opt_burst = strtod(burst + 1, NULL);
+            break;
+        }
+        case 'm': opt_max_record = strtoul(optarg, NULL, 0); break;
+        case 'R': {
+            char *burst;
+            opt_record_rate = strtod(optarg, &burst);
+            if (*burst == ':')
+                opt_record_burst = strtod(burst + 1, NULL);
+            break;
+        }
+#if !USE_AESD_CHAR_DEVICE
+        case 's': {
+            char *end;
+            opt_segment_size = strtoul(optarg, &end, 0);
+            if (*end != '\0' || opt_segment_size == 0) {
+                fprintf(stderr, "%s: bad segment size \"%s\"\n", argv[0], optarg);
+                ret = -1;
+                goto exit_syslog;
+            }
+            break;
+        }
+        case 'f': {
+            char *end;
+            if (strcmp(optarg, "none") == 0) {
+                opt_sync = AESDLOG_SYNC_NONE;
+                break;
+            } else if (strcmp(optarg, "batch") == 0) {
+                opt_sync = AESDLOG_SYNC_BATCH;
+                break;
+            }
+            opt_sync = AESDLOG_SYNC_INTERVAL;
+            opt_sync_interval_ms = strtoul(optarg, &end, 0);
+            if (!isdigit((unsigned char)*optarg) || *end != '\0' ||
+                opt_sync_interval_ms == 0) {
+                fprintf(stderr, "%s: bad sync policy \"%s\"\n", argv[0], optarg);
+                ret = -1;
+                goto exit_syslog;
+            }
+            break;
+        }
+#endif
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-p] [-a] [-T] [-D drain_ms] [-c max_conns] "
+                    "[-r rate[:burst]] [-m max_record] [-R rate[:burst]] [-s segment_size] "
+                    "[-f none|batch|ms]\n", argv[0]);
+            ret = -1;
+            goto exit_syslog;
+        }
+    }
+
+    if (daemonize) {
         pid_t pid = fork();
         if (pid < 0) { perror("fork"); ret = -6; goto exit_socket_server; }
         if (pid > 0) _exit(0);
@@ -274,7 +722,8 @@ int main(int argc, char *argv[])
     }
 
     /* Listen for incoming connections */
-    ret = listen(socket_server, 5);
+    /* Admission is decided after accept(), so let the queue absorb bursts */
+    ret = listen(socket_server, SOMAXCONN);
     if (ret == -1) {
         printf("Failed to listen on socket\n");
         ret = -10;
@@ -287,6 +736,12 @@ int main(int argc, char *argv[])
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
+    /* SIGINT/SIGTERM are left to this thread; helper threads block them */
+    sigset_t term_signals, old_mask;
+    sigemptyset(&term_signals);
+    sigaddset(&term_signals, SIGINT);
+    sigaddset(&term_signals, SIGTERM);
+
     // Setup the thread mutex
     ret = pthread_mutex_init(&mutex, NULL);
     if (ret != 0) {
@@ -295,14 +750,60 @@ int main(int argc, char *argv[])
         goto exit_socket_server;
     }
 
+#if !USE_AESD_CHAR_DEVICE
+    /* Open the log after daemonizing: its sync thread wouldn't survive fork() */
+    pthread_sigmask(SIG_BLOCK, &term_signals, &old_mask);
+    ret = aesdlog_open(&data_log, FILE_PATH, opt_segment_size, opt_sync, opt_sync_interval_ms);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (ret != 0) {
+        printf("Failed to open data log: %s\n", strerror(-ret));
+        pthread_mutex_destroy(&mutex);
+        ret = -18;
+        goto exit_socket_server;
+    }
+#endif
+
     // Setup the linked list for threads
     struct node_head head = SLIST_HEAD_INITIALIZER(head);
     SLIST_INIT(&head);
+    aesd_admit_init(&admit, opt_max_conns, opt_rate, opt_burst);
+
+#if USE_IO_URING
+    if (!opt_threads) {
+        struct aesd_uring_config cfg = {
+            .listen_fd = socket_server,
+            .persistent = opt_persistent,
+            .ack_only = opt_ack_only,
+            .data_path = FILE_PATH,
+#if !USE_AESD_CHAR_DEVICE
+            .log = &data_log,
+#endif
+            .terminated = &is_terminated,
+            .drain_ms = opt_drain_ms,
+            .admit = &admit,
+            .max_record = opt_max_record,
+            .record_rate = opt_record_rate,
+            .record_burst = opt_record_burst,
+            .stats = &stats,
+        };
+        ret = aesd_uring_run(&cfg);
+        if (ret != -ENOSYS) {
+            if (ret != 0) {
+                printf("io_uring backend failed: %s\n", strerror(-ret));
+                ret = -19;
+            }
+            goto cleanup_threads;
+        }
+        printf("io_uring unavailable, falling back to threads\n");
+        ret = 0;
+    }
+#endif
 
     while(!is_terminated)
     {
         /* Accept a connection */
         socket_client = accept(socket_server, (struct sockaddr *)&client_addr, &client_addr_len);
+        COUNT_SYSCALLS(1);
         if (socket_client == -1) {
             if (is_terminated && (errno == EINTR || errno == EBADF)) {
                 ret = 0;
@@ -313,6 +814,14 @@ int main(int argc, char *argv[])
             goto cleanup_threads;
         }
 
+        /* Refuse over-limit clients before spending a thread on them */
+        if (aesd_admit_check(&admit, client_addr.sin_addr) != AESD_ADMIT_OK) {
+            aesd_admit_refuse(socket_client);
+            COUNT_SYSCALLS(2);
+            socket_client = -1;
+            continue;
+        }
+
         /* Create a new thread for each client connection */
         struct thread_data *data = malloc(sizeof(struct thread_data));
         if (data == NULL) {
@@ -320,11 +829,27 @@ int main(int argc, char *argv[])
             ret = -13;
             goto cleanup_threads;
         }
+        /* Acks for pipelined records are small; don't let Nagle hold them back */
+        if (opt_persistent) {
+            int nodelay = 1;
+            setsockopt(socket_client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            COUNT_SYSCALLS(1);
+        }
         data->sock_client = socket_client;
         data->file_path = FILE_PATH;
         data->mutex = &mutex;
         data->thread_complete_success = false;
+        data->persistent = opt_persistent;
+        data->ack_only = opt_ack_only;
+        atomic_init(&data->idle, false);
+        atomic_init(&data->finished, false);
+        atomic_init(&data->cut_off, false);
+        aesd_budget_init(&data->budget, opt_record_rate, opt_record_burst);
+        /* Workers inherit the mask, so SIGINT/SIGTERM always interrupt accept() here */
+        pthread_sigmask(SIG_BLOCK, &term_signals, &old_mask);
         ret = pthread_create(&data->thread_id, NULL, thread_func, data);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        COUNT_SYSCALLS(1); /* clone */
         if (ret != 0) {
             free(data);
             printf("Failed to create thread\n");
@@ -353,12 +878,12 @@ int main(int argc, char *argv[])
         node->data = data;
         SLIST_INSERT_HEAD(&head, node, links);
 
-        /* Iterate the link list and delete the node with completed thread */
+        /* Iterate the link list and delete the node of every exited thread, failed or not */
         struct thread_node *current = SLIST_FIRST(&head);
         struct thread_node *next;
         while (current != NULL) {
             next = SLIST_NEXT(current, links);
-            if (current->data->thread_complete_success) {
+            if (atomic_load(&current->data->finished)) {
                 pthread_join(current->data->thread_id, NULL);
                 free(current->data);
                 SLIST_REMOVE(&head, current, thread_node, links);
@@ -370,18 +895,26 @@ int main(int argc, char *argv[])
 
 cleanup_threads:
 {
-    /* Join and free any remaining threads and notes */
+    /* Stop accepting: new clients are refused instead of queueing unserved */
+    close(socket_server);
+    socket_server = -1;
+    drain_threads(&head);
+
+    /* Free the joined threads and nodes */
     struct thread_node *current = SLIST_FIRST(&head);
     struct thread_node *next;
     while (current != NULL) {
         next = SLIST_NEXT(current, links);
-        pthread_join(current->data->thread_id, NULL);
         free(current->data);
         SLIST_REMOVE(&head, current, thread_node, links);
         free(current);
         current = next;
     }
     pthread_mutex_destroy(&mutex);
+    report_stats();
+#if !USE_AESD_CHAR_DEVICE
+    aesdlog_close(&data_log);
+#endif
 }
 
     if (file) fclose(file);
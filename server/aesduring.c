@@ -0,0 +1,894 @@
+/*
+ * aesduring.c -- io_uring execution backend for aesdsocket
+ *
+ * The ring is driven with the raw system calls so the build doesn't
+ * depend on liburing. Each connection is a small state machine advanced
+ * from completions:
+ *
+ *   recv (multishot) -> complete records -> write (linked) -> send echo
+ *
+ * In history mode the echo is the whole device, read back in chunks and
+ * sent one after the other; with a log backend (non-device mode) records
+ * are appended in memory and the echo is sent straight from the log.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesdadmit.h"
+#include "aesdlog.h"
+#include "aesduring.h"
+
+#define URING_ENTRIES   256
+#define URING_BUFFERS   256     /* provided recv buffers, power of two */
+#define URING_BUF_SIZE  4096
+#define URING_BGID      0
+#define HISTORY_SIZE    16384   /* device read-back per history chunk */
+#define URING_BACKLOG   (64 * URING_BUF_SIZE) /* input held while busy before recv pauses */
+#define THROTTLE_NS     10000000ULL /* longest wait for a spent record budget */
+
+/* Operation tag kept in the low bits of user_data next to the connection */
+enum uring_op {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_WRITE,
+    OP_SEND,
+    OP_READ,
+    OP_CANCEL,
+    OP_THROTTLE,
+};
+#define OP_MASK 7UL
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned sq_local_tail;         /* SQEs handed out so far */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;                     /* SQ and CQ rings share one mapping */
+    size_t ring_size, sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    char *bufs;
+};
+
+struct uring_conn {
+    int fd;
+    unsigned inflight;              /* SQEs whose final CQE hasn't arrived */
+    bool closing;                   /* socket shut down, free once idle */
+    bool peer_closed;               /* recv saw EOF */
+    bool busy;                      /* a batch is being stored and echoed */
+    bool recv_armed;                /* the multishot recv is still running */
+    bool recv_paused;               /* backlog full: recv stopped until the batch is done */
+    struct aesd_budget budget;      /* records/s this connection may have handled */
+    struct __kernel_timespec throttle_ts; /* wait for budget, busy until it fires */
+    char *in;                       /* received bytes, may end mid-record */
+    size_t in_len, in_size;
+    size_t partial_len;             /* bytes since the last newline received */
+    char *batch;                    /* complete records being handled */
+    size_t batch_len;
+    size_t record_off, record_len;  /* record within the batch */
+    const char *send_buf;           /* buffer of the current send */
+    size_t send_len, send_off;
+    uint64_t hist_off, hist_end;    /* history echo progress */
+    char *hist_buf;                 /* device mode read-back chunk */
+    LIST_ENTRY(uring_conn) links;
+};
+LIST_HEAD(conn_head, uring_conn);
+
+struct uring_server {
+    const struct aesd_uring_config *cfg;
+    struct uring ring;
+    int data_wfd, data_rfd;         /* device mode only */
+    struct conn_head conns;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void count_syscall(struct uring_server *srv)
+{
+    atomic_fetch_add_explicit(&srv->cfg->stats->syscalls, 1, memory_order_relaxed);
+}
+
+/* Multishot recv arrived in 6.0; older kernels take the threaded path */
+static bool uring_kernel_supported(void)
+{
+    struct utsname u;
+    int major = 0, minor = 0;
+
+    if (uname(&u) || sscanf(u.release, "%d.%d", &major, &minor) != 2)
+        return false;
+    return major >= 6;
+}
+
+/* Hand buffer "bid" back to the kernel for the next recv */
+static void uring_recycle_buffer(struct uring *r, unsigned short bid)
+{
+    struct io_uring_buf *buf = &r->buf_ring->bufs[r->buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_exit(struct uring *r)
+{
+    /*
+     * Ring teardown after close() is deferred to a kernel worker, which
+     * would keep the listening socket referenced for a moment after we
+     * return. Cancel everything synchronously first so a restarted server
+     * can bind the port straight away.
+     */
+    if (r->fd >= 0) {
+        struct io_uring_sync_cancel_reg cancel;
+
+        memset(&cancel, 0, sizeof(cancel));
+        cancel.fd = -1;
+        cancel.flags = IORING_ASYNC_CANCEL_ANY;
+        cancel.timeout.tv_sec = -1;
+        cancel.timeout.tv_nsec = -1;
+        sys_io_uring_register(r->fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+        close(r->fd);
+    }
+    if (r->ring)
+        munmap(r->ring, r->ring_size);
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->buf_ring)
+        munmap(r->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(r->bufs);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int uring_init(struct uring *r)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned *sq_array;
+    void *map;
+    unsigned i;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (r->fd < 0)
+        return -ENOSYS;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG))
+        goto unsupported;
+
+    r->entries = p.sq_entries;
+    r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (r->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    map = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               r->fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+        goto unsupported;
+    r->ring = map;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               r->fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+        goto unsupported;
+    r->sqes = map;
+
+    r->sq_head = (unsigned *)((char *)r->ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->ring + p.sq_off.ring_mask);
+    r->sq_local_tail = *r->sq_tail;
+    sq_array = (unsigned *)((char *)r->ring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++)
+        sq_array[i] = i; /* SQE slots are used in ring order */
+    r->cq_head = (unsigned *)((char *)r->ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->ring + p.cq_off.cqes);
+
+    /* Provided buffers for multishot recv (5.19+) */
+    map = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        goto unsupported;
+    r->buf_ring = map;
+    r->bufs = malloc((size_t)URING_BUFFERS * URING_BUF_SIZE);
+    if (!r->bufs)
+        goto unsupported;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)r->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto unsupported;
+    for (i = 0; i < URING_BUFFERS; i++)
+        uring_recycle_buffer(r, i);
+    return 0;
+
+unsupported:
+    uring_exit(r);
+    return -ENOSYS;
+}
+
+/*
+ * Tell the kernel about new SQEs and optionally wait for a completion,
+ * for at most timeout_ms if that isn't 0
+ */
+static int uring_submit(struct uring_server *srv, unsigned wait_nr, unsigned timeout_ms)
+{
+    struct uring *r = &srv->ring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit, flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (wait_nr && timeout_ms) {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = (uintptr_t)&ts;
+        ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG,
+                                 &arg, sizeof(arg));
+    } else {
+        ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags, NULL, 0);
+    }
+    count_syscall(srv);
+    return ret < 0 ? -errno : ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_server *srv)
+{
+    struct uring *r = &srv->ring;
+    struct io_uring_sqe *sqe;
+
+    if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+        /* Full: without SQPOLL the kernel consumes everything we submit */
+        uring_submit(srv, 0, 0);
+        if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+            return NULL;
+    }
+    sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local_tail++;
+    return sqe;
+}
+
+static struct io_uring_sqe *uring_prep(struct uring_server *srv, int opcode, int fd,
+                                       const void *addr, unsigned len, uint64_t off,
+                                       struct uring_conn *conn, enum uring_op op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(srv);
+
+    if (!sqe)
+        return NULL;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)conn | op;
+    if (conn)
+        conn->inflight++;
+    return sqe;
+}
+
+static int queue_accept(struct uring_server *srv)
+{
+    struct io_uring_sqe *sqe = uring_prep(srv, IORING_OP_ACCEPT, srv->cfg->listen_fd,
+                                          NULL, 0, 0, NULL, OP_ACCEPT);
+    if (!sqe)
+        return -1;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    return 0;
+}
+
+static int queue_recv(struct uring_server *srv, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_prep(srv, IORING_OP_RECV, conn->fd, NULL, 0, 0,
+                                          conn, OP_RECV);
+    if (!sqe)
+        return -1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    conn->recv_armed = true;
+    return 0;
+}
+
+static int queue_send(struct uring_server *srv, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_prep(srv, IORING_OP_SEND, conn->fd,
+                                          conn->send_buf + conn->send_off,
+                                          conn->send_len - conn->send_off, 0, conn, OP_SEND);
+    if (!sqe)
+        return -1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+static void conn_close(struct uring_server *srv, struct uring_conn *conn)
+{
+    if (conn->closing)
+        return;
+    conn->closing = true;
+    /* Wakes the multishot recv with a final completion */
+    shutdown(conn->fd, SHUT_RDWR);
+    count_syscall(srv);
+}
+
+/*
+ * Multishot recv keeps filling "in" for as long as the peer sends, even
+ * while the connection is busy sending echoes. A client that pipelines
+ * and never reads would grow it without bound, so once it holds
+ * URING_BACKLOG bytes the recv is cancelled, and it is re-armed from
+ * conn_pump() when the connection is free to work through its backlog.
+ */
+static void conn_pause_recv(struct uring_server *srv, struct uring_conn *conn)
+{
+    if (!conn->busy || conn->in_len < URING_BACKLOG || conn->recv_paused || conn->closing)
+        return;
+    conn->recv_paused = true;
+    if (conn->recv_armed &&
+        !uring_prep(srv, IORING_OP_ASYNC_CANCEL, -1,
+                    (void *)((uintptr_t)conn | OP_RECV), 0, 0, conn, OP_CANCEL))
+        conn_close(srv, conn);
+}
+
+static void conn_resume_recv(struct uring_server *srv, struct uring_conn *conn)
+{
+    /* The cancelled recv must have finished before a new one goes in */
+    if (!conn->recv_paused || conn->recv_armed || conn->closing)
+        return;
+    conn->recv_paused = false;
+    if (queue_recv(srv, conn))
+        conn_close(srv, conn);
+}
+
+/*
+ * Out of record budget: sit busy until some is back, so the backlog
+ * pauses recv and TCP flow control holds the client back. The wait is
+ * capped, a close or drain doesn't have to outlast a long one.
+ */
+static void conn_throttle(struct uring_server *srv, struct uring_conn *conn, uint64_t wait_ns)
+{
+    if (wait_ns > THROTTLE_NS)
+        wait_ns = THROTTLE_NS;
+    conn->throttle_ts.tv_sec = wait_ns / 1000000000ULL;
+    conn->throttle_ts.tv_nsec = wait_ns % 1000000000ULL;
+    if (!uring_prep(srv, IORING_OP_TIMEOUT, -1, &conn->throttle_ts, 1, 0, conn, OP_THROTTLE)) {
+        conn_close(srv, conn);
+        return;
+    }
+    conn->busy = true;
+    atomic_fetch_add_explicit(&srv->cfg->stats->throttled, 1, memory_order_relaxed);
+}
+
+static void conn_free(struct uring_server *srv, struct uring_conn *conn)
+{
+    LIST_REMOVE(conn, links);
+    close(conn->fd);
+    count_syscall(srv);
+    aesd_admit_release(srv->cfg->admit);
+    free(conn->in);
+    free(conn->batch);
+    free(conn->hist_buf);
+    free(conn);
+}
+
+static void conn_record_done(struct uring_server *srv, struct uring_conn *conn);
+static void conn_pump(struct uring_server *srv, struct uring_conn *conn);
+
+/* Send the next chunk of history, or finish the record when it's all out */
+static void conn_send_history(struct uring_server *srv, struct uring_conn *conn)
+{
+    const struct aesd_uring_config *cfg = srv->cfg;
+
+    if (cfg->log) {
+        size_t len;
+
+        if (conn->hist_off >= conn->hist_end) {
+            conn_record_done(srv, conn);
+            return;
+        }
+        conn->send_buf = aesdlog_peek(cfg->log, conn->hist_off, conn->hist_end, &len);
+        if (!conn->send_buf) {
+            conn_close(srv, conn);
+            return;
+        }
+        conn->send_len = len;
+        conn->send_off = 0;
+        if (queue_send(srv, conn))
+            conn_close(srv, conn);
+        return;
+    }
+
+    if (!uring_prep(srv, IORING_OP_READ, srv->data_rfd, conn->hist_buf, HISTORY_SIZE,
+                    conn->hist_off, conn, OP_READ))
+        conn_close(srv, conn);
+}
+
+/* Store the current record and start its echo */
+static void conn_store(struct uring_server *srv, struct uring_conn *conn)
+{
+    const struct aesd_uring_config *cfg = srv->cfg;
+    const char *record = conn->batch + conn->record_off;
+    struct io_uring_sqe *sqe;
+
+    conn->hist_off = 0;
+    if (cfg->log) {
+        if (aesdlog_append(cfg->log, record, conn->record_len)) {
+            conn_close(srv, conn);
+            return;
+        }
+        conn->hist_end = aesdlog_size(cfg->log);
+    } else {
+        /* Linked so the echo can't overtake the write it reports */
+        sqe = uring_prep(srv, IORING_OP_WRITE, srv->data_wfd, record, conn->record_len,
+                         (uint64_t)-1, conn, OP_WRITE);
+        if (!sqe) {
+            conn_close(srv, conn);
+            return;
+        }
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+
+    if (cfg->ack_only) {
+        conn->send_buf = record;
+        conn->send_len = conn->record_len;
+        conn->send_off = 0;
+        if (queue_send(srv, conn))
+            conn_close(srv, conn);
+        return;
+    }
+    conn_send_history(srv, conn);
+}
+
+static void conn_record_done(struct uring_server *srv, struct uring_conn *conn)
+{
+    conn->record_off += conn->record_len;
+    if (conn->record_off < conn->batch_len) {
+        /* Persistent history mode: one record at a time, each with its echo */
+        const char *record = conn->batch + conn->record_off;
+        const char *newline = memchr(record, '\n', conn->batch_len - conn->record_off);
+
+        conn->record_len = newline ? (size_t)(newline - record) + 1
+                                   : conn->batch_len - conn->record_off;
+        conn_store(srv, conn);
+        return;
+    }
+
+    free(conn->batch);
+    conn->batch = NULL;
+    conn->busy = false;
+    if (!srv->cfg->persistent) {
+        conn_close(srv, conn);
+        return;
+    }
+    conn_pump(srv, conn);
+}
+
+/* If the connection is idle, start on whatever complete records it holds */
+static void conn_pump(struct uring_server *srv, struct uring_conn *conn)
+{
+    const struct aesd_uring_config *cfg = srv->cfg;
+    size_t complete = 0, i, records = 0;
+
+    if (conn->busy || conn->closing)
+        return;
+
+    if (cfg->persistent) {
+        char *newline = memrchr(conn->in, '\n', conn->in_len);
+        if (newline)
+            complete = newline - conn->in + 1;
+    } else if (conn->in_len && conn->in[conn->in_len - 1] == '\n') {
+        complete = conn->in_len;
+    } else if (conn->peer_closed) {
+        /* A single-shot client that closed without a final newline still gets its echo */
+        complete = conn->in_len;
+    }
+    if (complete && cfg->record_rate > 0) {
+        /* Keep recv paused while waiting, the budget is what's holding us up */
+        unsigned long want = 0, granted;
+        uint64_t wait_ns = 0;
+
+        if (cfg->persistent)
+            for (i = 0; i < complete; i++)
+                if (conn->in[i] == '\n')
+                    want++;
+        if (want == 0)
+            want = 1;
+        granted = aesd_budget_take(&conn->budget, want, &wait_ns);
+        if (granted == 0) {
+            conn_throttle(srv, conn, wait_ns);
+            return;
+        }
+        if (granted < want)
+            complete = aesd_budget_span(conn->in, complete, granted);
+    }
+    conn_resume_recv(srv, conn);
+    if (conn->closing)
+        return;
+    if (complete == 0) {
+        /* While draining, a connection with nothing left to do is done */
+        if (conn->peer_closed || (*cfg->terminated && conn->in_len == 0))
+            conn_close(srv, conn);
+        return;
+    }
+
+    conn->batch = malloc(complete);
+    if (!conn->batch) {
+        conn_close(srv, conn);
+        return;
+    }
+    memcpy(conn->batch, conn->in, complete);
+    memmove(conn->in, conn->in + complete, conn->in_len - complete);
+    conn->in_len -= complete;
+    conn->batch_len = complete;
+    conn->busy = true;
+
+    for (i = 0; i < complete; i++)
+        if (conn->batch[i] == '\n')
+            records++;
+    atomic_fetch_add_explicit(&cfg->stats->records, records ? records : 1,
+                              memory_order_relaxed);
+
+    conn->record_off = 0;
+    conn->record_len = complete;
+    if (cfg->persistent && !cfg->ack_only)
+        conn->record_len = (char *)memchr(conn->batch, '\n', complete) - conn->batch + 1;
+    conn_store(srv, conn);
+}
+
+/*
+ * Check the records in newly received bytes against the size cap. A
+ * single-shot connection's whole request counts as one record.
+ */
+static bool conn_oversized(struct uring_server *srv, struct uring_conn *conn,
+                           const char *buf, size_t len)
+{
+    const struct aesd_uring_config *cfg = srv->cfg;
+    const char *end = buf + len, *newline;
+
+    if (!cfg->max_record)
+        return false;
+    if (cfg->persistent) {
+        while ((newline = memchr(buf, '\n', end - buf)) != NULL) {
+            conn->partial_len += newline - buf + 1;
+            if (conn->partial_len > cfg->max_record)
+                goto oversized;
+            conn->partial_len = 0;
+            buf = newline + 1;
+        }
+    }
+    conn->partial_len += end - buf;
+    if (conn->partial_len <= cfg->max_record)
+        return false;
+oversized:
+    atomic_fetch_add_explicit(&cfg->stats->oversized, 1, memory_order_relaxed);
+    syslog(LOG_WARNING, "Record over %zu bytes, closing connection", cfg->max_record);
+    return true;
+}
+
+static int conn_append(struct uring_conn *conn, const char *buf, size_t len)
+{
+    if (conn->in_size - conn->in_len < len) {
+        size_t new_size = conn->in_size ? conn->in_size : URING_BUF_SIZE;
+        char *new_in;
+
+        while (new_size - conn->in_len < len)
+            new_size *= 2;
+        new_in = realloc(conn->in, new_size);
+        if (!new_in)
+            return -1;
+        conn->in = new_in;
+        conn->in_size = new_size;
+    }
+    memcpy(conn->in + conn->in_len, buf, len);
+    conn->in_len += len;
+    return 0;
+}
+
+static void handle_accept(struct uring_server *srv, struct io_uring_cqe *cqe)
+{
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    struct uring_conn *conn;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !*srv->cfg->terminated)
+        queue_accept(srv); /* multishot accept was dropped, re-arm it */
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED && !*srv->cfg->terminated)
+            printf("Failed to accept connection: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    memset(&client_addr, 0, sizeof(client_addr));
+    getpeername(cqe->res, (struct sockaddr *)&client_addr, &client_addr_len);
+    count_syscall(srv);
+    /* Refuse over-limit clients before allocating anything for them */
+    if (aesd_admit_check(srv->cfg->admit, client_addr.sin_addr) != AESD_ADMIT_OK) {
+        aesd_admit_refuse(cqe->res);
+        /* setsockopt + close */
+        atomic_fetch_add_explicit(&srv->cfg->stats->syscalls, 2, memory_order_relaxed);
+        return;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn && !srv->cfg->ack_only && !srv->cfg->log)
+        conn->hist_buf = malloc(HISTORY_SIZE);
+    if (!conn || (!srv->cfg->ack_only && !srv->cfg->log && !conn->hist_buf)) {
+        printf("Failed to allocate memory for connection\n");
+        free(conn);
+        close(cqe->res);
+        aesd_admit_release(srv->cfg->admit);
+        return;
+    }
+    conn->fd = cqe->res;
+    aesd_budget_init(&conn->budget, srv->cfg->record_rate, srv->cfg->record_burst);
+    LIST_INSERT_HEAD(&srv->conns, conn, links);
+
+    printf("Accepted connection from %s\n", inet_ntoa(client_addr.sin_addr));
+    syslog(LOG_INFO, "Accepted connection from %s\n", inet_ntoa(client_addr.sin_addr));
+    count_syscall(srv);
+    if (srv->cfg->persistent) {
+        int nodelay = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        count_syscall(srv);
+    }
+    if (queue_recv(srv, conn)) {
+        conn_close(srv, conn);
+        conn_free(srv, conn);
+    }
+}
+
+static void handle_recv(struct uring_server *srv, struct uring_conn *conn,
+                        struct io_uring_cqe *cqe)
+{
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (!more)
+        conn->recv_armed = false;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        const char *data = srv->ring.bufs + (size_t)bid * URING_BUF_SIZE;
+
+        if (cqe->res > 0 && !conn->closing &&
+            (conn_oversized(srv, conn, data, cqe->res) || conn_append(conn, data, cqe->res)))
+            conn_close(srv, conn);
+        uring_recycle_buffer(&srv->ring, bid);
+    }
+
+    if (cqe->res == 0) {
+        conn->peer_closed = true;
+    } else if (conn->recv_paused) {
+        /* Stopped on purpose (or about to be): conn_pump() re-arms it */
+        if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            conn_close(srv, conn);
+            return;
+        }
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        conn_close(srv, conn);
+        return;
+    } else if (!more && !conn->closing && queue_recv(srv, conn)) {
+        conn_close(srv, conn);
+        return;
+    }
+    conn_pump(srv, conn);
+    conn_pause_recv(srv, conn);
+}
+
+static void handle_cqe(struct uring_server *srv, struct io_uring_cqe *cqe)
+{
+    struct uring_conn *conn = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    enum uring_op op = cqe->user_data & OP_MASK;
+
+    if (op == OP_ACCEPT) {
+        handle_accept(srv, cqe);
+        return;
+    }
+    if (op != OP_RECV || !(cqe->flags & IORING_CQE_F_MORE))
+        conn->inflight--;
+
+    switch (op) {
+    case OP_RECV:
+        handle_recv(srv, conn, cqe);
+        break;
+
+    case OP_WRITE:
+        /* A short write fails the link, so the echo sees -ECANCELED */
+        if (cqe->res != (int)conn->record_len)
+            conn_close(srv, conn);
+        break;
+
+    case OP_READ:
+        if (cqe->res < 0 || conn->closing) {
+            conn_close(srv, conn);
+        } else if (cqe->res == 0) {
+            conn_record_done(srv, conn);
+        } else {
+            conn->send_buf = conn->hist_buf;
+            conn->send_len = cqe->res;
+            conn->send_off = 0;
+            if (queue_send(srv, conn))
+                conn_close(srv, conn);
+        }
+        break;
+
+    case OP_SEND:
+        if (cqe->res < 0 || conn->closing) {
+            conn_close(srv, conn);
+            break;
+        }
+        conn->send_off += cqe->res;
+        if (conn->send_off < conn->send_len) {
+            if (queue_send(srv, conn))
+                conn_close(srv, conn);
+        } else if (srv->cfg->ack_only) {
+            conn_record_done(srv, conn);
+        } else {
+            conn->hist_off += conn->send_len;
+            conn_send_history(srv, conn);
+        }
+        break;
+
+    case OP_THROTTLE:
+        /* -ETIME is the timer running out, the usual way for it to end */
+        conn->busy = false;
+        conn_pump(srv, conn);
+        conn_pause_recv(srv, conn);
+        break;
+
+    default:
+        break;
+    }
+
+    if (conn->closing && conn->inflight == 0)
+        conn_free(srv, conn);
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Start a shutdown drain: stop accepting and close the connections that
+ * sit idle between records. Busy ones close themselves from conn_pump()
+ * once they run out of complete records.
+ */
+static void uring_drain_start(struct uring_server *srv)
+{
+    struct uring_conn *conn;
+
+    /* Fails the multishot accept, which isn't re-armed while terminating */
+    shutdown(srv->cfg->listen_fd, SHUT_RD);
+    count_syscall(srv);
+    LIST_FOREACH(conn, &srv->conns, links) {
+        srv->cfg->stats->drained++;
+        if (!conn->busy && conn->in_len == 0)
+            conn_close(srv, conn);
+    }
+}
+
+int aesd_uring_run(const struct aesd_uring_config *cfg)
+{
+    struct uring_server srv;
+    struct uring_conn *conn;
+    struct timespec drain_start;
+    bool draining = false;
+    int ret;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.cfg = cfg;
+    srv.data_wfd = srv.data_rfd = -1;
+    LIST_INIT(&srv.conns);
+
+    if (!uring_kernel_supported() || uring_init(&srv.ring))
+        return -ENOSYS;
+
+    if (!cfg->log) {
+        srv.data_wfd = open(cfg->data_path, O_WRONLY | O_APPEND);
+        srv.data_rfd = open(cfg->data_path, O_RDONLY);
+        if (srv.data_wfd < 0 || srv.data_rfd < 0) {
+            ret = -errno;
+            printf("Failed to open %s\n", cfg->data_path);
+            goto out;
+        }
+    }
+
+    if (queue_accept(&srv)) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    ret = 0;
+    while (!draining || !LIST_EMPTY(&srv.conns)) {
+        struct uring *r = &srv.ring;
+        unsigned head, tail;
+
+        if (*cfg->terminated && !draining) {
+            draining = true;
+            clock_gettime(CLOCK_MONOTONIC, &drain_start);
+            uring_drain_start(&srv);
+            continue;
+        }
+        if (draining && elapsed_ms(&drain_start) >= cfg->drain_ms) {
+            /* Out of time: anything still open is cut off by the teardown */
+            LIST_FOREACH(conn, &srv.conns, links)
+                if (!conn->closing)
+                    cfg->stats->drain_forced++;
+            break;
+        }
+
+        /* Wake up now and then while draining to check the deadline */
+        ret = uring_submit(&srv, 1, draining ? 10 : 0);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY && ret != -ETIME) {
+            printf("io_uring_enter failed: %s\n", strerror(-ret));
+            break;
+        }
+        ret = 0;
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_cqe(&srv, &r->cqes[head & *r->cq_mask]);
+            head++;
+            /* Completions can be reaped again once handed back */
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    if (draining)
+        cfg->stats->drain_ms = elapsed_ms(&drain_start);
+
+out:
+    /* Tear the ring down first so nothing lands in memory we free below */
+    uring_exit(&srv.ring);
+    while ((conn = LIST_FIRST(&srv.conns)) != NULL)
+        conn_free(&srv, conn);
+    if (srv.data_wfd >= 0)
+        close(srv.data_wfd);
+    if (srv.data_rfd >= 0)
+        close(srv.data_rfd);
+    return ret;
+}
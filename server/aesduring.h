@@ -0,0 +1,55 @@
+/*
+ * aesduring.h -- io_uring execution backend for aesdsocket
+ *
+ * Built when USE_IO_URING=1. One thread drives a single ring: a
+ * multishot accept feeds connections, each connection has a multishot
+ * recv drawing from a provided buffer ring, and complete records are
+ * written to the device linked to the send of their echo. The protocol
+ * is the same as the threaded path in aesdsocket.c.
+ */
+
+#ifndef AESDURING_H
+#define AESDURING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct aesd_admit;
+struct aesdlog;
+
+/* Data-path counters shared by both backends, reported on shutdown */
+struct aesd_stats {
+    atomic_ulong records;
+    atomic_ulong syscalls;
+    atomic_ulong oversized;     /* connections dropped for a record over the cap */
+    atomic_ulong throttled;     /* waits for a connection's record budget */
+    /* Shutdown drain, filled in by whichever backend served the clients */
+    unsigned int drained;       /* connections open when shutdown started */
+    unsigned int drain_forced;  /* still busy at the deadline */
+    double drain_ms;
+};
+
+struct aesd_uring_config {
+    int listen_fd;
+    bool persistent;            /* -p */
+    bool ack_only;              /* -a */
+    const char *data_path;      /* device written through the ring */
+    struct aesdlog *log;        /* non-device mode: log instead of data_path */
+    volatile bool *terminated;
+    unsigned int drain_ms;      /* deadline for in-flight connections on shutdown */
+    struct aesd_admit *admit;   /* consulted on every accept */
+    size_t max_record;          /* 0: no cap */
+    double record_rate;         /* records/s per connection, 0: no limit */
+    double record_burst;
+    struct aesd_stats *stats;
+};
+
+/*
+ * Serve connections until *terminated is set, then give the open ones up
+ * to drain_ms to finish the records they are on. Returns -ENOSYS before
+ * accepting anything if the kernel lacks the io_uring features we need,
+ * in which case the caller falls back to the threaded path.
+ */
+int aesd_uring_run(const struct aesd_uring_config *cfg);
+
+#endif /* AESDURING_H */
@@ -0,0 +1,93 @@
+#!/bin/bash
+# Checks that -R throttles a single persistent connection: it pipelines
+# records as fast as it can and must still get its echoes no faster than
+# the per-connection record budget allows. Extra arguments go to make,
+# e.g. USE_IO_URING=1 to test the io_uring backend; a leading -T is
+# passed to the server instead, for the thread backend of that build.
+#
+#	./throttle-test.sh [-T] [make args...]
+
+set -e
+set -u
+
+cd "$(dirname "$0")"
+
+PORT=9000
+RECORDS=45
+RATE=20
+BURST=5
+# 40 records past the burst at 20/s take 2 s; leave some slack
+MIN_MS=1700
+MAX_MS_UNTHROTTLED=1000
+
+SERVER_OPTS=
+if [ $# -gt 0 ] && [ "$1" = "-T" ]; then
+	SERVER_OPTS=-T
+	shift
+fi
+
+make USE_AESD_CHAR_DEVICE=0 "$@" >/dev/null
+
+server_pid=
+cleanup() {
+	if [ -n "${server_pid}" ]; then
+		kill -INT "${server_pid}" 2>/dev/null || true
+		wait "${server_pid}" 2>/dev/null || true
+	fi
+	server_pid=
+}
+trap cleanup EXIT
+
+# Start the server with the given options, wait for the port to open
+start_server() {
+	./aesdsocket -p -a ${SERVER_OPTS} "$@" >/dev/null &
+	server_pid=$!
+	for i in $(seq 50); do
+		if (exec 3<>/dev/tcp/127.0.0.1/${PORT}) 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "aesdsocket didn't start listening on port ${PORT}"
+	exit 1
+}
+
+# Send RECORDS records down one connection, print ms until all are echoed
+run_client() {
+	local start end line i
+
+	start=$(date +%s%N)
+	exec 3<>/dev/tcp/127.0.0.1/${PORT}
+	for i in $(seq ${RECORDS}); do
+		printf 'record %d\n' "${i}" >&3
+	done
+	for i in $(seq ${RECORDS}); do
+		if ! read -r -t 10 line <&3 || [ "${line}" != "record ${i}" ]; then
+			echo "echo ${i} missing or wrong: '${line:-}'" >&2
+			exit 1
+		fi
+	done
+	exec 3<&-
+	end=$(date +%s%N)
+	echo $(( (end - start) / 1000000 ))
+}
+
+start_server
+ms=$(run_client)
+cleanup
+echo "unthrottled: ${RECORDS} records in ${ms} ms"
+if [ "${ms}" -ge ${MAX_MS_UNTHROTTLED} ]; then
+	echo "failed: the unthrottled run should take under ${MAX_MS_UNTHROTTLED} ms"
+	exit 1
+fi
+
+start_server -R ${RATE}:${BURST}
+ms=$(run_client)
+cleanup
+echo "-R ${RATE}:${BURST}: ${RECORDS} records in ${ms} ms"
+if [ "${ms}" -lt ${MIN_MS} ]; then
+	echo "failed: the connection wasn't held to ${RATE} records/s"
+	exit 1
+fi
+
+echo "success"